@@ -14,9 +14,36 @@
  */
 
 #include <sys/time.h>
+#include <stdint.h>
 #include "queues.h"
 
 
+/*  *********************************************************************
+    *  Show time
+    ********************************************************************* */
+
+//
+// Times are kept in integer nanoseconds from the start of the show,
+// so events meant to happen together compare equal no matter how
+// their times were worked out.  Seconds as doubles only show up at
+// the edges: printing, the music player and the beat grid.
+//
+
+typedef int64_t lstime_t;
+
+#define LSTIME_SECOND   1000000000LL
+#define LSTIME_MS       1000000LL
+#define LSTIME_SECS(t)  ((double) (t) / (double) LSTIME_SECOND)
+#define LSTIME_FROMSECS(s) ((lstime_t) ((s) * (double) LSTIME_SECOND + (((s) < 0) ? -0.5 : 0.5)))
+
+lstime_t parsetime(const char *str);
+lstime_t current_ticks(void);
+lstime_t clock_now(void);
+void clock_wait(lstime_t deadline);
+int clock_is_virtual(void);
+void clock_use_virtual(int on);
+
+
 /*  *********************************************************************
     *  Parser-related
     ********************************************************************* */
@@ -50,7 +77,10 @@ enum {
     sMUSIC,
     sIDLE,
     sDEFINE,
-    sMACRO
+    sMACRO,
+    sINCLUDE,
+    sREPEAT,
+    sATBEAT
 };
     
 
@@ -64,20 +94,29 @@ typedef struct node_s {
 
 
 
+//
+// A statement list while it is being parsed, so we can append to it.
+//
+typedef struct nodelist_s {
+    node_t *head;
+    node_t *tail;
+} nodelist_t;
+
 typedef struct option_s {
     int type;
     int line;
     int opttype;
     struct node_s *lvalue;
     int wvalue;
-    double fvalue;
+    lstime_t tvalue;
 } option_t;
 
 typedef struct scriptcmd_s {
     int type;
     int line;
     int cmdtype;
-    double from,to;
+    lstime_t from,to;
+    lstime_t every;             // repeat interval
     struct node_s *options;
     char *str;
     int val;
@@ -91,22 +130,37 @@ typedef struct idlist_s {
     char *idstr;
 } idlist_t;
 
-node_t *newnode(node_t *l, node_t *r);
-node_t *newidlist(char *idstr, node_t *rest);
-node_t *newoption_idl(int opttype, node_t *optval);
-node_t *newoption_w(int opttype, int w);
-node_t *newoption_f(int opttype, double f);
-node_t *newcmd_sched(int cmdtype, double from, double to, node_t *opts);
-node_t *newcmd_str(int cmdtype, char *str);
-node_t *newcmd_defval(char *str, int val);
-node_t *newcmd_defidl(char *str, node_t *idl);
-node_t *newcmd_defmacro(char *str, node_t *idl);
-
-
-void yyerror(char  *str,...);
-extern int yylex();
+//
+// Everything one parse needs.  Each file gets its own, along with
+// its own scanner, so files can be parsed on several threads at once.
+//
 
-extern node_t *tree;
+typedef struct lsparse_s {
+    char *filename;             // for error messages
+    void *scanner;              // flex yyscan_t
+    node_t *tree;               // result
+    int errors;
+    int tokens;                 // for --stats
+    int nodes;
+} lsparse_t;
+
+node_t *newnode(lsparse_t *ps, node_t *l, node_t *r);
+node_t *newidlist(lsparse_t *ps, char *idstr, node_t *rest);
+node_t *newoption_idl(lsparse_t *ps, int opttype, node_t *optval);
+node_t *newoption_w(lsparse_t *ps, int opttype, int w);
+node_t *newoption_t(lsparse_t *ps, int opttype, lstime_t t);
+node_t *newcmd_sched(lsparse_t *ps, int cmdtype, lstime_t from, lstime_t to, node_t *opts);
+node_t *newcmd_str(lsparse_t *ps, int cmdtype, char *str);
+node_t *newcmd_defval(lsparse_t *ps, char *str, int val);
+node_t *newcmd_defidl(lsparse_t *ps, char *str, node_t *idl);
+node_t *newcmd_defmacro(lsparse_t *ps, char *str, node_t *idl);
+node_t *newcmd_repeat(lsparse_t *ps, node_t *body, lstime_t every, lstime_t from, lstime_t until);
+node_t *newcmd_beat(lsparse_t *ps, int beat, node_t *opts);
+char *includepath(lsparse_t *ps, char *str);
+void freetree(node_t *n);
+
+int parse_file(lsparse_t *ps, char *filename);
+node_t *parse_buffer(lsparse_t *ps, const char *buf, int len);
 
 
 /*  *********************************************************************
@@ -122,6 +176,7 @@ extern node_t *tree;
 //
 
 #define MAXVALUES 256
+#define MAXSTRIPS 31
 
 typedef struct symbol_s {
     dqueue_t link;
@@ -131,6 +186,52 @@ typedef struct symbol_s {
     void *pvalue;
 } symbol_t;
 
+/*  *********************************************************************
+    *  Arduino protocol
+    ********************************************************************* */
+
+typedef struct __attribute__((packed)) lsmessage_s {
+    uint8_t     ls_sync[2];
+    uint16_t    ls_reserved;
+    uint16_t    ls_anim;
+    uint16_t    ls_speed;
+    uint16_t    ls_option;
+    uint32_t    ls_color;
+    uint32_t    ls_strips;
+} lsmessage_t;
+
+//
+// ls_reserved flags.  A ping asks the controller to answer with an
+// ack that echoes ls_option and says in ls_color how many
+// microseconds it takes to get a frame onto the strips.
+//
+#define LSFLAG_PING     0x0001
+#define LSFLAG_ACK      0x0002
+
+//
+// Frames due at the same time go out as a group: every frame but
+// the last has HOLD set, and the controller keeps them until the
+// last one comes, then changes all the strips at once.  A single
+// frame never has it, and controllers that don't know the flag
+// just apply each frame as it comes, as they always have.
+//
+#define LSFLAG_HOLD     0x0004
+
+//
+// Network controllers get one datagram per dispatch: this header
+// and then lu_count frames.
+//
+#define LSUDP_VERSION   1
+
+typedef struct __attribute__((packed)) lsudphdr_s {
+    uint8_t     lu_magic[2];    // 'L' 'S'
+    uint8_t     lu_version;
+    uint8_t     lu_count;
+    uint32_t    lu_seq;         // counts datagrams, so loss can be seen
+} lsudphdr_t;
+
+typedef struct lssink_s lssink_t;
+
 /*  *********************************************************************
     *  Script
     ********************************************************************* */
@@ -154,13 +255,13 @@ typedef struct command_s {
     unsigned int palette;
     unsigned int direction;
     unsigned int option;
-    double delay;
-    double from, to;
+    lstime_t delay;
+    lstime_t from, to;
 } command_t;
 
 typedef struct schedcmd_s {
     dqueue_t link;
-    double time;
+    lstime_t time;
     unsigned int stripmask;
     unsigned int animation;
     unsigned int speed;
@@ -170,12 +271,93 @@ typedef struct schedcmd_s {
     unsigned int option;
 } schedcmd_t;
 
+//
+// The finished schedule.  Commands are generated and optimized as
+// a list of schedcmd_t, then packed into parallel arrays sorted by
+// time so playback can seek with a binary search and scan forward
+// without chasing pointers.
+//
+typedef struct schedtab_s {
+    int count;
+    lstime_t *time;
+    unsigned int *stripmask;
+    unsigned int *animation;
+    unsigned int *speed;
+    unsigned int *brightness;
+    unsigned int *palette;
+    unsigned int *direction;
+    unsigned int *option;
+} schedtab_t;
+
+//
+// One event on its own, as it goes through a compiled stream
+// (see lsstream.c).
+//
+typedef struct lsevent_s {
+    lstime_t time;
+    uint32_t stripmask;
+    uint32_t animation;
+    uint32_t speed;
+    uint32_t brightness;
+    uint32_t palette;
+    uint32_t direction;
+    uint32_t option;
+} lsevent_t;
+
+//
+// A 'repeat' block.  The body is compiled once, into a short
+// schedule of one pass with times from the start of the pass, and
+// the passes are generated as playback gets to them.
+//
+typedef struct repeat_s {
+    dqueue_t link;
+    lstime_t from;
+    lstime_t every;
+    lstime_t until;             // nothing at or after this
+    dqueue_t commands;          // the body
+    schedtab_t pattern;         // one pass, see genschedule()
+} repeat_t;
+
+//
+// Walks the packed schedule and the repeats together, in time
+// order (see lsrepeat.c).
+//
+typedef struct schedgen_s {
+    repeat_t *rep;
+    lstime_t base;              // start of the current pass
+    lstime_t stride;            // from one of our passes to the next
+    int idx;                    // into the pattern
+} schedgen_t;
+
+typedef struct schedcursor_s {
+    schedtab_t *tab;
+    int idx;
+    int ngens;
+    schedgen_t *gens;
+    dqueue_t *live;             // injected events, see lsinject.c
+    struct inject_s *inject;    // where played ones go back to
+} schedcursor_t;
+
+//
+// Which event each strip is showing at a keyframe every few
+// seconds, so a seek can put the strips back (see lsseek.c).
+//
+typedef struct seekindex_s {
+    lstime_t interval;
+    int nkeys;
+    int32_t *keys;              // nkeys * MAXSTRIPS event indexes, -1 for none
+} seekindex_t;
+
 typedef struct script_s {
     char *musicfile;
     dqueue_t symbols;
     dqueue_t macros;
     char *idleanimation;
 
+    // Modules brought in with 'include', searched after our own tables
+    dqueue_t imports;
+    int depth;                  // include nesting
+
     // Parsed trees
     node_t *configtree;
     node_t *scripttree;
@@ -183,23 +365,85 @@ typedef struct script_s {
     // Command table (raw, not scheduled)
     dqueue_t commands;
 
-    // schedule
+    // 'repeat' blocks, generated during playback
+    dqueue_t repeats;
+    int repeating;              // compiling a repeat body
+    int macrodepth;             // expanding macros inside macros
+
+    // schedule, a list while it is built and the packed arrays after
     dqueue_t schedule;
+    schedtab_t sched;
+    seekindex_t seekidx;
+
+    // Schedule dump, see lsdump.c
+    int nodump;
+    char *dumpfile;             // NULL for stdout
+    lstime_t dump_from;         // 0 for the beginning
+    lstime_t dump_to;           // 0 for the end
+    uint32_t dump_strips;       // 0 for all strips
+
+    // Preview rendering, see lspreview.c
+    int preview_fps;
+    int preview_pixels;         // per strip
+    int preview_ppm;            // image sequence instead of raw frames
+
+    // When compiling to a stream, events go here instead
+    struct stream_s *stream;
+    char *streamfile;           // stream to play with 'splay'
 
     // Time
-    time_t epoch;
-    double start_offset;
+    lstime_t start_offset;
 
     // Start cue time
-    double start_cue;
-    double end_cue;
+    lstime_t start_cue;
+    lstime_t end_cue;
 
-    // Arduino device
+    // Arduino device, or another sink (see lsplayback.c)
     char *device_name;
-    int device;
+    lssink_t *sink;
+
+    // Set to stop playback from another thread
+    volatile int abort;
+
+    // Real-time playback settings
+    int realtime;
+    int rtcpu;                  // CPU to pin to, -1 for none
+
+    // Serial link model for the bandwidth check
+    int baud;
+    int frame_overhead;         // extra bytes on the wire per frame
+    lstime_t budget_window;
+    double budget_peak;         // set by check_linkbudget()
+
+    // Leave out progress messages (batch checking)
+    int quiet;
+
+    // Controller latency, see lslatency.c
+    int measure_latency;
+    lstime_t latency;           // dispatch this much early
+    struct latency_s *lat;
+
+    // The music's beat grid, for 'at beat' (see lsanalyze.c)
+    double *beatgrid;
+    int nbeatgrid;              // -1 if there is none
+
+    // Events from other programs, see lsinject.c
+    char *inject_path;
+    struct inject_s *inject;
 } script_t;
 
+//
+// A reference from a script to an included module's definitions.
+// The module itself lives in the module cache and is shared.
+//
+
+typedef struct import_s {
+    dqueue_t link;
+    script_t *defs;
+} import_t;
+
 void initscript(script_t *script);
+void freescript(script_t *script);
 
 void savedefines(script_t *script, node_t *tree);
 void savecommands(script_t *script, node_t *tree);
@@ -207,13 +451,120 @@ void printcmdtab(script_t *script);
 void printsymtab(script_t *script);
 
 void genschedule(script_t *script);
+void genevents(script_t *script);
 
 symbol_t *findsym(dqueue_t *tab, char *str);
+symbol_t *newsym(dqueue_t *tab, char *str);
 char *findval(dqueue_t *tab, unsigned int val);
+symbol_t *lookupsym(script_t *script, char *str);
+symbol_t *lookupmacro(script_t *script, char *str);
+char *lookupval(script_t *script, unsigned int val);
+
+void include_module(script_t *script, char *filename);
+script_t *load_config(char *configfilename, int *errors);
+extern int use_config_cache;
+uint64_t hashbytes(const void *buf, size_t len);
 
 
 unsigned int getsymmask(symbol_t *sym);
 unsigned int getsymval(symbol_t *sym);
 
+int compile_script(script_t *script, char *configfilename, char *scriptfilename);
+
 void play_script(script_t *script,int how);
-void printsched1(script_t *script, schedcmd_t * acmd);
+void play_show(script_t *script, int how);
+void play_idle(script_t *script);
+void dryrun_script(script_t *script, int how);
+lssink_t *sink_open(char *name);
+void sink_send(lssink_t *sink, lsmessage_t *msg);
+void sink_flush(lssink_t *sink);
+void sink_close(lssink_t *sink);
+int sink_recv(lssink_t *sink, lsmessage_t *msg, int timeout);
+extern int use_groups;
+int latency_calibrate(script_t *script);
+void latency_poll(script_t *script);
+void latency_report(script_t *script);
+int inject_open(script_t *script);
+void inject_poll(script_t *script, lstime_t now);
+dqueue_t *inject_pending(script_t *script);
+void inject_done(struct inject_s *inj, schedcmd_t *cmd);
+void inject_close(script_t *script);
+void send_message(script_t *script, unsigned int strips, unsigned int anim,  unsigned int speed, unsigned int option, unsigned int palette);
+void printsched1(script_t *script, int idx);
+void printevent(script_t *script, lsevent_t *ev);
+void dumpschedule(script_t *script);
+int optimize_group(dqueue_t *group);
+int sched_seek(schedtab_t *tab, lstime_t t);
+void cursor_seek(schedcursor_t *cur, script_t *script, lstime_t t);
+int cursor_peek(schedcursor_t *cur, lstime_t *t);
+void cursor_next(schedcursor_t *cur, lsevent_t *ev);
+void cursor_free(schedcursor_t *cur);
+void seek_index(script_t *script);
+void seek_restore(script_t *script, lstime_t t);
+void bench_schedule(script_t *script);
+
+int genstream(script_t *script, char *filename);
+struct stream_s *stream_create(script_t *script, char *filename);
+void stream_event(struct stream_s *st, schedcmd_t *cmd);
+void stream_schedule(struct stream_s *st, script_t *script);
+int stream_finish(struct stream_s *st);
+int stream_attach(script_t *script, char *configfilename, char *filename);
+void play_stream(script_t *script);
+
+int preview_script(script_t *script, char *filename);
+int run_batch(char *configfilename, script_t *opts, int nthreads, int nfiles, char **files);
+
+int analyze_music(script_t *script);
+void check_beats(script_t *script);
+int beat_time(script_t *script, int beat, lstime_t *t);
+int check_linkbudget(script_t *script);
+
+int run_daemon(char *sockname, char *device_name, char *configfilename, script_t *opts);
+
+int realtime_setup(script_t *script);
+
+
+/*  *********************************************************************
+    *  Statistics (--stats)
+    ********************************************************************* */
+
+// Subsystems we count allocations for
+enum {
+    MEM_PARSE = 0,
+    MEM_SYMBOLS,
+    MEM_COMMANDS,
+    MEM_SCHEDULE,
+    MEM_MODULES,
+    MEM_MAX
+};
+
+// Things we count
+enum {
+    CNT_TOKENS = 0,
+    CNT_NODES,
+    CNT_COMMANDS,
+    CNT_MACROS,                 // macro expansions
+    CNT_EVENTS,                 // scheduled, before optimizing
+    CNT_FRAMES,                 // in the main schedule, after optimizing
+    CNT_MAX
+};
+
+#define STATS_TEXT      1
+#define STATS_JSON      2
+
+extern int stats_mode;
+extern char *stats_file;
+
+void *stats_calloc(int sub, size_t n, size_t size);
+void *stats_malloc(int sub, size_t size);
+void stats_free(int sub, void *ptr, size_t size);
+void stats_count(int which, uint64_t n);
+void stats_start(void);
+void stats_phase(char *name);
+void stats_report(void);
+
+int record_open(char *filename);
+void record_frame(lsmessage_t *msg);
+void record_flush(void);
+void record_close(void);
+int replay_log(char *filename, char *device_name);
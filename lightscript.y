@@ -11,71 +11,93 @@
 %{
 #include <stdio.h>
 #include "lightscript.h"
-extern int script_error;
 %}
 
+/* Reentrant: all state lives in the scanner and the lsparse_t we are handed */
+%define api.pure
+%lex-param {void *scanner}
+%parse-param {void *scanner}
+%parse-param {lsparse_t *ps}
+
 %union {
     node_t *n;
-    double f;
+    nodelist_t l;
+    lstime_t t;
     int w;
     char *str;
 }
 
+%{
+extern int yylex(YYSTYPE *lvalp, void *scanner);
+extern void yyerror(void *scanner, lsparse_t *ps, const char *str);
+
+// Count tokens as the parser asks for them.  A macro does not
+// expand inside itself, so the yylex here is the real one.
+#define yylex(lvalp, scanner) (ps->tokens++, yylex(lvalp, scanner))
+%}
+
 /* our tokens */
-%token <f> tFLOAT
+%token <t> tFLOAT
 %token <w> tWHOLE
 %token <str> tIDENT tSTRING
 
-%token tMUSIC tFROM tTO tAT tDO tON tCOUNT tIDLE tSPEED tCASCADE tDELAY tBRIGHTNESS tDEFINE tAS tMACRO tPALETTE tREVERSE tCOLOR tOPTION
+%token tMUSIC tFROM tTO tAT tDO tON tCOUNT tIDLE tSPEED tCASCADE tDELAY tBRIGHTNESS tDEFINE tAS tMACRO tPALETTE tREVERSE tCOLOR tOPTION tINCLUDE tREPEAT tEVERY tUNTIL tBEAT
 
-%type <n> idlist top optlist option scriptcmd scriptlist
+%type <n> idlist top optlist option scriptcmd
+%type <l> scriptlist
 
 
 /* %start script */
 %%
 
-top : scriptlist { tree = $1; }
+top : scriptlist { ps->tree = $1.head; }
     ;
 
+/* Left recursive, so the parser stack stays flat however long the
+   script is.  We keep the tail so each statement is a quick append. */
 scriptlist :
-     scriptcmd ';' { $$ = newnode($1,NULL); }
-     | scriptcmd ';' scriptlist { $$ = newnode($1,$3); } 
+     scriptcmd ';' { $$.head = $$.tail = newnode(ps, $1,NULL); }
+     | scriptlist scriptcmd ';' { $$ = $1; $$.tail->right = newnode(ps, $2,NULL); $$.tail = $$.tail->right; }
      ;
 
-idlist : tIDENT { $$ = newidlist($1, NULL) ; }
-    | tIDENT  ',' idlist { $$ = newidlist($1, $3); }
+idlist : tIDENT { $$ = newidlist(ps, $1, NULL) ; }
+    | tIDENT  ',' idlist { $$ = newidlist(ps, $1, $3); }
     ;
 
 scriptcmd :
-     tAT tFLOAT optlist  {  $$ = newcmd_sched(sAT, $2, $2, $3); }
-     | tFROM tFLOAT tTO tFLOAT optlist { $$ = newcmd_sched(sFROM, $2, $4, $5); }
-     | tMUSIC tSTRING  { $$ = newcmd_str(sMUSIC,$2); }
-     | tIDLE tIDENT  { $$ = newcmd_str(sIDLE, $2); }
-     | tDEFINE tIDENT tAS tWHOLE  { $$ = newcmd_defval($2, $4); }
-     | tDEFINE tIDENT tAS idlist  { $$ = newcmd_defidl($2, $4); }
-     | tDEFINE tIDENT '{' scriptlist '}' { $$ = newcmd_defmacro($2, $4); }
+     tAT tFLOAT optlist  {  $$ = newcmd_sched(ps, sAT, $2, $2, $3); }
+     | tAT tBEAT tWHOLE optlist  {  $$ = newcmd_beat(ps, $3, $4); }
+     | tFROM tFLOAT tTO tFLOAT optlist { $$ = newcmd_sched(ps, sFROM, $2, $4, $5); }
+     | tMUSIC tSTRING  { $$ = newcmd_str(ps, sMUSIC,$2); }
+     | tINCLUDE tSTRING  { $$ = newcmd_str(ps, sINCLUDE, includepath(ps, $2)); }
+     | tIDLE tIDENT  { $$ = newcmd_str(ps, sIDLE, $2); }
+     | tDEFINE tIDENT tAS tWHOLE  { $$ = newcmd_defval(ps, $2, $4); }
+     | tDEFINE tIDENT tAS idlist  { $$ = newcmd_defidl(ps, $2, $4); }
+     | tDEFINE tIDENT '{' scriptlist '}' { $$ = newcmd_defmacro(ps, $2, $4.head); }
+     | tREPEAT '{' scriptlist '}' tEVERY tFLOAT tUNTIL tFLOAT { $$ = newcmd_repeat(ps, $3.head, $6, 0, $8); }
+     | tREPEAT '{' scriptlist '}' tEVERY tFLOAT tFROM tFLOAT tUNTIL tFLOAT { $$ = newcmd_repeat(ps, $3.head, $6, $8, $10); }
      ;
 
 
-option : tON idlist  { $$ = newoption_idl(oON, $2); }
-    | tCASCADE tIDENT { $$ = newoption_idl(oCASCADE, newidlist($2,NULL)); }
-    | tDO tIDENT { $$ = newoption_idl(oDO, newidlist($2, NULL)); }
-    | tMACRO tIDENT { $$ = newoption_idl(oMACRO, newidlist($2, NULL)); }
-    | tBRIGHTNESS tWHOLE { $$ = newoption_w(oBRIGHTNESS, $2); }
-    | tDELAY tFLOAT { $$ = newoption_f(oDELAY, $2); }
-    | tSPEED tWHOLE { $$ = newoption_w(oSPEED, $2); }
-    | tCOUNT tWHOLE { $$ = newoption_w(oCOUNT, $2); }
-    | tOPTION tWHOLE { $$ = newoption_w(oOPTION, $2); }
-    | tPALETTE tWHOLE { $$ = newoption_w(oPALETTE, $2); }
-    | tPALETTE tIDENT { $$ = newoption_idl(oPALETTE, newidlist($2,NULL)); }
-    | tCOLOR tWHOLE { $$ = newoption_w(oCOLOR, $2); }
-    | tCOLOR tIDENT { $$ = newoption_idl(oCOLOR, newidlist($2,NULL)); }
-    | tREVERSE { $$ = newoption_w(oREVERSE, 0); }
+option : tON idlist  { $$ = newoption_idl(ps, oON, $2); }
+    | tCASCADE tIDENT { $$ = newoption_idl(ps, oCASCADE, newidlist(ps, $2,NULL)); }
+    | tDO tIDENT { $$ = newoption_idl(ps, oDO, newidlist(ps, $2, NULL)); }
+    | tMACRO tIDENT { $$ = newoption_idl(ps, oMACRO, newidlist(ps, $2, NULL)); }
+    | tBRIGHTNESS tWHOLE { $$ = newoption_w(ps, oBRIGHTNESS, $2); }
+    | tDELAY tFLOAT { $$ = newoption_t(ps, oDELAY, $2); }
+    | tSPEED tWHOLE { $$ = newoption_w(ps, oSPEED, $2); }
+    | tCOUNT tWHOLE { $$ = newoption_w(ps, oCOUNT, $2); }
+    | tOPTION tWHOLE { $$ = newoption_w(ps, oOPTION, $2); }
+    | tPALETTE tWHOLE { $$ = newoption_w(ps, oPALETTE, $2); }
+    | tPALETTE tIDENT { $$ = newoption_idl(ps, oPALETTE, newidlist(ps, $2,NULL)); }
+    | tCOLOR tWHOLE { $$ = newoption_w(ps, oCOLOR, $2); }
+    | tCOLOR tIDENT { $$ = newoption_idl(ps, oCOLOR, newidlist(ps, $2,NULL)); }
+    | tREVERSE { $$ = newoption_w(ps, oREVERSE, 0); }
     ;
 
 optlist : 
-    option optlist { $$ = newnode($1, $2); }
-    | option { $$ = newnode($1, NULL); }
+    option optlist { $$ = newnode(ps, $1, $2); }
+    | option { $$ = newnode(ps, $1, NULL); }
     ;
 
 
@@ -0,0 +1,686 @@
+/*  *********************************************************************
+    *  LightScript - A script processor for LED animations
+    *
+    *  Music Analysis                           File: lsanalyze.c
+    *
+    *  Onset and tempo detection for the music file named in a
+    *  script.  We build a beat grid that is saved next to the
+    *  music file.  Scripts can put cues on its beats ('at beat 17
+    *  do ...') and 'check' uses it to find cues that are off-beat.
+    *
+    *  Author:  Mitch Lichtenberg
+    ********************************************************************* */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "lightscript.h"
+
+//
+// Analysis parameters.  Frames are FFTSIZE samples long and
+// advance by HOPSIZE, so at 44.1KHz we get one onset value every 11.6ms.
+//
+
+#define FFTSIZE         1024
+#define FFTLOG2         10
+#define HOPSIZE         512
+#define MAXTHREADS      16
+#define FLUXLANES       8               // partial sums for the flux, a multiple of the vector width
+
+#define MINBPM          60.0
+#define MAXBPM          200.0
+#define PREFBPM         120.0
+
+#define BEATTOLERANCE   0.050           // Cues further than this from a beat are reported
+
+extern int decodeMusicFile(const char *filename, float **samples, long *nsamples, double *rate);
+
+/*  *********************************************************************
+    *  FFT
+    *
+    *  A plain iterative radix-2 FFT.  The real and imaginary parts are
+    *  kept in separate arrays, and each stage has its own run of
+    *  twiddle factors, so the window, butterfly and magnitude loops
+    *  walk every array one float at a time and the compiler
+    *  vectorizes them (this needs -O2, see the Makefile).  The bit
+    *  reversal and the log are left scalar.
+    ********************************************************************* */
+
+typedef struct fft_s {
+    float window[FFTSIZE];
+    float twr[FFTSIZE];         // stage of size 2*half uses [half, 2*half)
+    float twi[FFTSIZE];
+    int bitrev[FFTSIZE];
+} fft_t;
+
+static void fft_init(fft_t *fft)
+{
+    int i, j, b;
+
+    for (i = 0; i < FFTSIZE; i++) {
+        fft->window[i] = 0.5f - 0.5f * cosf(2.0f * (float) M_PI * (float) i / (float) FFTSIZE);
+        for (j = 0, b = 0; b < FFTLOG2; b++) {
+            j = (j << 1) | ((i >> b) & 1);
+        }
+        fft->bitrev[i] = j;
+    }
+
+    for (b = 1; b < FFTSIZE; b <<= 1) {
+        for (i = 0; i < b; i++) {
+            fft->twr[b+i] = cosf((float) M_PI * (float) i / (float) b);
+            fft->twi[b+i] = -sinf((float) M_PI * (float) i / (float) b);
+        }
+    }
+}
+
+static void fft_run(const fft_t *fft, float * restrict re, float * restrict im)
+{
+    int size, half;
+    int i, j, k;
+
+    for (i = 0; i < FFTSIZE; i++) {
+        j = fft->bitrev[i];
+        if (j > i) {
+            float t = re[i]; re[i] = re[j]; re[j] = t;
+            t = im[i]; im[i] = im[j]; im[j] = t;
+        }
+    }
+
+    for (size = 2; size <= FFTSIZE; size <<= 1) {
+        const float * restrict twr = &fft->twr[size >> 1];
+        const float * restrict twi = &fft->twi[size >> 1];
+
+        half = size >> 1;
+        for (i = 0; i < FFTSIZE; i += size) {
+            float * restrict are = &re[i];
+            float * restrict aim = &im[i];
+            float * restrict bre = &re[i+half];
+            float * restrict bim = &im[i+half];
+
+            for (k = 0; k < half; k++) {
+                float wr = twr[k];
+                float wi = twi[k];
+                float tr = bre[k]*wr - bim[k]*wi;
+                float ti = bre[k]*wi + bim[k]*wr;
+                bre[k] = are[k] - tr;
+                bim[k] = aim[k] - ti;
+                are[k] = are[k] + tr;
+                aim[k] = aim[k] + ti;
+            }
+        }
+    }
+}
+
+/*  *********************************************************************
+    *  Spectral flux
+    *
+    *  The music is split into contiguous blocks of frames, one block
+    *  per thread.  Each thread computes the log-magnitude spectrum
+    *  of its frames and sums the positive differences from the
+    *  previous frame.  Threads write disjoint parts of the flux array.
+    ********************************************************************* */
+
+typedef struct fluxjob_s {
+    pthread_t thread;
+    const fft_t *fft;
+    const float *samples;
+    long nsamples;
+    long firstframe;
+    long lastframe;
+    float *flux;
+} fluxjob_t;
+
+static void logspectrum(const fft_t *fft, const float *samples, long nsamples, long frame, float *mag)
+{
+    float re[FFTSIZE];
+    float im[FFTSIZE];
+    long base = frame * HOPSIZE;
+    int i;
+
+    if (base + FFTSIZE <= nsamples) {
+        for (i = 0; i < FFTSIZE; i++) {
+            re[i] = samples[base+i] * fft->window[i];
+            im[i] = 0;
+        }
+    } else {
+        for (i = 0; i < FFTSIZE; i++) {
+            re[i] = ((base+i) < nsamples) ? samples[base+i] * fft->window[i] : 0;
+            im[i] = 0;
+        }
+    }
+
+    fft_run(fft, re, im);
+
+    for (i = 0; i < FFTSIZE/2; i++) {
+        mag[i] = sqrtf(re[i]*re[i] + im[i]*im[i]);
+    }
+    for (i = 0; i < FFTSIZE/2; i++) {
+        mag[i] = log1pf(mag[i]);
+    }
+}
+
+static void *fluxworker(void *arg)
+{
+    fluxjob_t *job = (fluxjob_t *) arg;
+    float bufa[FFTSIZE/2];
+    float bufb[FFTSIZE/2];
+    float *prev = bufa;
+    float *cur = bufb;
+    long frame;
+    int i;
+
+    if (job->firstframe > 0) {
+        logspectrum(job->fft, job->samples, job->nsamples, job->firstframe-1, prev);
+    } else {
+        memset(prev, 0, sizeof(bufa));
+    }
+
+    for (frame = job->firstframe; frame < job->lastframe; frame++) {
+        float part[FLUXLANES];
+        float sum = 0;
+        float *t;
+        int j;
+
+        logspectrum(job->fft, job->samples, job->nsamples, frame, cur);
+
+        // A sum in one variable has to be added up in order, which
+        // can't be vectorized, so keep a sum per lane.
+        for (j = 0; j < FLUXLANES; j++) {
+            part[j] = 0;
+        }
+        for (i = 0; i < FFTSIZE/2; i += FLUXLANES) {
+            for (j = 0; j < FLUXLANES; j++) {
+                float d = cur[i+j] - prev[i+j];
+                part[j] += (d > 0) ? d : 0;
+            }
+        }
+        for (j = 0; j < FLUXLANES; j++) {
+            sum += part[j];
+        }
+        job->flux[frame] = sum;
+
+        t = prev; prev = cur; cur = t;
+    }
+
+    return NULL;
+}
+
+static void spectralflux(const float *samples, long nsamples, float *flux, long nframes)
+{
+    fluxjob_t jobs[MAXTHREADS];
+    fft_t *fft;
+    long per;
+    int nthreads;
+    int i;
+
+    fft = (fft_t *) calloc(1,sizeof(fft_t));
+    fft_init(fft);
+
+    nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > MAXTHREADS) nthreads = MAXTHREADS;
+
+    per = (nframes + nthreads - 1) / nthreads;
+
+    for (i = 0; i < nthreads; i++) {
+        jobs[i].fft = fft;
+        jobs[i].samples = samples;
+        jobs[i].nsamples = nsamples;
+        jobs[i].firstframe = i * per;
+        jobs[i].lastframe = (i+1) * per;
+        if (jobs[i].lastframe > nframes) jobs[i].lastframe = nframes;
+        jobs[i].flux = flux;
+        pthread_create(&jobs[i].thread, NULL, fluxworker, &jobs[i]);
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(jobs[i].thread, NULL);
+    }
+
+    free(fft);
+}
+
+/*  *********************************************************************
+    *  Onsets and tempo
+    ********************************************************************* */
+
+//
+// Turn the raw flux into an onset envelope: subtract a moving
+// average and keep only the positive part.
+//
+static void onsetenvelope(const float *flux, float *env, long nframes)
+{
+    const int w = 8;
+    double sum = 0;
+    long i;
+    int n = 0;
+
+    for (i = 0; (i < w) && (i < nframes); i++) {
+        sum += flux[i];
+        n++;
+    }
+
+    for (i = 0; i < nframes; i++) {
+        float d;
+
+        if (i + w < nframes) {
+            sum += flux[i+w];
+            n++;
+        }
+        if (i - w - 1 >= 0) {
+            sum -= flux[i-w-1];
+            n--;
+        }
+
+        d = flux[i] - (float) (sum / n);
+        env[i] = (d > 0) ? d : 0;
+    }
+}
+
+static long pickonsets(const float *env, long nframes, long *onsets)
+{
+    const int w = 3;
+    long cnt = 0;
+    double mean = 0;
+    long i;
+    int j;
+
+    for (i = 0; i < nframes; i++) {
+        mean += env[i];
+    }
+    mean = (nframes > 0) ? mean / nframes : 0;
+
+    for (i = 0; i < nframes; i++) {
+        int peak = (env[i] > 1.5 * mean);
+
+        for (j = -w; peak && (j <= w); j++) {
+            if ((j != 0) && (i+j >= 0) && (i+j < nframes) && (env[i+j] > env[i])) {
+                peak = 0;
+            }
+        }
+        if (peak) {
+            onsets[cnt++] = i;
+        }
+    }
+
+    return cnt;
+}
+
+//
+// Autocorrelate the onset envelope over the lags that correspond
+// to our tempo range, weighting toward PREFBPM so we don't lock
+// on to half- or double-time.
+//
+static double findperiod(const float *env, long nframes, double framerate)
+{
+    long minlag = (long) (framerate * 60.0 / MAXBPM);
+    long maxlag = (long) (framerate * 60.0 / MINBPM) + 1;
+    double bestscore = -1;
+    long bestlag = minlag;
+    double before, after;
+    long lag, i;
+
+    if (maxlag >= nframes) maxlag = nframes - 1;
+
+    for (lag = minlag; lag <= maxlag; lag++) {
+        double acc = 0;
+        double bpm = framerate * 60.0 / (double) lag;
+        double x = log2(bpm / PREFBPM);
+
+        for (i = 0; i + lag < nframes; i++) {
+            acc += env[i] * env[i+lag];
+        }
+        acc *= exp(-0.5 * x * x);
+
+        if (acc > bestscore) {
+            bestscore = acc;
+            bestlag = lag;
+        }
+    }
+
+    // Refine to a fractional lag with a parabola through the neighbors
+    if ((bestlag <= minlag) || (bestlag >= maxlag)) {
+        return (double) bestlag;
+    }
+
+    before = after = 0;
+    for (i = 0; i + bestlag + 1 < nframes; i++) {
+        before += env[i] * env[i+bestlag-1];
+        after += env[i] * env[i+bestlag+1];
+    }
+    {
+        double mid = 0;
+        double denom;
+
+        for (i = 0; i + bestlag < nframes; i++) {
+            mid += env[i] * env[i+bestlag];
+        }
+        denom = before - 2*mid + after;
+        if (denom < 0) {
+            return (double) bestlag + 0.5 * (before - after) / denom;
+        }
+    }
+
+    return (double) bestlag;
+}
+
+//
+// Lay down the beat grid: pick the phase that best lines up with
+// the envelope, then walk forward one period at a time letting each
+// beat snap to the strongest onset close to where we expected it.
+//
+static long trackbeats(const float *env, long nframes, double period, long *beats)
+{
+    long nperiod = (long) period;
+    long slack = (long) (period * 0.1);
+    double bestscore = -1;
+    long bestphase = 0;
+    long phase, i, b, cnt = 0;
+    double t;
+
+    for (phase = 0; phase < nperiod; phase++) {
+        double score = 0;
+        for (t = phase; t < nframes; t += period) {
+            score += env[(long) t];
+        }
+        if (score > bestscore) {
+            bestscore = score;
+            bestphase = phase;
+        }
+    }
+
+    t = bestphase;
+    while (t < nframes) {
+        long center = (long) (t + 0.5);
+
+        if (center >= nframes) break;
+
+        b = center;
+        for (i = center - slack; i <= center + slack; i++) {
+            if ((i >= 0) && (i < nframes) && (env[i] > env[b])) {
+                b = i;
+            }
+        }
+
+        beats[cnt++] = b;
+        t = (double) b + period;
+    }
+
+    return cnt;
+}
+
+/*  *********************************************************************
+    *  Beat grid files
+    ********************************************************************* */
+
+static char *beatfilename(char *musicfile)
+{
+    char *name = (char *) malloc(strlen(musicfile) + 8);
+
+    sprintf(name,"%s.beats",musicfile);
+    return name;
+}
+
+static int savebeats(char *filename, char *musicfile, double tempo,
+                     long *beats, long nbeats, long *onsets, long nonsets, double frametime)
+{
+    FILE *str;
+    long i;
+
+    str = fopen(filename,"w");
+    if (!str) {
+        fprintf(stderr,"Could not create %s : %s\n",filename,strerror(errno));
+        return -1;
+    }
+
+    fprintf(str,"// Beat grid for %s, generated by 'lightscript analyze'\n",musicfile);
+    fprintf(str,"tempo %.2f\n",tempo);
+    for (i = 0; i < nbeats; i++) {
+        fprintf(str,"beat %.4f\n",(double) beats[i] * frametime);
+    }
+    for (i = 0; i < nonsets; i++) {
+        fprintf(str,"onset %.4f\n",(double) onsets[i] * frametime);
+    }
+
+    fclose(str);
+    return 0;
+}
+
+static double *loadbeats(char *filename, int *nbeats, double *tempo)
+{
+    FILE *str;
+    char line[256];
+    double *beats = NULL;
+    int cnt = 0;
+    int max = 0;
+    double t;
+
+    str = fopen(filename,"r");
+    if (!str) {
+        return NULL;
+    }
+
+    *tempo = 0;
+
+    while (fgets(line,sizeof(line),str)) {
+        if (sscanf(line,"tempo %lf",&t) == 1) {
+            *tempo = t;
+        } else if (sscanf(line,"beat %lf",&t) == 1) {
+            if (cnt == max) {
+                max = max ? max*2 : 1024;
+                beats = (double *) realloc(beats, max * sizeof(double));
+            }
+            beats[cnt++] = t;
+        }
+    }
+
+    fclose(str);
+
+    *nbeats = cnt;
+    return beats;
+}
+
+/*  *********************************************************************
+    *  analyze_music(script)
+    *
+    *  Decode the script's music file, find onsets and beats, and
+    *  write the beat grid to <musicfile>.beats
+    ********************************************************************* */
+
+static double elapsed(struct timeval *start)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return (double) (tv.tv_sec - start->tv_sec) + (double) (tv.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+int analyze_music(script_t *script)
+{
+    struct timeval start;
+    float *samples = NULL;
+    long nsamples = 0;
+    double rate = 0;
+    long nframes;
+    float *flux, *env;
+    long *beats, *onsets;
+    long nbeats, nonsets;
+    double framerate, period, duration, secs;
+    char *filename;
+    int res;
+
+    if (decodeMusicFile(script->musicfile, &samples, &nsamples, &rate) < 0) {
+        fprintf(stderr,"Could not decode music file %s\n",script->musicfile);
+        return -1;
+    }
+
+    duration = (double) nsamples / rate;
+    printf("* Analyzing %s (%.1f seconds at %.0f Hz)\n",script->musicfile,duration,rate);
+
+    gettimeofday(&start,NULL);
+
+    nframes = (nsamples + HOPSIZE - 1) / HOPSIZE;
+    framerate = rate / (double) HOPSIZE;
+
+    flux = (float *) calloc(nframes,sizeof(float));
+    env = (float *) calloc(nframes,sizeof(float));
+    beats = (long *) calloc(nframes,sizeof(long));
+    onsets = (long *) calloc(nframes,sizeof(long));
+
+    spectralflux(samples, nsamples, flux, nframes);
+    onsetenvelope(flux, env, nframes);
+
+    nonsets = pickonsets(env, nframes, onsets);
+    period = findperiod(env, nframes, framerate);
+    nbeats = trackbeats(env, nframes, period, beats);
+
+    secs = elapsed(&start);
+
+    printf("Tempo %.2f BPM, %ld beats, %ld onsets\n",framerate * 60.0 / period, nbeats, nonsets);
+    printf("Analysis took %.3f seconds (%.0fx realtime)\n",secs, (secs > 0) ? duration / secs : 0);
+
+    filename = beatfilename(script->musicfile);
+    res = savebeats(filename, script->musicfile, framerate * 60.0 / period,
+                    beats, nbeats, onsets, nonsets, 1.0 / framerate);
+    if (res == 0) {
+        printf("Beat grid written to %s\n",filename);
+    }
+
+    free(filename);
+    free(flux);
+    free(env);
+    free(beats);
+    free(onsets);
+    free(samples);
+
+    return res;
+}
+
+/*  *********************************************************************
+    *  beat_time(script, beat, t)
+    *
+    *  The time of a beat (numbered from 1) in the beat grid of the
+    *  script's music, for 'at beat'.  The grid is read the first
+    *  time it is needed.  Returns -1 if there is no grid or it has
+    *  no such beat.
+    ********************************************************************* */
+
+static char *findmusic(script_t *script)
+{
+    dqueue_t *qb;
+    char *music;
+
+    if (script->musicfile) {
+        return script->musicfile;
+    }
+
+    for (qb = script->imports.dq_next; qb != &(script->imports); qb = qb->dq_next) {
+        music = findmusic(((import_t *) qb)->defs);
+        if (music) {
+            return music;
+        }
+    }
+
+    return NULL;
+}
+
+int beat_time(script_t *script, int beat, lstime_t *t)
+{
+    char *music;
+    char *filename;
+    double tempo;
+
+    if (script->nbeatgrid == 0) {
+        music = findmusic(script);
+        script->nbeatgrid = -1;
+
+        if (music) {
+            filename = beatfilename(music);
+            script->beatgrid = loadbeats(filename, &(script->nbeatgrid), &tempo);
+            if (!script->beatgrid) {
+                printf("Warning: no beat grid %s, run 'lightscript analyze' first\n",filename);
+                script->nbeatgrid = -1;
+            }
+            free(filename);
+        } else {
+            printf("Warning: 'at beat' needs a music file\n");
+        }
+    }
+
+    if ((beat < 1) || (beat > script->nbeatgrid)) {
+        return -1;
+    }
+
+    *t = LSTIME_FROMSECS(script->beatgrid[beat-1]);
+    return 0;
+}
+
+/*  *********************************************************************
+    *  check_beats(script)
+    *
+    *  If the music file has a beat grid, report scheduled events
+    *  (repeats included) that do not land on (or close to) a beat.
+    ********************************************************************* */
+
+void check_beats(script_t *script)
+{
+    char *filename;
+    double *beats;
+    int nbeats;
+    double tempo;
+    int offbeat = 0;
+    int b = 0;
+    schedcursor_t cur;
+    lsevent_t ev;
+    lstime_t next;
+
+    if (!script->musicfile) {
+        return;
+    }
+
+    filename = beatfilename(script->musicfile);
+    beats = loadbeats(filename, &nbeats, &tempo);
+
+    if (!beats) {
+        free(filename);
+        return;
+    }
+
+    printf("* Checking cues against beat grid %s (%.2f BPM)\n",filename,tempo);
+
+    // The events come in order, so we can walk the beats along with them.
+    cursor_seek(&cur, script, 0);
+    while (cursor_peek(&cur, &next)) {
+        double t = LSTIME_SECS(next);
+        double d;
+
+        cursor_next(&cur, &ev);
+
+        while ((b+1 < nbeats) && (fabs(beats[b+1] - t) <= fabs(beats[b] - t))) {
+            b++;
+        }
+
+        d = t - beats[b];
+        if (fabs(d) > BEATTOLERANCE) {
+            printf("Off-beat (%+4.0fms from beat %d): ",d * 1000.0, b+1);
+            printevent(script,&ev);
+            offbeat++;
+        }
+    }
+    cursor_free(&cur);
+
+    if (offbeat) {
+        printf("%d cue%s off-beat by more than %.0fms\n",offbeat,(offbeat == 1) ? " is" : "s are",
+               BEATTOLERANCE * 1000.0);
+    }
+
+    free(beats);
+    free(filename);
+}
@@ -0,0 +1,302 @@
+/*  *********************************************************************
+    *  LightScript - A script processor for LED animations
+    *
+    *  Batch Checking                           File: lsbatch.c
+    *
+    *  Checks a whole show's worth of cue scripts at once.  The
+    *  config is loaded one time and every script imports the same
+    *  definitions, which nobody changes once they are loaded, so
+    *  the scripts can be compiled at the same time on a pool of
+    *  threads.  Each one gets its compiled stream (script.lss) and
+    *  then the checks and a summary are printed in order.
+    *
+    *  Author:  Mitch Lichtenberg
+    ********************************************************************* */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "lightscript.h"
+
+typedef struct batchjob_s {
+    char *filename;
+    char *output;
+    script_t script;
+    int failed;                 // 1 if it did not compile
+    int latespans;              // from the link budget check
+    lstime_t elapsed;           // compiling it took this long
+} batchjob_t;
+
+typedef struct batch_s {
+    script_t *opts;             // options from the command line
+    script_t *defs;             // the config, shared by every script
+    batchjob_t *jobs;
+    int njobs;
+    int maxjobs;
+    int nextjob;                // handed out to the threads
+} batch_t;
+
+static void addjob(batch_t *b, char *filename)
+{
+    batchjob_t *job;
+
+    if (b->njobs == b->maxjobs) {
+        b->maxjobs = b->maxjobs ? b->maxjobs * 2 : 64;
+        b->jobs = (batchjob_t *) realloc(b->jobs, b->maxjobs * sizeof(batchjob_t));
+    }
+
+    job = &(b->jobs[b->njobs++]);
+    memset(job, 0, sizeof(batchjob_t));
+    job->filename = filename;
+}
+
+static int lsfile(const struct dirent *de)
+{
+    const char *dot = strrchr(de->d_name, '.');
+
+    return dot && (strcmp(dot, ".ls") == 0);
+}
+
+//
+// A directory means every .ls file in it, in name order.
+//
+static int addpath(batch_t *b, char *path)
+{
+    struct stat statbuf;
+    struct dirent **names;
+    int n, i;
+
+    if (stat(path, &statbuf) < 0) {
+        fprintf(stderr,"Could not find %s : %s\n",path,strerror(errno));
+        return -1;
+    }
+
+    if (!S_ISDIR(statbuf.st_mode)) {
+        addjob(b, path);
+        return 0;
+    }
+
+    n = scandir(path, &names, lsfile, alphasort);
+    if (n < 0) {
+        fprintf(stderr,"Could not read %s : %s\n",path,strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        char *filename = (char *) malloc(strlen(path) + strlen(names[i]->d_name) + 2);
+
+        sprintf(filename, "%s/%s", path, names[i]->d_name);
+        addjob(b, filename);
+        free(names[i]);
+    }
+    free(names);
+
+    return 0;
+}
+
+//
+// Write the finished schedule as a compiled stream.
+//
+static int writestream(script_t *script, char *filename)
+{
+    struct stream_s *st;
+
+    st = stream_create(script, filename);
+    if (!st) {
+        return -1;
+    }
+
+    stream_schedule(st, script);
+
+    return stream_finish(st);
+}
+
+//
+// Compile one script, quietly.  Everything here only touches the
+// job's own script; the shared config is only read.
+//
+static void compile_job(batch_t *b, batchjob_t *job)
+{
+    script_t *script = &(job->script);
+    lstime_t start = current_ticks();
+    lsparse_t ps;
+    char *dot;
+
+    initscript(script);
+    script->baud = b->opts->baud;
+    script->frame_overhead = b->opts->frame_overhead;
+    script->budget_window = b->opts->budget_window;
+    script->quiet = 1;
+    script->nodump = 1;
+
+    parse_file(&ps, job->filename);
+    script->scripttree = ps.tree;
+
+    if (ps.errors || !script->scripttree) {
+        job->failed = 1;
+        job->elapsed = current_ticks() - start;
+        return;
+    }
+
+    if (b->defs) {
+        import_t *imp = (import_t *) stats_calloc(MEM_MODULES,1,sizeof(import_t));
+        imp->defs = b->defs;
+        dq_enqueue(&(script->imports), &(imp->link));
+    }
+
+    savedefines(script, script->scripttree);
+    savecommands(script, script->scripttree);
+
+    if (b->defs) {
+        if (!script->idleanimation) script->idleanimation = b->defs->idleanimation;
+        if (!script->musicfile) script->musicfile = b->defs->musicfile;
+    }
+
+    genschedule(script);
+
+    job->output = (char *) malloc(strlen(job->filename) + 5);
+    strcpy(job->output, job->filename);
+    dot = strrchr(job->output, '.');
+    if (dot && !strchr(dot, '/')) {
+        *dot = 0;
+    }
+    strcat(job->output, ".lss");
+
+    if (writestream(script, job->output) < 0) {
+        job->failed = 1;
+    }
+
+    job->elapsed = current_ticks() - start;
+}
+
+static void *batchthread(void *arg)
+{
+    batch_t *b = (batch_t *) arg;
+    int idx;
+
+    while ((idx = __atomic_fetch_add(&(b->nextjob), 1, __ATOMIC_RELAXED)) < b->njobs) {
+        compile_job(b, &(b->jobs[idx]));
+    }
+
+    return NULL;
+}
+
+/*  *********************************************************************
+    *  run_batch(configfilename, opts, nthreads, nfiles, files)
+    *
+    *  Compile and check every script named (or found in the
+    *  directories named).  Returns the exit status for main().
+    ********************************************************************* */
+
+int run_batch(char *configfilename, script_t *opts, int nthreads, int nfiles, char **files)
+{
+    batch_t b;
+    pthread_t *threads;
+    lstime_t start, wall;
+    int failed = 0, warned = 0;
+    int errors = 0;
+    int i;
+
+    memset(&b, 0, sizeof(b));
+    b.opts = opts;
+
+    for (i = 0; i < nfiles; i++) {
+        if (addpath(&b, files[i]) < 0) {
+            return 1;
+        }
+    }
+
+    if (b.njobs == 0) {
+        fprintf(stderr,"No scripts to check\n");
+        return 1;
+    }
+
+    start = current_ticks();
+
+    b.defs = load_config(configfilename, &errors);
+    if (errors) {
+        fprintf(stderr,"There was an error in the configuration file\n");
+        return 1;
+    }
+    if (!b.defs) {
+        fprintf(stderr,"[Proceeding without a config file]\n");
+    }
+    stats_phase("defines");
+
+    if (nthreads <= 0) {
+        nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > b.njobs) nthreads = b.njobs;
+
+    printf("* Compiling %d scripts on %d thread%s\n",b.njobs,nthreads,(nthreads == 1) ? "" : "s");
+
+    threads = (pthread_t *) calloc(nthreads, sizeof(pthread_t));
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, batchthread, &b) != 0) {
+            batchthread(&b);
+            nthreads = i;
+            break;
+        }
+    }
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    stats_phase("schedule");
+
+    // The checks print as they go, so they run here, in order.
+    for (i = 0; i < b.njobs; i++) {
+        batchjob_t *job = &(b.jobs[i]);
+
+        printf("------------------------------------------------------------------------\n");
+        printf("-- %s\n",job->filename);
+
+        if (job->failed) {
+            printf("There was an error in the script file\n");
+            continue;
+        }
+
+        check_beats(&(job->script));
+        job->latespans = check_linkbudget(&(job->script));
+        if (job->latespans > 0) {
+            warned++;
+        }
+    }
+    stats_phase("check");
+
+    wall = current_ticks() - start;
+
+    printf("------------------------------------------------------------------------\n");
+    printf("%-32s %-6s %8s %10s %6s %8s\n","Script","Result","Frames","Length","Link","ms");
+    for (i = 0; i < b.njobs; i++) {
+        batchjob_t *job = &(b.jobs[i]);
+        schedtab_t *tab = &(job->script.sched);
+        char *name = strrchr(job->filename, '/') ? strrchr(job->filename, '/') + 1 : job->filename;
+
+        if (job->failed) {
+            failed++;
+            printf("%-32.32s %-6s\n",name,"FAILED");
+            continue;
+        }
+
+        printf("%-32.32s %-6s %8d %10.3f %5.0f%% %8.1f\n",name,
+               job->latespans ? "LATE" : "ok",
+               tab->count,
+               tab->count ? LSTIME_SECS(tab->time[tab->count-1]) : 0.0,
+               job->script.budget_peak * 100.0,
+               LSTIME_SECS(job->elapsed) * 1000.0);
+    }
+
+    printf("* %d script%s checked in %.2f seconds: %d failed, %d with late frames\n",
+           b.njobs, (b.njobs == 1) ? "" : "s", LSTIME_SECS(wall), failed, warned);
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,179 @@
+/*  *********************************************************************
+    *  LightScript - A script processor for LED animations
+    *
+    *  Schedule Benchmark                       File: lsbench.c
+    *
+    *  Compares the packed schedule arrays against the linked list
+    *  of schedcmd_t we used to play from: a forward scan touching
+    *  everything dispatch touches, and seeking to random cue times.
+    *
+    *  The list is made the way it was, by genevents(), so its
+    *  nodes sit where the old player found them: allocated
+    *  command by command and linked in time order, not one after
+    *  another in memory.
+    *
+    *  Author:  Mitch Lichtenberg
+    ********************************************************************* */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include "lightscript.h"
+
+#define SCANEVENTS      20000000        // events to scan, roughly
+#define SEEKEVENTS      2000000         // list entries to walk while seeking, roughly
+
+static double bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+//
+// Rebuild the schedule the way it used to be kept, one allocation
+// per event, linked in time order.  genevents() makes the nodes so
+// they land where they used to, then we fill them in from the
+// packed schedule so both sides see the same frames.
+//
+static void buildlist(script_t *script, dqueue_t *list)
+{
+    schedtab_t *tab = &(script->sched);
+    dqueue_t *dq, *next;
+    int i;
+
+    dq_init(list);
+    genevents(script);
+
+    dq = script->schedule.dq_next;
+    for (i = 0; i < tab->count; i++) {
+        schedcmd_t *cmd;
+
+        // Repeats add events the commands didn't make.
+        if (dq != &(script->schedule)) {
+            cmd = (schedcmd_t *) dq;
+            dq = dq->dq_next;
+            dq_dequeue(&(cmd->link));
+        } else {
+            cmd = (schedcmd_t *) stats_calloc(MEM_SCHEDULE,1,sizeof(schedcmd_t));
+        }
+
+        cmd->time = tab->time[i];
+        cmd->stripmask = tab->stripmask[i];
+        cmd->animation = tab->animation[i];
+        cmd->speed = tab->speed[i];
+        cmd->brightness = tab->brightness[i];
+        cmd->palette = tab->palette[i];
+        cmd->direction = tab->direction[i];
+        cmd->option = tab->option[i];
+        dq_enqueue(list, &(cmd->link));
+    }
+
+    // And the optimizer dropped some.
+    for (dq = script->schedule.dq_next; dq != &(script->schedule); dq = next) {
+        next = dq->dq_next;
+        dq_dequeue(dq);
+        stats_free(MEM_SCHEDULE,dq,sizeof(schedcmd_t));
+    }
+}
+
+static void freelist(dqueue_t *list)
+{
+    dqueue_t *dq = list->dq_next;
+
+    while (dq != list) {
+        dqueue_t *next = dq->dq_next;
+        stats_free(MEM_SCHEDULE,dq,sizeof(schedcmd_t));
+        dq = next;
+    }
+}
+
+static void report(char *what, double listtime, double tabtime, int ops)
+{
+    printf("%-6s list %10.1f ns   arrays %10.1f ns   %6.1fx\n", what,
+           listtime * 1e9 / (double) ops, tabtime * 1e9 / (double) ops,
+           (tabtime > 0) ? listtime / tabtime : 0.0);
+}
+
+void bench_schedule(script_t *script)
+{
+    schedtab_t *tab = &(script->sched);
+    volatile unsigned int sink = 0;
+    unsigned int acc;
+    dqueue_t list;
+    dqueue_t *dq;
+    lstime_t *targets;
+    double t0, listtime, tabtime;
+    int reps, seeks;
+    int r, i;
+
+    if (tab->count == 0) {
+        printf("The schedule is empty, nothing to measure\n");
+        return;
+    }
+
+    buildlist(script, &list);
+
+    reps = SCANEVENTS / tab->count + 1;
+    seeks = SEEKEVENTS / tab->count + 100;
+
+    printf("* Benchmarking %d scheduled frames: %d scans, %d seeks\n", tab->count, reps, seeks);
+    printf("  (the list's nodes are laid out as genevents() allocates and sorts them)\n");
+
+    // Scan
+    t0 = bench_now();
+    for (r = 0; r < reps; r++) {
+        acc = 0;
+        for (dq = list.dq_next; dq != &list; dq = dq->dq_next) {
+            schedcmd_t *cmd = (schedcmd_t *) dq;
+            acc += cmd->stripmask ^ cmd->animation ^ cmd->speed ^ cmd->option ^
+                cmd->palette ^ cmd->direction ^ (unsigned int) cmd->time;
+        }
+        sink += acc;
+    }
+    listtime = bench_now() - t0;
+
+    t0 = bench_now();
+    for (r = 0; r < reps; r++) {
+        acc = 0;
+        for (i = 0; i < tab->count; i++) {
+            acc += tab->stripmask[i] ^ tab->animation[i] ^ tab->speed[i] ^ tab->option[i] ^
+                tab->palette[i] ^ tab->direction[i] ^ (unsigned int) tab->time[i];
+        }
+        sink += acc;
+    }
+    tabtime = bench_now() - t0;
+
+    report("scan", listtime, tabtime, reps * tab->count);
+
+    // Seek to the same random cue times both ways.
+    targets = (lstime_t *) malloc(seeks * sizeof(lstime_t));
+    srand(1);
+    for (i = 0; i < seeks; i++) {
+        targets[i] = (lstime_t) ((double) tab->time[tab->count-1] * ((double) rand() / (double) RAND_MAX));
+    }
+
+    t0 = bench_now();
+    for (i = 0; i < seeks; i++) {
+        for (dq = list.dq_next; dq != &list; dq = dq->dq_next) {
+            if (((schedcmd_t *) dq)->time >= targets[i]) break;
+        }
+        sink += (dq != &list);
+    }
+    listtime = bench_now() - t0;
+
+    t0 = bench_now();
+    for (i = 0; i < seeks; i++) {
+        sink += sched_seek(tab, targets[i]);
+    }
+    tabtime = bench_now() - t0;
+
+    report("seek", listtime, tabtime, seeks);
+
+    free(targets);
+    freelist(&list);
+}
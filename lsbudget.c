@@ -0,0 +1,155 @@
+/*  *********************************************************************
+    *  LightScript - A script processor for LED animations
+    *
+    *  Link Budget                              File: lsbudget.c
+    *
+    *  Models the serial link to the Arduino and checks whether
+    *  the generated schedule can actually be delivered on time.
+    *
+    *  Author:  Mitch Lichtenberg
+    ********************************************************************* */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "lightscript.h"
+
+#define BITSPERBYTE     10              // 8N1: start + 8 data + stop
+#define LATETHRESHOLD   (10*LSTIME_MS)  // Report spans where frames are this late
+
+static void fmtsecs(char *dest, lstime_t t)
+{
+    unsigned int minutes = (unsigned int) (t / (60*LSTIME_SECOND));
+
+    sprintf(dest,"%u:%06.3f",minutes,LSTIME_SECS(t - ((lstime_t) minutes)*60*LSTIME_SECOND));
+}
+
+static void reportspan(lstime_t start, lstime_t end, int frames, lstime_t worst)
+{
+    char s1[32], s2[32];
+
+    fmtsecs(s1,start);
+    fmtsecs(s2,end);
+    printf("Link overrun %s - %s: %d frames, up to %.1fms late\n",s1,s2,frames,LSTIME_SECS(worst) * 1000.0);
+}
+
+//
+// The link is a single queue: each frame goes out when it is due
+// or when the previous frame has finished, whichever is later.
+// While we walk the schedule (and the repeats, which the player
+// sends too) a second cursor trails the first by budget_window,
+// so the frames between them are the window we find the peak in.
+// Returns the number of spans where frames are late.
+//
+int check_linkbudget(script_t *script)
+{
+    lstime_t frametime;
+    lstime_t linefree = 0;
+    lstime_t worst = 0;
+    lstime_t worsttime = 0;
+    double peak = 0;
+    lstime_t peaktime = 0;
+    lstime_t spanstart = 0;
+    lstime_t spanworst = 0;
+    int spanframes = 0;
+    int late = 0;
+    int total = 0;
+    int spans = 0;
+    schedcursor_t cur, wincur;
+    lsevent_t ev;
+    lstime_t t, prev = 0;
+    lstime_t wintime;
+    int winframes = 0;
+    char s1[32];
+
+    if (script->baud <= 0) {
+        return 0;
+    }
+
+    frametime = ((lstime_t) (sizeof(lsmessage_t) + script->frame_overhead) * BITSPERBYTE * LSTIME_SECOND) / script->baud;
+
+    printf("* Checking link budget: %d baud, %d byte frames, %.2fms per frame\n",
+           script->baud, (int) sizeof(lsmessage_t) + script->frame_overhead, LSTIME_SECS(frametime) * 1000.0);
+
+    cursor_seek(&cur, script, 0);
+    cursor_seek(&wincur, script, 0);
+
+    while (cursor_peek(&cur, &t)) {
+        lstime_t start;
+        lstime_t delay;
+        double load;
+
+        cursor_next(&cur, &ev);
+        total++;
+
+        // Slide the window up to this frame
+        winframes++;
+        while (cursor_peek(&wincur, &wintime) && (wintime <= t - script->budget_window)) {
+            cursor_next(&wincur, &ev);
+            winframes--;
+        }
+
+        load = (double) winframes * (double) frametime / (double) script->budget_window;
+        if (load > peak) {
+            peak = load;
+            peaktime = wintime;
+        }
+
+        // Model the queue
+        start = (t > linefree) ? t : linefree;
+        linefree = start + frametime;
+        delay = start - t;
+
+        if (delay > 0) {
+            late++;
+        }
+
+        if (delay > worst) {
+            worst = delay;
+            worsttime = t;
+        }
+
+        // Collect runs of frames that go out noticeably late
+        if (delay > LATETHRESHOLD) {
+            if (spanframes == 0) {
+                spanstart = t;
+                spanworst = 0;
+            }
+            spanframes++;
+            if (delay > spanworst) spanworst = delay;
+        } else if (spanframes) {
+            reportspan(spanstart,prev,spanframes,spanworst);
+            spanframes = 0;
+            spans++;
+        }
+
+        prev = t;
+    }
+
+    cursor_free(&cur);
+    cursor_free(&wincur);
+
+    if (spanframes) {
+        reportspan(spanstart,prev,spanframes,spanworst);
+        spans++;
+    }
+
+    script->budget_peak = peak;
+
+    fmtsecs(s1,peaktime);
+    printf("Peak link utilization %.0f%% in the %.0fms window starting at %s\n",
+           peak * 100.0, LSTIME_SECS(script->budget_window) * 1000.0, s1);
+
+    fmtsecs(s1,worsttime);
+    printf("%d of %d frames wait for the link, worst delay %.1fms at %s\n",
+           late, total, LSTIME_SECS(worst) * 1000.0, s1);
+
+    if (spans) {
+        printf("Warning: %d span%s where frames will be more than %.0fms late\n",
+               spans, (spans == 1) ? "" : "s", LSTIME_SECS(LATETHRESHOLD) * 1000.0);
+    }
+
+    return spans;
+}
@@ -0,0 +1,629 @@
+/*  *********************************************************************
+    *  LightScript - A script processor for LED animations
+    *
+    *  Configuration Cache                      File: lscache.c
+    *
+    *  The configuration file's resolved symbols and macros are
+    *  saved in a compact cache file next to it.  When the config
+    *  has not changed we map the cache instead of parsing the
+    *  config and rebuilding its symbol table.
+    *
+    *  The cache is valid if the config's size and modification
+    *  time (to the nanosecond) match what we saved, or failing
+    *  that, if the hash of its contents does.  A config touched in
+    *  the same clock tick the cache was written is always hashed,
+    *  since the time can't tell an edit made right after we read it.
+    *
+    *  Loading still makes a symbol table entry for every define
+    *  and rebuilds the macro trees, so a bigger config still takes
+    *  longer to load.  What the cache saves is the parsing and
+    *  resolving, which is most of the time but not all of it.
+    *
+    *  Author:  Mitch Lichtenberg
+    ********************************************************************* */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "lightscript.h"
+
+#define CACHEMAGIC      "LSCACHE4"
+#define CACHESUFFIX     ".lsc"
+
+int use_config_cache = 1;
+extern int debug;
+
+typedef struct cachehdr_s {
+    char magic[8];
+    uint64_t srcsize;
+    int64_t srcmtime;           // ns
+    uint64_t srchash;
+    uint32_t nsyms;
+    uint32_t nvalues;
+    uint32_t nmacros;
+    uint32_t nnodes;
+    uint32_t strbytes;
+    uint32_t idle;              // string offsets + 1, 0 = none
+    uint32_t music;
+    uint32_t reserved;
+} cachehdr_t;
+
+typedef struct cachesym_s {
+    uint32_t name;              // string offset
+    uint32_t nvalues;
+    uint32_t values;            // index of first value
+} cachesym_t;
+
+typedef struct cachemacro_s {
+    uint32_t name;
+    uint32_t root;              // node index + 1
+} cachemacro_t;
+
+//
+// Parse tree nodes are flattened into records that refer to
+// each other by index (+1, so 0 can mean NULL).
+//
+typedef struct cachenode_s {
+    int32_t type;
+    int32_t line;
+    int32_t subtype;            // opttype or cmdtype
+    int32_t ival;               // wvalue or val
+    uint32_t a;                 // left, next, lvalue or options
+    uint32_t b;                 // right
+    uint32_t str;               // idstr or str, offset + 1
+    uint32_t pad;
+    int64_t t1;                 // tvalue or from
+    int64_t t2;                 // to
+    int64_t t3;                 // every
+} cachenode_t;
+
+// Layout: header, symbols, values, macros, nodes, strings
+
+/*  *********************************************************************
+    *  Writing
+    ********************************************************************* */
+
+typedef struct cachebuf_s {
+    cachenode_t *nodes;
+    uint32_t nnodes, maxnodes;
+    char *strs;
+    uint32_t strbytes, maxstrs;
+} cachebuf_t;
+
+static uint32_t addstr(cachebuf_t *cb, char *str)
+{
+    uint32_t off = cb->strbytes;
+    uint32_t len = strlen(str) + 1;
+
+    while (cb->strbytes + len > cb->maxstrs) {
+        cb->maxstrs = cb->maxstrs ? cb->maxstrs * 2 : 4096;
+        cb->strs = (char *) realloc(cb->strs, cb->maxstrs);
+    }
+
+    memcpy(cb->strs + off, str, len);
+    cb->strbytes += len;
+
+    return off;
+}
+
+static uint32_t newrec(cachebuf_t *cb, node_t *n)
+{
+    uint32_t idx;
+
+    if (cb->nnodes == cb->maxnodes) {
+        cb->maxnodes = cb->maxnodes ? cb->maxnodes * 2 : 256;
+        cb->nodes = (cachenode_t *) realloc(cb->nodes, cb->maxnodes * sizeof(cachenode_t));
+    }
+
+    idx = cb->nnodes++;
+    memset(&cb->nodes[idx], 0, sizeof(cachenode_t));
+    cb->nodes[idx].type = n->type;
+    cb->nodes[idx].line = n->line;
+
+    return idx;
+}
+
+static uint32_t addnode(cachebuf_t *cb, node_t *n)
+{
+    cachenode_t *cn;
+    uint32_t idx;
+
+    if (!n) {
+        return 0;
+    }
+
+    idx = newrec(cb, n);
+
+    // Careful, the array may move while we recurse.
+    switch (n->type) {
+        case nNODE:
+        {
+            // Lists are long chains of nodes to the right.  Follow the
+            // chain in a loop rather than recursing once per statement;
+            // the records come out in the same order either way.
+            uint32_t prev = idx;
+            uint32_t a = addnode(cb, n->left);
+
+            cb->nodes[prev].a = a;
+            for (n = n->right; n && (n->type == nNODE); n = n->right) {
+                uint32_t next = newrec(cb, n);
+
+                cb->nodes[prev].b = next + 1;
+                a = addnode(cb, n->left);
+                cb->nodes[next].a = a;
+                prev = next;
+            }
+            if (n) {
+                uint32_t b = addnode(cb, n);
+                cb->nodes[prev].b = b;
+            }
+        }
+        break;
+        case nIDLIST:
+        {
+            idlist_t *idl = (idlist_t *) n;
+            uint32_t a = addnode(cb, idl->next);
+            uint32_t str = addstr(cb, idl->idstr) + 1;
+            cn = &cb->nodes[idx];
+            cn->a = a;
+            cn->str = str;
+        }
+        break;
+        case nOPTION:
+        {
+            option_t *opt = (option_t *) n;
+            uint32_t a = addnode(cb, opt->lvalue);
+            cn = &cb->nodes[idx];
+            cn->a = a;
+            cn->subtype = opt->opttype;
+            cn->ival = opt->wvalue;
+            cn->t1 = opt->tvalue;
+        }
+        break;
+        case nSCRIPT:
+        {
+            scriptcmd_t *sc = (scriptcmd_t *) n;
+            uint32_t a = addnode(cb, sc->options);
+            uint32_t str = sc->str ? addstr(cb, sc->str) + 1 : 0;
+            cn = &cb->nodes[idx];
+            cn->a = a;
+            cn->str = str;
+            cn->subtype = sc->cmdtype;
+            cn->ival = sc->val;
+            cn->t1 = sc->from;
+            cn->t2 = sc->to;
+            cn->t3 = sc->every;
+        }
+        break;
+    }
+
+    return idx + 1;
+}
+
+//
+// Modification time in nanoseconds.
+//
+static int64_t mtime_ns(struct stat *st)
+{
+#ifdef __APPLE__
+    return (int64_t) st->st_mtimespec.tv_sec * 1000000000LL + st->st_mtimespec.tv_nsec;
+#else
+    return (int64_t) st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+#endif
+}
+
+static int writecache(char *cachename, struct stat *src, uint64_t hash, script_t *defs)
+{
+    cachebuf_t cb;
+    cachehdr_t hdr;
+    cachesym_t *syms;
+    cachemacro_t *macros;
+    uint32_t *values;
+    uint32_t nsyms = 0, nvalues = 0, nmacros = 0;
+    dqueue_t *dq;
+    char *tmpname;
+    FILE *str;
+    int i, res = 0;
+
+    memset(&cb,0,sizeof(cb));
+
+    for (dq = defs->symbols.dq_next; dq != &(defs->symbols); dq = dq->dq_next) {
+        nsyms++;
+        nvalues += ((symbol_t *) dq)->nvalues;
+    }
+    for (dq = defs->macros.dq_next; dq != &(defs->macros); dq = dq->dq_next) {
+        nmacros++;
+    }
+
+    syms = (cachesym_t *) calloc(nsyms ? nsyms : 1, sizeof(cachesym_t));
+    values = (uint32_t *) calloc(nvalues ? nvalues : 1, sizeof(uint32_t));
+    macros = (cachemacro_t *) calloc(nmacros ? nmacros : 1, sizeof(cachemacro_t));
+
+    nsyms = nvalues = 0;
+    for (dq = defs->symbols.dq_next; dq != &(defs->symbols); dq = dq->dq_next) {
+        symbol_t *sym = (symbol_t *) dq;
+        syms[nsyms].name = addstr(&cb, sym->name);
+        syms[nsyms].nvalues = sym->nvalues;
+        syms[nsyms].values = nvalues;
+        for (i = 0; i < sym->nvalues; i++) {
+            values[nvalues++] = sym->wvalues[i];
+        }
+        nsyms++;
+    }
+
+    nmacros = 0;
+    for (dq = defs->macros.dq_next; dq != &(defs->macros); dq = dq->dq_next) {
+        symbol_t *sym = (symbol_t *) dq;
+        macros[nmacros].name = addstr(&cb, sym->name);
+        macros[nmacros].root = addnode(&cb, (node_t *) sym->pvalue);
+        nmacros++;
+    }
+
+    memset(&hdr,0,sizeof(hdr));
+    memcpy(hdr.magic, CACHEMAGIC, sizeof(hdr.magic));
+    hdr.srcsize = src->st_size;
+    hdr.srcmtime = mtime_ns(src);
+    hdr.srchash = hash;
+    hdr.nsyms = nsyms;
+    hdr.nvalues = nvalues;
+    hdr.nmacros = nmacros;
+    hdr.idle = defs->idleanimation ? addstr(&cb, defs->idleanimation) + 1 : 0;
+    hdr.music = defs->musicfile ? addstr(&cb, defs->musicfile) + 1 : 0;
+    hdr.nnodes = cb.nnodes;
+    hdr.strbytes = cb.strbytes;
+
+    // Write it somewhere else and rename, so nobody sees half a cache.
+    tmpname = (char *) malloc(strlen(cachename) + 16);
+    sprintf(tmpname,"%s.%d",cachename,(int) getpid());
+
+    str = fopen(tmpname,"wb");
+    if (str) {
+        fwrite(&hdr, sizeof(hdr), 1, str);
+        fwrite(syms, sizeof(cachesym_t), nsyms, str);
+        fwrite(values, sizeof(uint32_t), nvalues, str);
+        fwrite(macros, sizeof(cachemacro_t), nmacros, str);
+        fwrite(cb.nodes, sizeof(cachenode_t), cb.nnodes, str);
+        fwrite(cb.strs, 1, cb.strbytes, str);
+        if ((fclose(str) != 0) || (rename(tmpname, cachename) < 0)) {
+            unlink(tmpname);
+            res = -1;
+        }
+    } else {
+        res = -1;
+    }
+
+    free(tmpname);
+    free(syms);
+    free(values);
+    free(macros);
+    free(cb.nodes);
+    free(cb.strs);
+
+    return res;
+}
+
+/*  *********************************************************************
+    *  Reading
+    ********************************************************************* */
+
+static node_t **buildnodes(cachenode_t *cn, uint32_t nnodes, char *strs)
+{
+    node_t **nodes;
+    uint32_t i;
+
+#define NODEPTR(x) ((x) ? nodes[(x)-1] : NULL)
+#define STRPTR(x) ((x) ? strs + (x) - 1 : NULL)
+
+    nodes = (node_t **) calloc(nnodes ? nnodes : 1, sizeof(node_t *));
+
+    for (i = 0; i < nnodes; i++) {
+        switch (cn[i].type) {
+            case nIDLIST:
+                nodes[i] = (node_t *) stats_calloc(MEM_PARSE,1,sizeof(idlist_t));
+                break;
+            case nOPTION:
+                nodes[i] = (node_t *) stats_calloc(MEM_PARSE,1,sizeof(option_t));
+                break;
+            case nSCRIPT:
+                nodes[i] = (node_t *) stats_calloc(MEM_PARSE,1,sizeof(scriptcmd_t));
+                break;
+            default:
+                nodes[i] = (node_t *) stats_calloc(MEM_PARSE,1,sizeof(node_t));
+                break;
+        }
+        nodes[i]->type = cn[i].type;
+        nodes[i]->line = cn[i].line;
+    }
+
+    for (i = 0; i < nnodes; i++) {
+        switch (cn[i].type) {
+            case nNODE:
+                nodes[i]->left = NODEPTR(cn[i].a);
+                nodes[i]->right = NODEPTR(cn[i].b);
+                break;
+            case nIDLIST:
+                ((idlist_t *) nodes[i])->next = NODEPTR(cn[i].a);
+                ((idlist_t *) nodes[i])->idstr = STRPTR(cn[i].str);
+                break;
+            case nOPTION:
+                ((option_t *) nodes[i])->lvalue = NODEPTR(cn[i].a);
+                ((option_t *) nodes[i])->opttype = cn[i].subtype;
+                ((option_t *) nodes[i])->wvalue = cn[i].ival;
+                ((option_t *) nodes[i])->tvalue = cn[i].t1;
+                break;
+            case nSCRIPT:
+                ((scriptcmd_t *) nodes[i])->options = NODEPTR(cn[i].a);
+                ((scriptcmd_t *) nodes[i])->str = STRPTR(cn[i].str);
+                ((scriptcmd_t *) nodes[i])->cmdtype = cn[i].subtype;
+                ((scriptcmd_t *) nodes[i])->val = cn[i].ival;
+                ((scriptcmd_t *) nodes[i])->from = cn[i].t1;
+                ((scriptcmd_t *) nodes[i])->to = cn[i].t2;
+                ((scriptcmd_t *) nodes[i])->every = cn[i].t3;
+                break;
+        }
+    }
+
+    // The caller picks out the roots and frees the array.
+    return nodes;
+}
+
+//
+// Everything in the cache refers to everything else by index, so
+// check every index before we use one.  A cache that was cut short
+// or edited by hand is thrown away and the config parsed again.
+//
+static int checkcache(cachehdr_t *hdr, cachesym_t *syms, cachemacro_t *macros,
+                      cachenode_t *cnodes, char *strs)
+{
+    uint32_t i;
+
+    if ((hdr->strbytes > 0) && (strs[hdr->strbytes-1] != 0)) {
+        return -1;
+    }
+
+    if ((hdr->idle > hdr->strbytes) || (hdr->music > hdr->strbytes)) {
+        return -1;
+    }
+
+    for (i = 0; i < hdr->nsyms; i++) {
+        if ((syms[i].nvalues > MAXVALUES) ||
+            ((uint64_t) syms[i].values + syms[i].nvalues > hdr->nvalues) ||
+            (syms[i].name >= hdr->strbytes)) {
+            return -1;
+        }
+    }
+
+    for (i = 0; i < hdr->nmacros; i++) {
+        if ((macros[i].name >= hdr->strbytes) || (macros[i].root > hdr->nnodes)) {
+            return -1;
+        }
+    }
+
+    for (i = 0; i < hdr->nnodes; i++) {
+        if ((cnodes[i].a > hdr->nnodes) || (cnodes[i].b > hdr->nnodes) ||
+            (cnodes[i].str > hdr->strbytes)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+//
+// Map a cache file and turn it back into symbol and macro tables.
+// The symbol names and other strings point into the map, which
+// stays around for the life of the program.
+//
+static int readcache(char *cachename, struct stat *src, char *configfilename, script_t *defs)
+{
+    struct stat statbuf;
+    cachehdr_t *hdr;
+    cachesym_t *syms;
+    uint32_t *values;
+    cachemacro_t *macros;
+    cachenode_t *cnodes;
+    char *strs;
+    node_t **nodes = NULL;
+    symbol_t *symtab;
+    uint64_t expect;
+    char *map;
+    uint32_t i;
+    int fd;
+
+    fd = open(cachename,O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if ((fstat(fd,&statbuf) < 0) || (statbuf.st_size < (off_t) sizeof(cachehdr_t))) {
+        close(fd);
+        return -1;
+    }
+
+    map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    // The counts are 32 bits, so in 64 bits none of this can wrap.
+    hdr = (cachehdr_t *) map;
+    expect = (uint64_t) sizeof(cachehdr_t) +
+        (uint64_t) hdr->nsyms * sizeof(cachesym_t) +
+        (uint64_t) hdr->nvalues * sizeof(uint32_t) +
+        (uint64_t) hdr->nmacros * sizeof(cachemacro_t) +
+        (uint64_t) hdr->nnodes * sizeof(cachenode_t) +
+        (uint64_t) hdr->strbytes;
+
+    if ((memcmp(hdr->magic, CACHEMAGIC, sizeof(hdr->magic)) != 0) || (expect != (uint64_t) statbuf.st_size) ||
+        (hdr->srcsize != (uint64_t) src->st_size)) {
+        munmap(map, statbuf.st_size);
+        return -1;
+    }
+
+    syms = (cachesym_t *) (hdr + 1);
+    values = (uint32_t *) (syms + hdr->nsyms);
+    macros = (cachemacro_t *) (values + hdr->nvalues);
+    cnodes = (cachenode_t *) (macros + hdr->nmacros);
+    strs = (char *) (cnodes + hdr->nnodes);
+
+    if (checkcache(hdr, syms, macros, cnodes, strs) < 0) {
+        munmap(map, statbuf.st_size);
+        return -1;
+    }
+
+    // Same size but touched since we saved it, or maybe touched in
+    // the tick we saved it in?  Then the contents decide.
+    if ((hdr->srcmtime != mtime_ns(src)) || (hdr->srcmtime >= mtime_ns(&statbuf))) {
+        char *cfg;
+
+        fd = open(configfilename,O_RDONLY);
+        cfg = (fd >= 0) ? mmap(NULL, src->st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        if (fd >= 0) close(fd);
+
+        if ((cfg == MAP_FAILED) || (hashbytes(cfg, src->st_size) != hdr->srchash)) {
+            if (cfg != MAP_FAILED) munmap(cfg, src->st_size);
+            munmap(map, statbuf.st_size);
+            return -1;
+        }
+        munmap(cfg, src->st_size);
+
+        // Still good, remember the new time so we don't hash it again.
+        fd = open(cachename,O_WRONLY);
+        if (fd >= 0) {
+            int64_t mtime = mtime_ns(src);
+            (void) pwrite(fd, &mtime, sizeof(mtime), offsetof(cachehdr_t, srcmtime));
+            close(fd);
+        }
+    }
+
+    // All the symbols in one allocation.
+    symtab = (symbol_t *) stats_calloc(MEM_SYMBOLS, hdr->nsyms ? hdr->nsyms : 1, sizeof(symbol_t));
+
+    for (i = 0; i < hdr->nsyms; i++) {
+        symtab[i].name = strs + syms[i].name;
+        symtab[i].nvalues = syms[i].nvalues;
+        memcpy(symtab[i].wvalues, &values[syms[i].values], syms[i].nvalues * sizeof(uint32_t));
+        dq_enqueue(&(defs->symbols), &(symtab[i].link));
+    }
+
+    if (hdr->nmacros) {
+        nodes = buildnodes(cnodes, hdr->nnodes, strs);
+    }
+
+    for (i = 0; i < hdr->nmacros; i++) {
+        symbol_t *sym = (symbol_t *) stats_calloc(MEM_SYMBOLS,1,sizeof(symbol_t));
+        sym->name = strs + macros[i].name;
+        sym->pvalue = macros[i].root ? nodes[macros[i].root - 1] : NULL;
+        dq_enqueue(&(defs->macros), &(sym->link));
+    }
+
+    free(nodes);
+
+    defs->idleanimation = hdr->idle ? strs + hdr->idle - 1 : NULL;
+    defs->musicfile = hdr->music ? strs + hdr->music - 1 : NULL;
+
+    return 0;
+}
+
+/*  *********************************************************************
+    *  load_config(configfilename, errors)
+    *
+    *  Get the resolved definitions from a configuration file,
+    *  from the cache if we can.  Returns NULL if there is no
+    *  config file, and sets *errors if the config has errors.
+    ********************************************************************* */
+
+script_t *load_config(char *configfilename, int *errors)
+{
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    static script_t *last = NULL;
+    static struct stat laststat;
+    static char *lastname = NULL;
+    struct stat statbuf;
+    script_t *defs;
+    lsparse_t ps;
+    char *cachename;
+    uint64_t hash;
+
+    *errors = 0;
+
+    if (stat(configfilename,&statbuf) < 0) {
+        fprintf(stderr,"Could not open %s : %s\n",configfilename,strerror(errno));
+        return NULL;
+    }
+
+    // The daemon compiles many shows against the same config,
+    // so remember the last one we loaded.
+    pthread_mutex_lock(&lock);
+    if (last && (strcmp(lastname, configfilename) == 0) &&
+        (laststat.st_size == statbuf.st_size) && (mtime_ns(&laststat) == mtime_ns(&statbuf))) {
+        defs = last;
+        pthread_mutex_unlock(&lock);
+        return defs;
+    }
+    pthread_mutex_unlock(&lock);
+
+    defs = (script_t *) calloc(1,sizeof(script_t));
+    initscript(defs);
+
+    cachename = (char *) malloc(strlen(configfilename) + sizeof(CACHESUFFIX));
+    sprintf(cachename,"%s%s",configfilename,CACHESUFFIX);
+
+    if (use_config_cache && (readcache(cachename, &statbuf, configfilename, defs) == 0)) {
+        if (debug) printf("[Using configuration cache %s]\n",cachename);
+    } else {
+        if (parse_file(&ps, configfilename) < 0) {
+            free(cachename);
+            return NULL;
+        }
+        if (ps.errors) {
+            *errors = ps.errors;
+            free(cachename);
+            return NULL;
+        }
+        if (!ps.tree) {
+            free(cachename);
+            return NULL;
+        }
+
+        defs->scripttree = ps.tree;
+        savedefines(defs, ps.tree);
+
+        // Included files could change without the config changing,
+        // so only configs that stand alone are cached.
+        if (use_config_cache && (defs->imports.dq_next == &(defs->imports))) {
+            int fd = open(configfilename,O_RDONLY);
+            char *cfg = (fd >= 0) ? mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+
+            if (fd >= 0) close(fd);
+            if (cfg != MAP_FAILED) {
+                hash = hashbytes(cfg, statbuf.st_size);
+                munmap(cfg, statbuf.st_size);
+                if ((writecache(cachename, &statbuf, hash, defs) == 0) && debug) {
+                    printf("[Saved configuration cache %s]\n",cachename);
+                }
+            }
+        }
+    }
+
+    free(cachename);
+
+    pthread_mutex_lock(&lock);
+    last = defs;
+    laststat = statbuf;
+    free(lastname);
+    lastname = strdup(configfilename);
+    pthread_mutex_unlock(&lock);
+
+    return defs;
+}
@@ -0,0 +1,139 @@
+/*  *********************************************************************
+    *  LightScript - A script processor for LED animations
+    *
+    *  Playback Clock                           File: lsclock.c
+    *
+    *  Everything that plays a show asks this clock what time it
+    *  is, and tells it when it has nothing to do until a deadline.
+    *  Normally that is the monotonic clock: a wait sleeps until just
+    *  before the deadline and spins the rest of the way, so the
+    *  player isn't burning a CPU (at real-time priority with -R)
+    *  between frames.  For a dry run the clock is
+    *  virtual: it starts at zero and a wait jumps it straight to
+    *  the deadline, so a whole show goes through the real dispatch
+    *  code as fast as the code can run, the same way every time.
+    *
+    *  Author:  Mitch Lichtenberg
+    ********************************************************************* */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include "lightscript.h"
+
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#endif
+
+#define WAITSPIN        (LSTIME_MS/5)   // spin this much of a wait, sleep the rest
+#define WAITNAP         (1*LSTIME_MS)   // longest sleep before the player looks around
+
+typedef struct lsclock_s {
+    char *name;
+    lstime_t (*now)(void);
+    void (*wait)(lstime_t deadline);
+} lsclock_t;
+
+//
+// Monotonic clock in ticks.  Only differences matter, so it does not
+// need an epoch, and it doesn't jump if someone sets the time of day.
+//
+lstime_t current_ticks(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (lstime_t) ts.tv_sec * LSTIME_SECOND + (lstime_t) ts.tv_nsec;
+}
+
+static void sleep_until(lstime_t wake, lstime_t now)
+{
+#ifdef __APPLE__
+    static mach_timebase_info_data_t tb;
+
+    if (tb.denom == 0) {
+        mach_timebase_info(&tb);
+    }
+    mach_wait_until(mach_absolute_time() + (uint64_t) (wake - now) * tb.denom / tb.numer);
+#else
+    struct timespec ts;
+
+    ts.tv_sec = wake / LSTIME_SECOND;
+    ts.tv_nsec = wake % LSTIME_SECOND;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+#endif
+}
+
+//
+// A long wait comes back after WAITNAP without reaching the deadline,
+// so the player can look for the controller's acks and injected
+// events.  It just calls us again.
+//
+static void real_wait(lstime_t deadline)
+{
+    lstime_t now = current_ticks();
+    lstime_t wake;
+
+    if (deadline - now > WAITSPIN) {
+        wake = deadline - WAITSPIN;
+        if (wake - now > WAITNAP) {
+            wake = now + WAITNAP;
+        }
+        sleep_until(wake, now);
+        return;
+    }
+
+    while (current_ticks() < deadline) {
+    }
+}
+
+static lstime_t virtual_now_ticks;
+
+static lstime_t virtual_now(void)
+{
+    return virtual_now_ticks;
+}
+
+static void virtual_wait(lstime_t deadline)
+{
+    if (deadline > virtual_now_ticks) {
+        virtual_now_ticks = deadline;
+    }
+}
+
+static lsclock_t real_clock = {"real", current_ticks, real_wait};
+static lsclock_t virtual_clock = {"virtual", virtual_now, virtual_wait};
+
+static lsclock_t *playclock = &real_clock;
+
+lstime_t clock_now(void)
+{
+    return playclock->now();
+}
+
+void clock_wait(lstime_t deadline)
+{
+    playclock->wait(deadline);
+}
+
+int clock_is_virtual(void)
+{
+    return (playclock == &virtual_clock);
+}
+
+//
+// Switch between the clocks.  The virtual clock starts over at zero.
+//
+void clock_use_virtual(int on)
+{
+    if (on) {
+        virtual_now_ticks = 0;
+        playclock = &virtual_clock;
+    } else {
+        playclock = &real_clock;
+    }
+}
@@ -0,0 +1,492 @@
+/*  *********************************************************************
+    *  LightScript - A script processor for LED animations
+    *
+    *  Resident Daemon                          File: lsdaemon.c
+    *
+    *  Keeps the Arduino device open and a set of compiled shows
+    *  in memory, and takes commands from a Unix domain socket so
+    *  a cue can start without the cost of starting a process.
+    *
+    *  Commands, one per line:
+    *
+    *      load <name> <scriptfile>     compile a show and keep it
+    *      unload <name>                forget a show
+    *      play <name> [start[-end]]    play a show (stops the current one)
+    *      mplay <name> [start[-end]]   play a show with its music
+    *      seek <time>                  restart the current show at a time
+    *      stop                         stop the current show
+    *      list                         list the loaded shows
+    *      quit                         shut down the daemon
+    *
+    *  Author:  Mitch Lichtenberg
+    ********************************************************************* */
+
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "lightscript.h"
+
+#define MAXCLIENTS      8
+#define MAXLINE         1024
+
+typedef struct show_s {
+    dqueue_t link;
+    char *name;
+    char *filename;
+    char *musicpath;            // full path of the music, ours to free
+    script_t script;
+} show_t;
+
+typedef struct client_s {
+    int fd;
+    int len;
+    char buf[MAXLINE];
+} client_t;
+
+typedef struct daemon_s {
+    char *configfilename;
+    script_t *opts;             // options from the command line
+    lssink_t *sink;
+    dqueue_t shows;
+
+    // The show that is playing now, if any.
+    show_t *current;
+    int how;
+    int playing;                // thread started and not yet joined
+    volatile int running;       // thread still in the show
+    pthread_t thread;
+
+    int quit;
+} daemon_t;
+
+
+static show_t *findshow(daemon_t *d, char *name)
+{
+    dqueue_t *dq;
+
+    for (dq = d->shows.dq_next; dq != &(d->shows); dq = dq->dq_next) {
+        show_t *show = (show_t *) dq;
+        if (strcmp(show->name, name) == 0) {
+            return show;
+        }
+    }
+
+    return NULL;
+}
+
+//
+// Only for a show that is not d->current: the play thread may
+// still be looking at that one.
+//
+static void freeshow(show_t *show)
+{
+    freescript(&(show->script));
+    free(show->musicpath);
+    free(show->name);
+    free(show->filename);
+    free(show);
+}
+
+static void reply(int fd, char *fmt, ...)
+{
+    char buf[MAXLINE];
+    va_list ap;
+    int len;
+
+    va_start(ap,fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    if (len >= (int) sizeof(buf)) len = sizeof(buf) - 1;
+
+    // Nothing we can do if the client went away.
+    (void) write(fd, buf, len);
+}
+
+/*  *********************************************************************
+    *  Playback thread
+    ********************************************************************* */
+
+static void *playthread(void *arg)
+{
+    daemon_t *d = (daemon_t *) arg;
+    script_t *script = &(d->current->script);
+
+    realtime_setup(script);
+
+    play_show(script, d->how);
+
+    // Keep what the pings found during the show for the next one.
+    // startshow() only reads this after joining us.
+    d->opts->latency = script->latency;
+
+    // Go back to idle if the show ran to the end.  If we were
+    // stopped, whoever stopped us decides what happens next.
+    if (!script->abort) {
+        play_idle(script);
+    }
+
+    d->running = 0;
+    return NULL;
+}
+
+static void stopshow(daemon_t *d)
+{
+    if (!d->playing) {
+        return;
+    }
+
+    d->current->script.abort = 1;
+    pthread_join(d->thread, NULL);
+    d->playing = 0;
+}
+
+static int startshow(daemon_t *d, show_t *show, int how, lstime_t start_cue, lstime_t end_cue)
+{
+    stopshow(d);
+
+    if ((how == 1) && !show->script.musicfile) {
+        return -1;
+    }
+
+    d->current = show;
+    d->how = how;
+
+    show->script.sink = d->sink;
+    show->script.start_cue = start_cue;
+    show->script.end_cue = end_cue;
+
+    // Everything is already compiled, don't hold back the first
+    // event, except to send it early enough to land on time.
+    show->script.start_offset = d->opts->latency;
+    show->script.latency = d->opts->latency;
+    show->script.lat = d->opts->lat;
+
+    show->script.realtime = d->opts->realtime;
+    show->script.rtcpu = d->opts->rtcpu;
+
+    d->running = 1;
+    if (pthread_create(&(d->thread), NULL, playthread, d) != 0) {
+        d->running = 0;
+        return -1;
+    }
+
+    d->playing = 1;
+    return 0;
+}
+
+/*  *********************************************************************
+    *  Commands
+    ********************************************************************* */
+
+static void parserange(char *str, lstime_t *start, lstime_t *end)
+{
+    char *x;
+
+    *start = 0;
+    *end = 0;
+
+    if (!str) {
+        return;
+    }
+
+    if ((x = strchr(str,'-'))) {
+        *x++ = 0;
+        *end = parsetime(x);
+    }
+    *start = parsetime(str);
+}
+
+static void loadshow(daemon_t *d, int fd, char *name, char *filename)
+{
+    show_t *show;
+
+    if (!name || !filename) {
+        reply(fd,"ERR usage: load <name> <scriptfile>\n");
+        return;
+    }
+
+    show = (show_t *) calloc(1,sizeof(show_t));
+    initscript(&(show->script));
+
+    if (compile_script(&(show->script), d->configfilename, filename) < 0) {
+        reply(fd,"ERR could not compile %s\n",filename);
+        freeshow(show);
+        return;
+    }
+    genschedule(&(show->script));
+
+    // mplay needs the full path of the music file.
+    if (show->script.musicfile) {
+        show->musicpath = realpath(show->script.musicfile,NULL);
+        if (show->musicpath) show->script.musicfile = show->musicpath;
+    }
+
+    // Replace any show with the same name, unless it is playing.
+    {
+        show_t *old = findshow(d, name);
+
+        if (old && (d->current == old)) {
+            if (d->running) {
+                reply(fd,"ERR show %s is playing\n",name);
+                freeshow(show);
+                return;
+            }
+            stopshow(d);
+            d->current = NULL;
+        }
+        if (old) {
+            dq_dequeue(&(old->link));
+            freeshow(old);
+        }
+    }
+
+    show->name = strdup(name);
+    show->filename = strdup(filename);
+    dq_enqueue(&(d->shows), &(show->link));
+
+    reply(fd,"OK loaded %s\n",name);
+}
+
+static void docommand(daemon_t *d, int fd, char *line)
+{
+    char *argv[4];
+    int argc = 0;
+    char *tok;
+    show_t *show;
+    lstime_t start, end;
+
+    while ((argc < 4) && (tok = strsep(&line," \t\r\n"))) {
+        if (*tok) argv[argc++] = tok;
+    }
+    while (argc < 4) argv[argc++] = NULL;
+
+    if (!argv[0]) {
+        return;
+    }
+
+    if (strcmp(argv[0],"load") == 0) {
+        loadshow(d, fd, argv[1], argv[2]);
+    } else if (strcmp(argv[0],"unload") == 0) {
+        show = argv[1] ? findshow(d, argv[1]) : NULL;
+        if (!show) {
+            reply(fd,"ERR no such show\n");
+        } else if (d->running && (d->current == show)) {
+            reply(fd,"ERR show %s is playing\n",argv[1]);
+        } else {
+            if (d->current == show) {
+                stopshow(d);
+                d->current = NULL;
+            }
+            dq_dequeue(&(show->link));
+            freeshow(show);
+            reply(fd,"OK\n");
+        }
+    } else if ((strcmp(argv[0],"play") == 0) || (strcmp(argv[0],"mplay") == 0)) {
+        show = argv[1] ? findshow(d, argv[1]) : NULL;
+        if (!show) {
+            reply(fd,"ERR no such show\n");
+            return;
+        }
+        parserange(argv[2], &start, &end);
+        if (startshow(d, show, (argv[0][0] == 'm') ? 1 : 0, start, end) < 0) {
+            reply(fd,"ERR could not play %s\n",argv[1]);
+        } else {
+            reply(fd,"OK playing %s\n",argv[1]);
+        }
+    } else if (strcmp(argv[0],"seek") == 0) {
+        if (!d->current || !argv[1]) {
+            reply(fd,"ERR nothing to seek\n");
+            return;
+        }
+        parserange(argv[1], &start, &end);
+        if (startshow(d, d->current, d->how, start, d->current->script.end_cue) < 0) {
+            reply(fd,"ERR could not seek\n");
+        } else {
+            reply(fd,"OK\n");
+        }
+    } else if (strcmp(argv[0],"stop") == 0) {
+        stopshow(d);
+        if (d->current) play_idle(&(d->current->script));
+        reply(fd,"OK\n");
+    } else if (strcmp(argv[0],"list") == 0) {
+        dqueue_t *dq;
+        for (dq = d->shows.dq_next; dq != &(d->shows); dq = dq->dq_next) {
+            show = (show_t *) dq;
+            reply(fd,"%s %s%s\n",show->name,show->filename,
+                  (d->running && (d->current == show)) ? " (playing)" : "");
+        }
+        reply(fd,"OK\n");
+    } else if (strcmp(argv[0],"quit") == 0) {
+        d->quit = 1;
+        reply(fd,"OK\n");
+    } else {
+        reply(fd,"ERR unknown command '%s'\n",argv[0]);
+    }
+}
+
+//
+// Pull any complete lines out of a client's buffer and run them.
+// Returns -1 if the client has gone away.
+//
+static int readclient(daemon_t *d, client_t *c)
+{
+    char *eol;
+    int res;
+
+    res = read(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+    if (res <= 0) {
+        return -1;
+    }
+    c->len += res;
+    c->buf[c->len] = 0;
+
+    while ((eol = strchr(c->buf,'\n'))) {
+        *eol++ = 0;
+        docommand(d, c->fd, c->buf);
+        c->len -= (eol - c->buf);
+        memmove(c->buf, eol, c->len + 1);
+    }
+
+    // Line too long, throw it away.
+    if (c->len == sizeof(c->buf) - 1) {
+        c->len = 0;
+    }
+
+    return 0;
+}
+
+/*  *********************************************************************
+    *  run_daemon(sockname, device_name, configfilename, opts)
+    *
+    *  Open the device and the control socket and process commands
+    *  until we are told to quit.
+    ********************************************************************* */
+
+int run_daemon(char *sockname, char *device_name, char *configfilename, script_t *opts)
+{
+    daemon_t d;
+    client_t clients[MAXCLIENTS];
+    struct pollfd fds[MAXCLIENTS+1];
+    struct sockaddr_un addr;
+    int listener;
+    int nclients = 0;
+    int i;
+
+    memset(&d,0,sizeof(d));
+    dq_init(&(d.shows));
+    d.configfilename = configfilename;
+    d.opts = opts;
+
+    // A client going away in the middle of a reply shouldn't kill us.
+    signal(SIGPIPE, SIG_IGN);
+
+    if (device_name != NULL) {
+        d.sink = sink_open(device_name);
+        if (!d.sink) {
+            return 1;
+        }
+
+        // Shows pick up what we measure here, see startshow().
+        opts->sink = d.sink;
+        latency_calibrate(opts);
+        opts->sink = NULL;
+    }
+
+    if (strlen(sockname) >= sizeof(addr.sun_path)) {
+        fprintf(stderr,"Socket name %s is too long\n",sockname);
+        return 1;
+    }
+
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        perror("socket");
+        return 1;
+    }
+
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sockname);
+    unlink(sockname);
+
+    if ((bind(listener, (struct sockaddr *) &addr, sizeof(addr)) < 0) || (listen(listener, MAXCLIENTS) < 0)) {
+        fprintf(stderr,"Could not listen on %s : %s\n",sockname,strerror(errno));
+        close(listener);
+        return 1;
+    }
+
+    printf("* Listening for commands on %s\n",sockname);
+    fflush(stdout);
+
+    while (!d.quit) {
+        fds[0].fd = listener;
+        fds[0].events = POLLIN;
+        for (i = 0; i < nclients; i++) {
+            fds[i+1].fd = clients[i].fd;
+            fds[i+1].events = POLLIN;
+        }
+
+        if (poll(fds, nclients+1, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+
+        for (i = nclients-1; i >= 0; i--) {
+            if (fds[i+1].revents & (POLLIN | POLLHUP | POLLERR)) {
+                if (readclient(&d, &clients[i]) < 0) {
+                    close(clients[i].fd);
+                    clients[i] = clients[--nclients];
+                }
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listener, NULL, NULL);
+
+            if (fd >= 0) {
+                if (nclients == MAXCLIENTS) {
+                    reply(fd,"ERR too many clients\n");
+                    close(fd);
+                } else {
+                    clients[nclients].fd = fd;
+                    clients[nclients].len = 0;
+                    nclients++;
+                }
+            }
+        }
+
+        fflush(stdout);
+    }
+
+    stopshow(&d);
+    d.current = NULL;
+
+    while (d.shows.dq_next != &(d.shows)) {
+        show_t *show = (show_t *) d.shows.dq_next;
+
+        dq_dequeue(&(show->link));
+        freeshow(show);
+    }
+
+    for (i = 0; i < nclients; i++) {
+        close(clients[i].fd);
+    }
+    close(listener);
+    unlink(sockname);
+
+    sink_close(d.sink);
+
+    return 0;
+}
@@ -0,0 +1,362 @@
+/*  *********************************************************************
+    *  LightScript - A script processor for LED animations
+    *
+    *  Schedule Dump                            File: lsdump.c
+    *
+    *  Prints the finished schedule after it is generated, in the
+    *  same format as printsched1() but much faster: each line is
+    *  formatted by hand into a large buffer, and animation names
+    *  come from a sorted table instead of searching the symbol
+    *  lists.  The dump can go to a file, be limited to a time
+    *  range or to some strips, or be turned off (-q).  Repeats
+    *  are listed after the schedule, one pass each.
+    *
+    *  Author:  Mitch Lichtenberg
+    ********************************************************************* */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include "lightscript.h"
+
+#define DUMPBUF         (1024*1024)     // bytes buffered before each write
+#define MAXLINE         256             // longer than any line we print
+
+typedef struct valname_s {
+    unsigned int value;
+    int order;                          // where findval() would find it
+    char *name;
+} valname_t;
+
+typedef struct nametab_s {
+    valname_t *names;
+    int count;
+    int max;
+} nametab_t;
+
+/*  *********************************************************************
+    *  Animation names
+    ********************************************************************* */
+
+//
+// Collect names in the order lookupval() searches, so when two
+// symbols have the same value we keep the one it would return.
+//
+static void collectnames(nametab_t *nt, script_t *script)
+{
+    dqueue_t *qb;
+
+    for (qb = script->symbols.dq_next; qb != &(script->symbols); qb = qb->dq_next) {
+        symbol_t *sym = (symbol_t *) qb;
+
+        if (sym->nvalues != 1) {
+            continue;
+        }
+
+        if (nt->count == nt->max) {
+            nt->max = nt->max ? nt->max * 2 : 256;
+            nt->names = (valname_t *) realloc(nt->names, nt->max * sizeof(valname_t));
+        }
+        nt->names[nt->count].value = sym->wvalues[0];
+        nt->names[nt->count].order = nt->count;
+        nt->names[nt->count].name = sym->name;
+        nt->count++;
+    }
+
+    for (qb = script->imports.dq_next; qb != &(script->imports); qb = qb->dq_next) {
+        collectnames(nt, ((import_t *) qb)->defs);
+    }
+}
+
+static int cmpname(const void *a, const void *b)
+{
+    const valname_t *x = (const valname_t *) a;
+    const valname_t *y = (const valname_t *) b;
+
+    if (x->value != y->value) {
+        return (x->value < y->value) ? -1 : 1;
+    }
+    return x->order - y->order;
+}
+
+static void buildnames(nametab_t *nt, script_t *script)
+{
+    int i, n;
+
+    memset(nt, 0, sizeof(nametab_t));
+    collectnames(nt, script);
+
+    if (nt->count == 0) {
+        return;
+    }
+
+    qsort(nt->names, nt->count, sizeof(valname_t), cmpname);
+
+    // Keep the first of each value.
+    n = 1;
+    for (i = 1; i < nt->count; i++) {
+        if (nt->names[i].value != nt->names[n-1].value) {
+            nt->names[n++] = nt->names[i];
+        }
+    }
+    nt->count = n;
+}
+
+static char *findname(nametab_t *nt, unsigned int value)
+{
+    int lo = 0;
+    int hi = nt->count;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (nt->names[mid].value < value) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if ((lo < nt->count) && (nt->names[lo].value == value)) {
+        return nt->names[lo].name;
+    }
+
+    return NULL;
+}
+
+/*  *********************************************************************
+    *  Formatting
+    ********************************************************************* */
+
+//
+// Unsigned number, right justified in at least 'width' columns.
+//
+static inline char *putnum(char *p, unsigned int v, int width)
+{
+    char digits[12];
+    int n = 0;
+
+    do {
+        digits[n++] = '0' + (v % 10);
+        v /= 10;
+    } while (v);
+
+    while (width-- > n) {
+        *p++ = ' ';
+    }
+    while (n) {
+        *p++ = digits[--n];
+    }
+
+    return p;
+}
+
+static inline char *putstr(char *p, const char *s)
+{
+    while (*s) {
+        *p++ = *s++;
+    }
+    return p;
+}
+
+//
+// Same as fmttime() in lsmain.c padded to 8 columns: "%2u:%05.02f".
+//
+static char *puttime(char *p, lstime_t t)
+{
+    char tmp[32];
+    char *q = tmp;
+    unsigned int minutes = (unsigned int) (t / (60*LSTIME_SECOND));
+    lstime_t rem = t - ((lstime_t) minutes)*60*LSTIME_SECOND;
+    unsigned int hundredths;
+    int len, pad;
+
+    if ((rem % (10*LSTIME_MS)) == 5*LSTIME_MS) {
+        // Exactly halfway, printf rounds the double, which may go
+        // either way.  Rare enough to just ask it.
+        len = snprintf(tmp, sizeof(tmp), "%2u:%05.02f", minutes, LSTIME_SECS(rem));
+    } else {
+        hundredths = (unsigned int) ((rem + 5*LSTIME_MS) / (10*LSTIME_MS));
+        q = putnum(q, minutes, 2);
+        *q++ = ':';
+        *q++ = '0' + (hundredths / 1000) % 10;
+        *q++ = '0' + (hundredths / 100) % 10;
+        *q++ = '.';
+        *q++ = '0' + (hundredths / 10) % 10;
+        *q++ = '0' + hundredths % 10;
+        len = q - tmp;
+    }
+
+    for (pad = len; pad < 8; pad++) {
+        *p++ = ' ';
+    }
+    memcpy(p, tmp, len);
+
+    return p + len;
+}
+
+static char *puthex6(char *p, unsigned int v)
+{
+    int shift;
+
+    for (shift = 20; shift >= 0; shift -= 4) {
+        *p++ = "0123456789ABCDEF"[(v >> shift) & 0xF];
+    }
+    return p;
+}
+
+static char *formatline(char *p, nametab_t *nt, schedtab_t *tab, int idx)
+{
+    char *name;
+    unsigned int m;
+    int i, n;
+
+    p = putstr(p, "Time ");
+    p = puttime(p, tab->time[idx]);
+    p = putstr(p, " | ");
+
+    // %-15.15s
+    name = findname(nt, tab->animation[idx]);
+    if (name) {
+        for (n = 0; (n < 15) && name[n]; n++) {
+            *p++ = name[n];
+        }
+    } else {
+        char *start = p;
+        p = putstr(p, "anim ");
+        p = putnum(p, tab->animation[idx], 0);
+        n = p - start;
+        if (n > 15) {
+            p = start + 15;
+            n = 15;
+        }
+    }
+    while (n++ < 15) {
+        *p++ = ' ';
+    }
+
+    *p++ = ' ';
+    *p++ = tab->direction[idx] ? 'R' : 'F';
+    p = putstr(p, " | speed ");
+    p = putnum(p, tab->speed[idx], 5);
+    p = putstr(p, " | option ");
+    p = putnum(p, tab->option[idx], 5);
+    p = putstr(p, " | ");
+
+    if (tab->palette[idx] & 0x1000000) {
+        p = putstr(p, "color 0x");
+        p = puthex6(p, tab->palette[idx] & 0x00FFFFFF);
+    } else {
+        p = putstr(p, "palette ");
+        p = putnum(p, tab->palette[idx], 2);
+        p = putstr(p, "    ");
+    }
+
+    p = putstr(p, " | strips ");
+    m = tab->stripmask[idx];
+    for (i = MAXSTRIPS-1; i >= 0; i--) {
+        *p++ = ((1 << i) & m) ? "123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ"[i] : '.';
+    }
+    *p++ = '\n';
+
+    return p;
+}
+
+/*  *********************************************************************
+    *  dumpschedule(script)
+    *
+    *  Print the schedule, subject to the dump settings in the script.
+    ********************************************************************* */
+
+void dumpschedule(script_t *script)
+{
+    schedtab_t *tab = &(script->sched);
+    nametab_t nt;
+    FILE *out = stdout;
+    dqueue_t *dq;
+    char *buf, *p;
+    int idx, end;
+
+    if (script->nodump) {
+        return;
+    }
+
+    if (script->dumpfile) {
+        out = fopen(script->dumpfile, "w");
+        if (!out) {
+            fprintf(stderr,"Could not create %s : %s\n",script->dumpfile,strerror(errno));
+            return;
+        }
+    } else {
+        fflush(stdout);
+    }
+
+    buildnames(&nt, script);
+    buf = (char *) malloc(DUMPBUF);
+    p = buf;
+
+    // The schedule is sorted, so the time range is a slice of it.
+    idx = (script->dump_from != 0) ? sched_seek(tab, script->dump_from) : 0;
+    end = (script->dump_to != 0) ? sched_seek(tab, script->dump_to + 1) : tab->count;
+
+    for (; idx < end; idx++) {
+        if (script->dump_strips && !(tab->stripmask[idx] & script->dump_strips)) {
+            continue;
+        }
+
+        if (p - buf > DUMPBUF - MAXLINE) {
+            fwrite(buf, 1, p - buf, out);
+            p = buf;
+        }
+
+        p = formatline(p, &nt, tab, idx);
+    }
+
+    // Repeats are not in the schedule, show one pass of each.
+    for (dq = script->repeats.dq_next; dq != &(script->repeats); dq = dq->dq_next) {
+        repeat_t *rep = (repeat_t *) dq;
+
+        if (p - buf > DUMPBUF - MAXLINE) {
+            fwrite(buf, 1, p - buf, out);
+            p = buf;
+        }
+
+        p = putstr(p, "Repeat every ");
+        p = puttime(p, rep->every);
+        p = putstr(p, " from ");
+        p = puttime(p, rep->from);
+        p = putstr(p, " until ");
+        p = puttime(p, rep->until);
+        *p++ = '\n';
+
+        for (idx = 0; idx < rep->pattern.count; idx++) {
+            if (script->dump_strips && !(rep->pattern.stripmask[idx] & script->dump_strips)) {
+                continue;
+            }
+
+            if (p - buf > DUMPBUF - MAXLINE) {
+                fwrite(buf, 1, p - buf, out);
+                p = buf;
+            }
+
+            *p++ = ' ';
+            *p++ = ' ';
+            p = formatline(p, &nt, &(rep->pattern), idx);
+        }
+    }
+
+    fwrite(buf, 1, p - buf, out);
+
+    free(buf);
+    free(nt.names);
+
+    if (out != stdout) {
+        fclose(out);
+        printf("* Wrote the schedule to %s\n",script->dumpfile);
+    } else {
+        fflush(stdout);
+    }
+}
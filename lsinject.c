@@ -0,0 +1,512 @@
+/*  *********************************************************************
+    *  LightScript - A script processor for LED animations
+    *
+    *  Live Injection                           File: lsinject.c
+    *
+    *  With --inject=path another program can add events to a show
+    *  while it plays: a strobe on a button press, a blackout from
+    *  the stage manager's panel.  Each datagram sent to the Unix
+    *  socket at path is a few script statements, like
+    *
+    *      at 0.0 do STROBE on ALL;
+    *      at 0.5 do CHASE on LEFT speed 200;
+    *
+    *  Times are from when the datagram arrives, or from the start
+    *  of the show if it begins with '@'.  The names are looked up
+    *  in the show's script and config.  If the sender's socket has
+    *  a name it gets back "OK n" with the number of events, or
+    *  "ERR" if the statements did not compile.
+    *
+    *  A thread of ours compiles the datagrams.  The events go to
+    *  the player through a lock-free queue (one atomic exchange to
+    *  add to it, none to take from it) and the player merges them
+    *  with the schedule, so the timing loop never waits on a lock
+    *  or a system call.  An injected event at the same time as a
+    *  scheduled one goes out after it, so the injected one wins.
+    *  The player doesn't free memory either (that takes the
+    *  allocator's lock): played events and empty batches go back
+    *  to our thread on a lock-free stack, and it frees them.
+    *
+    *  Author:  Mitch Lichtenberg
+    ********************************************************************* */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "lightscript.h"
+
+#define INJECTMAX       4096            // largest datagram
+#define INJECTPOLL      100             // ms between looks at the stop flag
+
+//
+// The events from one datagram, passed to the player as a unit.
+//
+typedef struct injbatch_s {
+    struct injbatch_s *next;    // in the queue
+    int relative;               // times are from when it arrived
+    dqueue_t events;            // schedcmd_t, sorted
+} injbatch_t;
+
+//
+// The queue is Vyukov's intrusive multi-producer, single-consumer
+// list.  Producers swap themselves in at the head; the player owns
+// the tail.  The stub keeps the list from ever being empty.
+//
+typedef struct inject_s {
+    injbatch_t *head;           // producers add here
+    injbatch_t *tail;           // the player takes from here
+    injbatch_t stub;
+
+    dqueue_t pending;           // taken from the queue, not yet due
+
+    schedcmd_t *spentcmds;      // done with, for our thread to free
+    injbatch_t *spentbatches;
+
+    script_t *script;
+    char *path;
+    int fd;
+    int stop;
+    pthread_t thread;
+    uint64_t received;
+    uint64_t events;
+} inject_t;
+
+static void queue_push(inject_t *inj, injbatch_t *b)
+{
+    injbatch_t *prev;
+
+    __atomic_store_n(&(b->next), NULL, __ATOMIC_RELAXED);
+    prev = __atomic_exchange_n(&(inj->head), b, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&(prev->next), b, __ATOMIC_RELEASE);
+}
+
+//
+// Take the oldest batch, or NULL if there is none.  Also NULL if a
+// producer is halfway through adding one; we get it next time.
+//
+static injbatch_t *queue_pop(inject_t *inj)
+{
+    injbatch_t *tail = inj->tail;
+    injbatch_t *next = __atomic_load_n(&(tail->next), __ATOMIC_ACQUIRE);
+    injbatch_t *head;
+
+    if (tail == &(inj->stub)) {
+        if (!next) {
+            return NULL;
+        }
+        inj->tail = next;
+        tail = next;
+        next = __atomic_load_n(&(tail->next), __ATOMIC_ACQUIRE);
+    }
+
+    if (next) {
+        inj->tail = next;
+        return tail;
+    }
+
+    head = __atomic_load_n(&(inj->head), __ATOMIC_ACQUIRE);
+    if (tail != head) {
+        return NULL;
+    }
+
+    // The last one: put the stub back behind it so we can take it.
+    queue_push(inj, &(inj->stub));
+
+    next = __atomic_load_n(&(tail->next), __ATOMIC_ACQUIRE);
+    if (next) {
+        inj->tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
+
+static void freebatch(injbatch_t *b)
+{
+    while (b->events.dq_next != &(b->events)) {
+        schedcmd_t *cmd = (schedcmd_t *) b->events.dq_next;
+
+        dq_dequeue(&(cmd->link));
+        stats_free(MEM_SCHEDULE,cmd,sizeof(schedcmd_t));
+    }
+    stats_free(MEM_SCHEDULE,b,sizeof(injbatch_t));
+}
+
+//
+// The player gives things back with these.  Only the player pushes,
+// and our thread takes the whole stack at once, so a swap of the top
+// can't be fooled by a node that was taken and pushed again.
+//
+static void spent_batch(inject_t *inj, injbatch_t *b)
+{
+    injbatch_t *top = __atomic_load_n(&(inj->spentbatches), __ATOMIC_RELAXED);
+
+    do {
+        b->next = top;
+    } while (!__atomic_compare_exchange_n(&(inj->spentbatches), &top, b, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+void inject_done(struct inject_s *inj, schedcmd_t *cmd)
+{
+    schedcmd_t *top = __atomic_load_n(&(inj->spentcmds), __ATOMIC_RELAXED);
+
+    do {
+        cmd->link.dq_next = (dqueue_t *) top;
+    } while (!__atomic_compare_exchange_n(&(inj->spentcmds), &top, cmd, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+//
+// Free what the player has given back.  Our thread only, or the
+// player once our thread has stopped.
+//
+static void reclaim(inject_t *inj)
+{
+    schedcmd_t *cmd = __atomic_exchange_n(&(inj->spentcmds), NULL, __ATOMIC_ACQUIRE);
+    injbatch_t *b = __atomic_exchange_n(&(inj->spentbatches), NULL, __ATOMIC_ACQUIRE);
+
+    while (cmd) {
+        schedcmd_t *next = (schedcmd_t *) cmd->link.dq_next;
+
+        stats_free(MEM_SCHEDULE,cmd,sizeof(schedcmd_t));
+        cmd = next;
+    }
+
+    while (b) {
+        injbatch_t *next = b->next;
+
+        freebatch(b);
+        b = next;
+    }
+}
+
+/*  *********************************************************************
+    *  The listener thread
+    ********************************************************************* */
+
+//
+// Is there an 'at beat' in the statements, or in a repeat among them?
+//
+static int hasbeats(node_t *n)
+{
+    scriptcmd_t *sc;
+
+    while (n && (n->type == nNODE)) {
+        if (hasbeats(n->left)) {
+            return 1;
+        }
+        n = n->right;
+    }
+
+    if (!n || (n->type != nSCRIPT)) {
+        return 0;
+    }
+
+    sc = (scriptcmd_t *) n;
+    if (sc->cmdtype == sATBEAT) {
+        return 1;
+    }
+
+    return (sc->cmdtype == sREPEAT) ? hasbeats(sc->options) : 0;
+}
+
+//
+// Compile one datagram against the show's names.  Returns the
+// batch, or NULL if it had errors or no events.
+//
+static injbatch_t *compile_datagram(inject_t *inj, char *buf, int len, int *errors)
+{
+    script_t tmp;
+    import_t imp;
+    lsparse_t ps;
+    injbatch_t *b;
+    dqueue_t *dq;
+
+    b = (injbatch_t *) stats_calloc(MEM_SCHEDULE,1,sizeof(injbatch_t));
+    dq_init(&(b->events));
+    b->relative = 1;
+
+    while ((len > 0) && ((*buf == ' ') || (*buf == '\t') || (*buf == '\n'))) {
+        buf++;
+        len--;
+    }
+    if ((len > 0) && (*buf == '@')) {
+        b->relative = 0;
+        buf++;
+        len--;
+    }
+
+    memset(&ps,0,sizeof(ps));
+    ps.filename = "inject";
+    parse_buffer(&ps, buf, len);
+
+    *errors = ps.errors;
+    if (ps.errors || !ps.tree) {
+        freetree(ps.tree);
+        freebatch(b);
+        return NULL;
+    }
+
+    // A beat is a time from the start of the song, so it only makes
+    // sense in a datagram timed from the start of the show, and only
+    // with the show's beat grid.  We won't load one for a datagram.
+    if (hasbeats(ps.tree) && (b->relative || (inj->script->nbeatgrid <= 0))) {
+        printf("Warning: 'at beat' can only be injected with '@', into a show with a beat grid\n");
+        (*errors)++;
+        freetree(ps.tree);
+        freebatch(b);
+        return NULL;
+    }
+
+    initscript(&tmp);
+    imp.defs = inj->script;
+    dq_enqueue(&(tmp.imports), &(imp.link));
+    tmp.scripttree = ps.tree;
+    tmp.beatgrid = inj->script->beatgrid;
+    tmp.nbeatgrid = (inj->script->nbeatgrid > 0) ? inj->script->nbeatgrid : -1;
+
+    savecommands(&tmp, ps.tree);
+
+    // A name that is not defined would stop the show when the
+    // events are generated, so the whole datagram is refused.
+    for (dq = tmp.commands.dq_next; dq != &(tmp.commands); dq = dq->dq_next) {
+        command_t *cmd = (command_t *) dq;
+
+        if ((cmd->animations.nvalues != 1) || (cmd->strips.nvalues == 0)) {
+            (*errors)++;
+        }
+    }
+
+    if (*errors == 0) {
+        genevents(&tmp);
+    }
+
+    while (tmp.schedule.dq_next != &(tmp.schedule)) {
+        dq = tmp.schedule.dq_next;
+        dq_dequeue(dq);
+        dq_enqueue(&(b->events), dq);
+    }
+
+    if (tmp.repeats.dq_next != &(tmp.repeats)) {
+        printf("Warning: repeats cannot be injected, ignored\n");
+    }
+
+    // The grid and the import are the show's, the rest is ours.
+    tmp.beatgrid = NULL;
+    tmp.nbeatgrid = 0;
+    dq_dequeue(&(imp.link));
+    freescript(&tmp);
+
+    if (b->events.dq_next == &(b->events)) {
+        freebatch(b);
+        return NULL;
+    }
+
+    return b;
+}
+
+static void *injectthread(void *arg)
+{
+    inject_t *inj = (inject_t *) arg;
+    char buf[INJECTMAX];
+    char reply[32];
+    struct sockaddr_un from;
+    struct pollfd pfd;
+
+    pfd.fd = inj->fd;
+    pfd.events = POLLIN;
+
+    while (!__atomic_load_n(&(inj->stop), __ATOMIC_RELAXED)) {
+        socklen_t fromlen = sizeof(from);
+        injbatch_t *b;
+        dqueue_t *dq;
+        int errors = 0;
+        int count = 0;
+        int len;
+
+        reclaim(inj);
+
+        if (poll(&pfd, 1, INJECTPOLL) <= 0) {
+            continue;
+        }
+
+        len = (int) recvfrom(inj->fd, buf, sizeof(buf), 0, (struct sockaddr *) &from, &fromlen);
+        if (len <= 0) {
+            continue;
+        }
+
+        inj->received++;
+        b = compile_datagram(inj, buf, len, &errors);
+
+        if (b) {
+            for (dq = b->events.dq_next; dq != &(b->events); dq = dq->dq_next) {
+                count++;
+            }
+            inj->events += count;
+            queue_push(inj, b);
+        }
+
+        // Only a sender with a name can be answered.
+        if (fromlen > sizeof(sa_family_t)) {
+            if (errors) {
+                strcpy(reply, "ERR\n");
+            } else {
+                sprintf(reply, "OK %d\n", count);
+            }
+            sendto(inj->fd, reply, strlen(reply), 0, (struct sockaddr *) &from, fromlen);
+        }
+    }
+
+    return NULL;
+}
+
+/*  *********************************************************************
+    *  inject_open(script)
+    *
+    *  Start taking events on script->inject_path, if it is set.
+    *  Returns -1 if the socket could not be opened.
+    ********************************************************************* */
+
+int inject_open(script_t *script)
+{
+    struct sockaddr_un addr;
+    inject_t *inj;
+    int fd;
+
+    if (!script->inject_path) {
+        return 0;
+    }
+
+    if (strlen(script->inject_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr,"Socket name %s is too long\n",script->inject_path);
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, script->inject_path);
+    unlink(script->inject_path);
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        fprintf(stderr,"Could not listen on %s : %s\n",script->inject_path,strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    inj = (inject_t *) calloc(1, sizeof(inject_t));
+    inj->head = &(inj->stub);
+    inj->tail = &(inj->stub);
+    dq_init(&(inj->pending));
+    inj->script = script;
+    inj->path = script->inject_path;
+    inj->fd = fd;
+
+    if (pthread_create(&(inj->thread), NULL, injectthread, inj) != 0) {
+        fprintf(stderr,"Could not start the injection thread\n");
+        close(fd);
+        unlink(inj->path);
+        free(inj);
+        return -1;
+    }
+
+    script->inject = inj;
+
+    printf("* Taking injected events on %s\n",script->inject_path);
+
+    return 0;
+}
+
+/*  *********************************************************************
+    *  inject_poll(script, now)
+    *
+    *  Called by the player, and only the player, before it looks
+    *  for the next event.  Moves anything that has arrived into
+    *  the pending list the cursor merges with the schedule.  'now'
+    *  is the show time, for the relative times.
+    ********************************************************************* */
+
+void inject_poll(script_t *script, lstime_t now)
+{
+    inject_t *inj = script->inject;
+    injbatch_t *b;
+
+    if (!inj) {
+        return;
+    }
+
+    while ((b = queue_pop(inj)) != NULL) {
+        while (b->events.dq_next != &(b->events)) {
+            schedcmd_t *cmd = (schedcmd_t *) b->events.dq_next;
+            dqueue_t *dq;
+
+            dq_dequeue(&(cmd->link));
+            if (b->relative) {
+                cmd->time += now;
+            }
+
+            // After anything at the same time, like the schedule.
+            for (dq = inj->pending.dq_prev; dq != &(inj->pending); dq = dq->dq_prev) {
+                if (((schedcmd_t *) dq)->time <= cmd->time) {
+                    break;
+                }
+            }
+            dq_enqueue(dq->dq_next, &(cmd->link));
+        }
+        spent_batch(inj, b);
+    }
+}
+
+//
+// The pending events for a cursor, or NULL if we are not injecting.
+//
+dqueue_t *inject_pending(script_t *script)
+{
+    inject_t *inj = script->inject;
+
+    return inj ? &(inj->pending) : NULL;
+}
+
+void inject_close(script_t *script)
+{
+    inject_t *inj = script->inject;
+
+    if (!inj) {
+        return;
+    }
+
+    __atomic_store_n(&(inj->stop), 1, __ATOMIC_RELAXED);
+    pthread_join(inj->thread, NULL);
+    close(inj->fd);
+    unlink(inj->path);
+
+    // Whatever did not get played.
+    inject_poll(script, 0);
+    while (inj->pending.dq_next != &(inj->pending)) {
+        schedcmd_t *cmd = (schedcmd_t *) inj->pending.dq_next;
+
+        dq_dequeue(&(cmd->link));
+        stats_free(MEM_SCHEDULE,cmd,sizeof(schedcmd_t));
+    }
+    reclaim(inj);
+
+    printf("* Injected %llu events from %llu datagrams\n",
+           (unsigned long long) inj->events, (unsigned long long) inj->received);
+
+    free(inj);
+    script->inject = NULL;
+}
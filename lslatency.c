@@ -0,0 +1,268 @@
+/*  *********************************************************************
+    *  LightScript - A script processor for LED animations
+    *
+    *  Controller Latency                       File: lslatency.c
+    *
+    *  With --latency we ping the controller before the show and
+    *  every few seconds during it.  Its ack tells us the round
+    *  trip, and the controller says how long it takes to get a
+    *  frame onto the strips.  Half the round trip plus that is
+    *  how late a frame lands after we send it, so the players
+    *  send every frame that much early (script->latency) and the
+    *  lights change on the beat.
+    *
+    *  Controllers that don't answer are left alone: after a few
+    *  unanswered pings we give up and play as before.
+    *
+    *  Author:  Mitch Lichtenberg
+    ********************************************************************* */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include "lightscript.h"
+
+#define LATPINGS        32                      // pings before the show
+#define LATSPACING      (5*LSTIME_MS)           // between them
+#define LATTIMEOUT      50                      // ms to wait for each ack before the show
+#define LATGIVEUP       4                       // unanswered pings before we stop asking
+#define LATPERIOD       (5*LSTIME_SECOND)       // between pings during the show
+#define LATLOST         (1*LSTIME_SECOND)       // an ack later than this is not coming
+#define LATCHECK        (1*LSTIME_MS)           // how often to look for the ack
+#define LATSAMPLES      64                      // most recent, for the statistics
+
+typedef struct latency_s {
+    lstime_t rtt[LATSAMPLES];
+    lstime_t proc[LATSAMPLES];
+    int nsamples;
+    int next;                   // replaced by the next sample
+    uint64_t pings;
+    uint64_t acks;
+    uint16_t seq;
+    int waiting;                // for the ack to the last ping
+    lstime_t sent;
+    lstime_t nextping;
+    lstime_t lastcheck;
+} latency_t;
+
+static void sendping(script_t *script, latency_t *lat)
+{
+    lsmessage_t msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.ls_sync[0] = 0x02;
+    msg.ls_sync[1] = 0xAA;
+    msg.ls_reserved = LSFLAG_PING;
+    msg.ls_option = ++lat->seq;
+
+    sink_send(script->sink, &msg);
+    sink_flush(script->sink);
+
+    lat->sent = current_ticks();
+    lat->waiting = 1;
+    lat->pings++;
+}
+
+//
+// Keep the sample if this is the ack we are waiting for.
+//
+static int takeack(latency_t *lat, lsmessage_t *msg)
+{
+    if (!lat->waiting || !(msg->ls_reserved & LSFLAG_ACK) || (msg->ls_option != lat->seq)) {
+        return 0;
+    }
+
+    lat->rtt[lat->next] = current_ticks() - lat->sent;
+    lat->proc[lat->next] = (lstime_t) msg->ls_color * 1000;
+    lat->next = (lat->next + 1) % LATSAMPLES;
+    if (lat->nsamples < LATSAMPLES) lat->nsamples++;
+
+    lat->waiting = 0;
+    lat->acks++;
+
+    return 1;
+}
+
+static int cmptime(const void *a, const void *b)
+{
+    lstime_t x = *(const lstime_t *) a;
+    lstime_t y = *(const lstime_t *) b;
+
+    return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+//
+// Sort a copy of the samples, for the percentiles.
+//
+static void sorted(lstime_t *dest, lstime_t *src, int n)
+{
+    memcpy(dest, src, n * sizeof(lstime_t));
+    qsort(dest, n, sizeof(lstime_t), cmptime);
+}
+
+static inline lstime_t pctile(lstime_t *v, int n, int pct)
+{
+    return v[((n - 1) * pct) / 100];
+}
+
+//
+// How late a frame lands after we send it, for each sample.
+//
+static void oneway(latency_t *lat, lstime_t *dest)
+{
+    int i;
+
+    for (i = 0; i < lat->nsamples; i++) {
+        dest[i] = lat->rtt[i] / 2 + lat->proc[i];
+    }
+    sorted(dest, dest, lat->nsamples);
+}
+
+static void update(script_t *script)
+{
+    latency_t *lat = script->lat;
+    lstime_t v[LATSAMPLES];
+
+    oneway(lat, v);
+    script->latency = pctile(v, lat->nsamples, 50);
+}
+
+static void printstats(char *what, lstime_t *v, int n)
+{
+    printf("  %-12s min %6.2fms  median %6.2fms  p99 %6.2fms\n", what,
+           LSTIME_SECS(v[0]) * 1000.0,
+           LSTIME_SECS(pctile(v, n, 50)) * 1000.0,
+           LSTIME_SECS(pctile(v, n, 99)) * 1000.0);
+}
+
+void latency_report(script_t *script)
+{
+    latency_t *lat = script->lat;
+    lstime_t v[LATSAMPLES];
+
+    if (!lat || !lat->nsamples) {
+        return;
+    }
+
+    printf("* Controller latency, %llu of %llu pings answered:\n",
+           (unsigned long long) lat->acks, (unsigned long long) lat->pings);
+
+    sorted(v, lat->rtt, lat->nsamples);
+    printstats("round trip", v, lat->nsamples);
+    sorted(v, lat->proc, lat->nsamples);
+    printstats("controller", v, lat->nsamples);
+    oneway(lat, v);
+    printstats("frame lands", v, lat->nsamples);
+
+    printf("  Sending frames %.2fms early\n", LSTIME_SECS(script->latency) * 1000.0);
+}
+
+/*  *********************************************************************
+    *  latency_calibrate(script)
+    *
+    *  Measure the latency before the show, on an open sink.  Sets
+    *  script->latency, and raises the start offset so the first
+    *  frames can go out early too.  Returns -1 if the controller
+    *  did not answer.
+    ********************************************************************* */
+
+int latency_calibrate(script_t *script)
+{
+    latency_t *lat;
+    lsmessage_t msg;
+    struct timespec nap = {0, LATSPACING};
+    lstime_t v[LATSAMPLES];
+    lstime_t worst;
+    int misses = 0;
+    int i;
+
+    if (!script->measure_latency || !script->sink || clock_is_virtual()) {
+        return 0;
+    }
+
+    lat = (latency_t *) calloc(1, sizeof(latency_t));
+    script->lat = lat;
+
+    for (i = 0; i < LATPINGS; i++) {
+        sendping(script, lat);
+
+        while (lat->waiting && sink_recv(script->sink, &msg, LATTIMEOUT)) {
+            takeack(lat, &msg);
+        }
+
+        if (lat->waiting) {
+            lat->waiting = 0;
+            if ((lat->acks == 0) && (++misses == LATGIVEUP)) {
+                break;
+            }
+        }
+
+        nanosleep(&nap, NULL);
+    }
+
+    if (lat->acks == 0) {
+        printf("Warning: the controller did not answer, latency not measured\n");
+        free(lat);
+        script->lat = NULL;
+        return -1;
+    }
+
+    update(script);
+    latency_report(script);
+
+    oneway(lat, v);
+    worst = pctile(v, lat->nsamples, 99);
+    if (worst > script->start_offset) {
+        script->start_offset = worst;
+        printf("  Start offset raised to %.2fms\n", LSTIME_SECS(worst) * 1000.0);
+    }
+
+    lat->nextping = current_ticks() + LATPERIOD;
+
+    return 0;
+}
+
+/*  *********************************************************************
+    *  latency_poll(script)
+    *
+    *  Called by the players between dispatches.  Sends a ping now
+    *  and then, and picks up its ack.  Cheap when there is nothing
+    *  to do.
+    ********************************************************************* */
+
+void latency_poll(script_t *script)
+{
+    latency_t *lat = script->lat;
+    lsmessage_t msg;
+    lstime_t now;
+
+    if (!lat) {
+        return;
+    }
+
+    now = current_ticks();
+
+    if (lat->waiting) {
+        if (now - lat->lastcheck < LATCHECK) {
+            return;
+        }
+        lat->lastcheck = now;
+
+        while (sink_recv(script->sink, &msg, 0)) {
+            if (takeack(lat, &msg)) {
+                update(script);
+                break;
+            }
+        }
+
+        if (lat->waiting && (now - lat->sent > LATLOST)) {
+            lat->waiting = 0;
+        }
+    } else if (now >= lat->nextping) {
+        sendping(script, lat);
+        lat->nextping = now + LATPERIOD;
+    }
+}
@@ -19,20 +19,24 @@
 #include <sys/time.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <sys/mman.h>
 #include "lightscript.h"
 
-extern void yyparse(void);
-
-extern int yylineno;
-extern FILE *yyin;
+// The scanner and parser are reentrant, these take the scanner
+// (a flex yyscan_t) as an argument instead of using globals.
+extern int yyparse(void *scanner, lsparse_t *ps);
+extern int yylex_init(void **scanner);
+extern int yylex_destroy(void *scanner);
+extern void *yy_scan_bytes(const char *bytes, int len, void *scanner);
+extern int yyget_lineno(void *scanner);
 
 void printtree(node_t *node, int depth);
 
-extern node_t *tree;
 script_t script;
-char *inpfilename = "input";
 int debug = 0;
-int script_error = 0;
 
 static char *findarduino(void)
 {
@@ -85,15 +89,50 @@ static void usage(void)
 {
     fprintf(stderr,"Usage: lightscript [-c configfile] [-v] [-p device] command script-file\n\n");
     fprintf(stderr,"    -c configfile       Specifies the name of a configuration file\n");
-    fprintf(stderr,"    -p device           Specifies the name of the Arduino device\n");
+    fprintf(stderr,"    -p device           Specifies the name of the Arduino device, or udp:host:port[,host:port...]\n");
+    fprintf(stderr,"                        for network controllers (one datagram per cue time), file:path, or null\n");
     fprintf(stderr,"    -s time             Starting time for playback\n");
     fprintf(stderr,"    -v                  Print diagnostic output\n");
+    fprintf(stderr,"    -b baud             Serial link speed for the link budget check (default 115200)\n");
+    fprintf(stderr,"    -f bytes            Extra bytes on the wire per frame (default 0)\n");
+    fprintf(stderr,"    -w time             Window for the link utilization check (default 0.1)\n");
+    fprintf(stderr,"    -r logfile          Record every frame sent to the device in logfile\n");
+    fprintf(stderr,"    -n                  Ignore the configuration cache (configfile.lsc)\n");
+    fprintf(stderr,"    -R                  Real-time playback: lock memory and raise priority\n");
+    fprintf(stderr,"    -a cpu              With -R, pin playback to this CPU (best isolated from others)\n");
+    fprintf(stderr,"    -q                  Do not print the schedule\n");
+    fprintf(stderr,"    -o file             Print the schedule to file instead\n");
+    fprintf(stderr,"    -t time[-time]      Only print the schedule in this time range\n");
+    fprintf(stderr,"    -m strips           Only print the schedule for these strips (like 1,3,5-8)\n");
+    fprintf(stderr,"    --fps=n             Frame rate for preview (default 30)\n");
+    fprintf(stderr,"    --pixels=n          Pixels per strip for preview (default 64)\n");
+    fprintf(stderr,"    --ppm               Preview as PPM images in script.frames/ instead of script.rgb\n");
+    fprintf(stderr,"    -j threads          Threads for batch (default: one per CPU)\n");
+    fprintf(stderr,"    --music             Dry run through the music player's callback\n");
+    fprintf(stderr,"    --latency           Measure the controller's latency and send frames early to make up for it\n");
+    fprintf(stderr,"    --inject=path       Take events from other programs on this socket while playing\n");
+    fprintf(stderr,"    --nogroup           Send frames due together one by one, for controllers that can't hold them\n");
+    fprintf(stderr,"    --stats[=json[:file]] Report memory use by subsystem and phase at exit\n");
+    fprintf(stderr,"                        (JSON goes to stderr, or to file)\n");
     fprintf(stderr,"\n");
     fprintf(stderr,"  Commands:\n");
     fprintf(stderr,"\n");
     fprintf(stderr,"      check     Check but do not play the script\n");
     fprintf(stderr,"      play      Check, then play the script\n");
     fprintf(stderr,"      mplay     Check, then play the script with background music\n");
+    fprintf(stderr,"      analyze   Find the beats in the script's music file and save a beat grid\n");
+    fprintf(stderr,"      daemon    Stay resident and take commands on the socket named instead\n");
+    fprintf(stderr,"                of a script file (load name file, play name [time], seek time, stop)\n");
+    fprintf(stderr,"      replay    Send a log recorded with -r, named instead of a script file,\n");
+    fprintf(stderr,"                to the device with its original timing\n");
+    fprintf(stderr,"      bench     Time scanning and seeking the script's schedule\n");
+    fprintf(stderr,"      compile   Write the schedule to script.lss instead of memory, for very long shows\n");
+    fprintf(stderr,"      splay     Play a compiled .lss file, named instead of a script file\n");
+    fprintf(stderr,"      preview   Render the show to frames in script.rgb without the rig\n");
+    fprintf(stderr,"      dryrun    Play the show on a virtual clock, as fast as possible (device\n");
+    fprintf(stderr,"                only with -p, e.g. /dev/null or a PTY)\n");
+    fprintf(stderr,"      batch     Check and compile every script named, or every .ls file in the\n");
+    fprintf(stderr,"                directories named, sharing one config, on all CPUs\n");
     fprintf(stderr,"\n");
     fprintf(stderr,"    script-file         Name of script file to process\n");
     fprintf(stderr,"\n");
@@ -104,42 +143,175 @@ static void usage(void)
     fprintf(stderr,"\n");
     fprintf(stderr,"    ./lightscript play test1.ls          Play test1.ls on the LED system\n");
     fprintf(stderr,"    ./lightscript check test1.ls         Check for syntax errors but do not play\n");
+    fprintf(stderr,"    ./lightscript daemon /tmp/ls.sock    Run resident, control with 'nc -U /tmp/ls.sock'\n");
     fprintf(stderr,"\n");
     exit(1);
 
 }
 
-void yyerror(char *str,...)
+void yyerror(void *scanner, lsparse_t *ps, const char *str)
 {
-    va_list ap;
-    va_start(ap,str);
-
-    fprintf(stderr,"%s(%d) : ",inpfilename,yylineno);
-    vfprintf(stderr,str,ap);
-    fprintf(stderr,"\n");
+    fprintf(stderr,"%s(%d) : %s\n",ps->filename,yyget_lineno(scanner),str);
 
-    script_error = 1;
+    ps->errors++;
 }
 
 
-static node_t *parse_file(char *filename)
+node_t *parse_buffer(lsparse_t *ps, const char *buf, int len)
 {
-    yyin = fopen(filename,"r");
+    void *scanner;
 
-    if (!yyin) {
-        fprintf(stderr,"Could not open %s : %s\n",filename,strerror(errno));
+    if (yylex_init(&scanner) != 0) {
+        ps->errors++;
         return NULL;
     }
 
-    tree = NULL;
+    ps->scanner = scanner;
+    yy_scan_bytes(buf, len, scanner);
+    yyparse(scanner, ps);
+    yylex_destroy(scanner);
+    ps->scanner = NULL;
+
+    stats_count(CNT_TOKENS, ps->tokens);
+    stats_count(CNT_NODES, ps->nodes);
+
+    return ps->tree;
+}
+
+//
+// Parse a file into ps->tree.  The file is mapped rather than read
+// through stdio.  Returns -1 if the file could not be opened.
+//
+int parse_file(lsparse_t *ps, char *filename)
+{
+    struct stat statbuf;
+    char *buf;
+    int fd;
+
+    memset(ps,0,sizeof(lsparse_t));
 
     // Save file name for error messages.
-    inpfilename = filename;
-    yyparse();
+    ps->filename = filename;
+
+    fd = open(filename,O_RDONLY);
+
+    if (fd < 0) {
+        fprintf(stderr,"Could not open %s : %s\n",filename,strerror(errno));
+        return -1;
+    }
 
-    fclose(yyin);
+    if ((fstat(fd,&statbuf) < 0) || (statbuf.st_size == 0)) {
+        close(fd);
+        return 0;
+    }
+
+    buf = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (buf == MAP_FAILED) {
+        fprintf(stderr,"Could not read %s : %s\n",filename,strerror(errno));
+        return -1;
+    }
 
-    return tree;
+    parse_buffer(ps, buf, (int) statbuf.st_size);
+
+    munmap(buf, statbuf.st_size);
+
+    return 0;
+}
+
+typedef struct configjob_s {
+    pthread_t thread;
+    char *filename;
+    script_t *defs;
+    int errors;
+} configjob_t;
+
+static void *configthread(void *arg)
+{
+    configjob_t *job = (configjob_t *) arg;
+
+    job->defs = load_config(job->filename, &(job->errors));
+
+    return NULL;
+}
+
+//
+// Parse the config and script files and resolve the script's
+// defines and commands.  The schedule is not generated here.
+// Returns 0 if the script is ready to schedule, -1 on error.
+//
+int compile_script(script_t *script, char *configfilename, char *scriptfilename)
+{
+    configjob_t config;
+    lsparse_t ps;
+    import_t *imp;
+    int threaded;
+
+    // The parse phase starts here, not with finding the device.
+    stats_start();
+
+    // The config file and the script don't depend on each other
+    // until we resolve symbols, so load them at the same time.
+    memset(&config,0,sizeof(config));
+    config.filename = configfilename;
+    threaded = (pthread_create(&config.thread, NULL, configthread, &config) == 0);
+    if (!threaded) {
+        configthread(&config);
+    }
+
+    parse_file(&ps, scriptfilename);
+
+    if (threaded) {
+        pthread_join(config.thread, NULL);
+    }
+
+    script->scripttree = ps.tree;
+    stats_phase("parse");
+
+    if (config.errors) {
+        fprintf(stderr,"There was an error in the configuration file\n");
+        return -1;
+    }
+
+    if (!config.defs) {
+        fprintf(stderr,"[Proceeding without a config file]\n");
+    }
+
+    if (ps.errors) {
+        fprintf(stderr,"There was an error in the script file\n");
+        return -1;
+    }
+
+    if (!script->scripttree) {
+        fprintf(stderr,"Could not read script file.\n");
+        return -1;
+    }
+
+    // The config's definitions are already resolved, the script
+    // sees them the same way it sees an included file.  If they
+    // came from the cache there is no tree to show.
+    if (config.defs) {
+        printf("* Processing configuration file\n");
+        script->configtree = config.defs->scripttree;
+        imp = (import_t *) stats_calloc(MEM_MODULES,1,sizeof(import_t));
+        imp->defs = config.defs;
+        dq_enqueue(&(script->imports), &(imp->link));
+    }
+    printf("* Processing script file\n");
+    savedefines(script,script->scripttree);
+    stats_phase("defines");
+    printf("* Finding script commands\n");
+    savecommands(script, script->scripttree);
+    stats_phase("commands");
+
+    // Idle and music can come from the config if the script has none.
+    if (config.defs) {
+        if (!script->idleanimation) script->idleanimation = config.defs->idleanimation;
+        if (!script->musicfile) script->musicfile = config.defs->musicfile;
+    }
+
+    return 0;
 }
 
 double get_time(void)
@@ -155,24 +327,18 @@ double get_time(void)
 #define CMD_PLAY        1
 #define CMD_CHECK       2
 #define CMD_MPLAY       3
-
-
-static double _parsetime(char *str) {
-    double minutes = 0;
-    double seconds = 0;
-    char *colon = strchr(str,':');
-    if (colon) {
-        *colon++ = '\0';
-        if (*str != ':') minutes = atof(str);
-        seconds = atof(colon);
-    } else {
-        seconds = atof(str);
-    }
-    seconds = minutes*60.0 + seconds;
-    return seconds;
-}
-
-static int parse_range(char *str, double *start, double *end)
+#define CMD_ANALYZE     4
+#define CMD_DAEMON      5
+#define CMD_REPLAY      6
+#define CMD_BENCH       7
+#define CMD_COMPILE     8
+#define CMD_SPLAY       9
+#define CMD_PREVIEW     10
+#define CMD_DRYRUN      11
+#define CMD_BATCH       12
+
+
+static int parse_range(char *str, lstime_t *start, lstime_t *end)
 {
     char *x;
     
@@ -182,16 +348,73 @@ static int parse_range(char *str, double *start, double *end)
     // See if it's just the start, or the start and end
     if ((x = strchr(str,'-'))) {
         *x++ = 0;
-        *start = _parsetime(str);
-        *end = _parsetime(x);
+        *start = parsetime(str);
+        *end = parsetime(x);
     } else {
-        *start = _parsetime(str);
+        *start = parsetime(str);
     }
 
     return  1;
     
 }
 
+//
+// script.ls -> script.lss, etc.
+//
+static char *newext(char *scriptfilename, char *ext)
+{
+    char *name = (char *) malloc(strlen(scriptfilename) + strlen(ext) + 1);
+    char *dot;
+
+    strcpy(name, scriptfilename);
+    dot = strrchr(name, '.');
+    if (dot && !strchr(dot, '/')) {
+        *dot = 0;
+    }
+    strcat(name, ext);
+
+    return name;
+}
+
+//
+// Strip list for -m, numbered from 1 as in scripts: "1,3,5-8"
+//
+static uint32_t parse_strips(char *str)
+{
+    uint32_t mask = 0;
+    char *tok;
+
+    for (tok = strtok(str,","); tok; tok = strtok(NULL,",")) {
+        int lo, hi;
+        char *x;
+
+        lo = hi = atoi(tok);
+        if ((x = strchr(tok,'-'))) {
+            hi = atoi(x+1);
+        }
+
+        for (; lo <= hi; lo++) {
+            if ((lo >= 1) && (lo <= MAXSTRIPS)) {
+                mask |= (1 << (lo-1));
+            }
+        }
+    }
+
+    return mask;
+}
+
+static struct option longopts[] = {
+    {"stats", optional_argument, NULL, 'S'},
+    {"fps", required_argument, NULL, 'F'},
+    {"pixels", required_argument, NULL, 'X'},
+    {"ppm", no_argument, NULL, 'P'},
+    {"music", no_argument, NULL, 'M'},
+    {"latency", no_argument, NULL, 'L'},
+    {"inject", required_argument, NULL, 'I'},
+    {"nogroup", no_argument, NULL, 'G'},
+    {NULL, 0, NULL, 0}
+};
+
 int main(int argc,char *argv[])
 {
     FILE *str = stdin;
@@ -201,15 +424,18 @@ int main(int argc,char *argv[])
     char ch;
     struct stat statbuf;
     char *playdevice = NULL;
+    char *recordfile = NULL;
     char *command;
     int cmdnum = 0;
     int skipflag = 0;
-    double start_cue = 0;
-    double end_cue = 0;
+    lstime_t start_cue = 0;
+    lstime_t end_cue = 0;
+    int dryrun_how = 0;
+    int nthreads = 0;
 
     initscript(&script);
 
-    while ((ch = getopt(argc,argv,"c:vp:s:")) != -1) {
+    while ((ch = getopt_long(argc,argv,"c:vp:s:b:f:w:r:nRa:qo:t:m:j:",longopts,NULL)) != -1) {
         switch (ch) {
             case 'c':
                 configfilename = optarg;
@@ -224,6 +450,75 @@ int main(int argc,char *argv[])
             case 's':
                 parse_range(optarg,&start_cue,&end_cue);
                 break;
+            case 'b':
+                script.baud = atoi(optarg);
+                break;
+            case 'f':
+                script.frame_overhead = atoi(optarg);
+                break;
+            case 'r':
+                recordfile = optarg;
+                break;
+            case 'n':
+                use_config_cache = 0;
+                break;
+            case 'R':
+                script.realtime = 1;
+                break;
+            case 'a':
+                script.rtcpu = atoi(optarg);
+                break;
+            case 'q':
+                script.nodump = 1;
+                break;
+            case 'o':
+                script.dumpfile = optarg;
+                break;
+            case 't':
+                parse_range(optarg,&script.dump_from,&script.dump_to);
+                break;
+            case 'm':
+                script.dump_strips = parse_strips(optarg);
+                if (script.dump_strips == 0) {
+                    fprintf(stderr,"No valid strips in '-m %s'\n",optarg);
+                    exit(1);
+                }
+                break;
+            case 'F':
+                script.preview_fps = atoi(optarg);
+                break;
+            case 'X':
+                script.preview_pixels = atoi(optarg);
+                break;
+            case 'P':
+                script.preview_ppm = 1;
+                break;
+            case 'M':
+                dryrun_how = 1;
+                break;
+            case 'L':
+                script.measure_latency = 1;
+                break;
+            case 'I':
+                script.inject_path = optarg;
+                break;
+            case 'G':
+                use_groups = 0;
+                break;
+            case 'j':
+                nthreads = atoi(optarg);
+                break;
+            case 'S':
+                stats_mode = STATS_TEXT;
+                if (optarg && (strncmp(optarg,"json",4) == 0) && ((optarg[4] == 0) || (optarg[4] == ':'))) {
+                    stats_mode = STATS_JSON;
+                    if (optarg[4] == ':') stats_file = optarg+5;
+                }
+                break;
+            case 'w':
+                script.budget_window = parsetime(optarg);
+                if (script.budget_window <= 0) script.budget_window = 100*LSTIME_MS;
+                break;
         }
     }
 
@@ -242,61 +537,84 @@ int main(int argc,char *argv[])
     if (strcmp(command,"play") == 0) cmdnum = CMD_PLAY;
     else if (strcmp(command,"check") == 0) cmdnum = CMD_CHECK;
     else if (strcmp(command,"mplay") == 0) cmdnum = CMD_MPLAY;
+    else if (strcmp(command,"analyze") == 0) cmdnum = CMD_ANALYZE;
+    else if (strcmp(command,"daemon") == 0) cmdnum = CMD_DAEMON;
+    else if (strcmp(command,"replay") == 0) cmdnum = CMD_REPLAY;
+    else if (strcmp(command,"bench") == 0) cmdnum = CMD_BENCH;
+    else if (strcmp(command,"compile") == 0) cmdnum = CMD_COMPILE;
+    else if (strcmp(command,"splay") == 0) cmdnum = CMD_SPLAY;
+    else if (strcmp(command,"preview") == 0) cmdnum = CMD_PREVIEW;
+    else if (strcmp(command,"dryrun") == 0) cmdnum = CMD_DRYRUN;
+    else if (strcmp(command,"batch") == 0) cmdnum = CMD_BATCH;
 
     if (cmdnum == 0) {
-        fprintf(stderr,"You must specify a command, 'play', 'mplay', or 'check' before the file name\n");
+        fprintf(stderr,"You must specify a command, 'play', 'mplay', 'analyze', 'daemon', 'replay', 'compile', 'splay', 'preview', 'dryrun', 'batch' or 'check' before the file name\n");
         fprintf(stderr,"\n");
         usage();
     }
 
-    if (!playdevice && ((cmdnum == CMD_PLAY) || (cmdnum == CMD_MPLAY))) {
+    if (!playdevice && ((cmdnum == CMD_PLAY) || (cmdnum == CMD_MPLAY) || (cmdnum == CMD_DAEMON) || (cmdnum == CMD_REPLAY) || (cmdnum == CMD_SPLAY))) {
         playdevice = findarduino();
     }
 
-    script.device_name = playdevice;
-    script.configtree = parse_file(configfilename);
-    script.start_cue = start_cue;
-    script.end_cue = end_cue;
-
-    if (!script.configtree) {
-        fprintf(stderr,"[Proceeding without a config file]\n");
+    if (stats_mode) {
+        stats_start();
+        atexit(stats_report);
     }
 
-    yylineno = 0;
+    if (cmdnum == CMD_REPLAY) {
+        exit((replay_log(scriptfilename, playdevice) < 0) ? 1 : 0);
+    }
 
-    script.scripttree = parse_file(scriptfilename);
+    if (cmdnum == CMD_BATCH) {
+        exit(run_batch(configfilename, &script, nthreads, argc-1, argv+1));
+    }
 
-    if (script_error) {
-        fprintf(stderr,"There was an error in the script file\n");
-        exit(1);
+    if (recordfile) {
+        if (record_open(recordfile) < 0) {
+            exit(1);
+        }
+        atexit(record_close);
     }
 
-    if (!script.scripttree) {
-        fprintf(stderr,"Could not read script file.\n");
-        exit(1);
+    if (cmdnum == CMD_DAEMON) {
+        exit(run_daemon(scriptfilename, playdevice, configfilename, &script));
     }
 
-    if (start_cue != 0) printf("Will start playback at %5.2f seconds\n",start_cue);
-    if (end_cue != 0) printf("Will stop playback at %5.2f seconds\n",end_cue);
+    script.device_name = playdevice;
+    script.start_cue = start_cue;
+    script.end_cue = end_cue;
+
+    if (start_cue != 0) printf("Will start playback at %5.2f seconds\n",LSTIME_SECS(start_cue));
+    if (end_cue != 0) printf("Will stop playback at %5.2f seconds\n",LSTIME_SECS(end_cue));
 
     if ((end_cue != 0) && (end_cue < start_cue)) {
         printf("The end of the playback can't be before the beginning!\n");
         exit(1);
     }
-    
-    // First, walk the tree and find all our "defines"
-    if (script.configtree) {
-        printf("* Processing configuration file\n");
-        savedefines(&script,script.configtree);
+
+    // Compiled streams play with 'splay', and can have a dry run too.
+    if ((cmdnum == CMD_SPLAY) ||
+        ((cmdnum == CMD_DRYRUN) && strrchr(scriptfilename,'.') && (strcmp(strrchr(scriptfilename,'.'),".lss") == 0))) {
+        if (stream_attach(&script, configfilename, scriptfilename) < 0) {
+            exit(1);
+        }
+        if (cmdnum == CMD_DRYRUN) {
+            dryrun_script(&script, 2);
+            stats_phase("play");
+        } else if (playdevice) {
+            play_script(&script, 2);
+            stats_phase("play");
+        }
+        exit(0);
     }
-    printf("* Processing script file\n");
-    savedefines(&script,script.scripttree);
-    printf("* Finding script commands\n");
-    savecommands(&script, script.scripttree);
 
+    if (compile_script(&script, configfilename, scriptfilename) < 0) {
+        exit(1);
+    }
 
-    // If we're playing a real music file, the file must exist.
-    if (cmdnum == CMD_MPLAY) {
+    // If we're playing or analyzing a real music file, the file must exist.
+    if ((cmdnum == CMD_MPLAY) || (cmdnum == CMD_ANALYZE)) {
         char *mfile = script.musicfile;
         if (!script.musicfile) {
             printf("Your script file does not contain a 'music' statement to identify the music file\n");
@@ -316,6 +634,9 @@ int main(int argc,char *argv[])
             printf("------------------------------------------------------------------------\n");
             printf("-- Configuration file: %s\n",configfilename);
             printtree(script.configtree,0);
+        } else if (script.imports.dq_next != &(script.imports)) {
+            printf("------------------------------------------------------------------------\n");
+            printf("-- Configuration file: %s (from cache)\n",configfilename);
         }
         printf("------------------------------------------------------------------------\n");
         printf("-- Script file: %s\n",scriptfilename);
@@ -331,8 +652,46 @@ int main(int argc,char *argv[])
     }
 
 
+    if (cmdnum == CMD_ANALYZE) {
+        exit((analyze_music(&script) < 0) ? 1 : 0);
+    }
+
+    if (cmdnum == CMD_COMPILE) {
+        char *streamfile = newext(scriptfilename, ".lss");
+
+        printf("* Compiling schedule to %s\n",streamfile);
+        if (genstream(&script, streamfile) < 0) {
+            exit(1);
+        }
+        stats_phase("schedule");
+        exit(0);
+    }
+
     printf("* Generating schedule\n");
     genschedule(&script);
+    stats_phase("schedule");
+
+    if (cmdnum == CMD_CHECK) {
+        check_beats(&script);
+        check_linkbudget(&script);
+        stats_phase("check");
+    }
+
+    if (cmdnum == CMD_BENCH) {
+        bench_schedule(&script);
+    }
+
+    if (cmdnum == CMD_PREVIEW) {
+        if (preview_script(&script, newext(scriptfilename, script.preview_ppm ? ".frames" : ".rgb")) < 0) {
+            exit(1);
+        }
+        stats_phase("preview");
+    }
+
+    if (cmdnum == CMD_DRYRUN) {
+        dryrun_script(&script, dryrun_how);
+        stats_phase("play");
+    }
 
     if (playdevice && (cmdnum == CMD_PLAY)) {
         play_script(&script, 0);
@@ -340,6 +699,10 @@ int main(int argc,char *argv[])
         play_script(&script, 1);
     }
     
+    if (playdevice && ((cmdnum == CMD_PLAY) || (cmdnum == CMD_MPLAY))) {
+        stats_phase("play");
+    }
+
     return 0;
 }
 
@@ -350,44 +713,143 @@ void initscript(script_t *script)
 
     dq_init(&(script->symbols));
     dq_init(&(script->macros));
+    dq_init(&(script->imports));
     dq_init(&(script->commands));
+    dq_init(&(script->repeats));
     dq_init(&(script->schedule));
 
-    // Set the epoch (the start of 'time')
-    time(&script->epoch);
-    script->start_offset = 0.1;
+    // Hold back the first event a little
+    script->start_offset = 100*LSTIME_MS;
+
+    script->rtcpu = -1;
+
+    script->baud = 115200;
+    script->frame_overhead = 0;
+    script->budget_window = 100*LSTIME_MS;
 }
 
+static void freetab(schedtab_t *tab)
+{
+    int n = tab->count ? tab->count : 1;
 
-void insert_sched(script_t *script, schedcmd_t *scmd)
+    if (!tab->time) {
+        return;
+    }
+
+    stats_free(MEM_SCHEDULE,tab->time,n * sizeof(lstime_t));
+    stats_free(MEM_SCHEDULE,tab->stripmask,n * sizeof(unsigned int));
+    stats_free(MEM_SCHEDULE,tab->animation,n * sizeof(unsigned int));
+    stats_free(MEM_SCHEDULE,tab->speed,n * sizeof(unsigned int));
+    stats_free(MEM_SCHEDULE,tab->brightness,n * sizeof(unsigned int));
+    stats_free(MEM_SCHEDULE,tab->palette,n * sizeof(unsigned int));
+    stats_free(MEM_SCHEDULE,tab->direction,n * sizeof(unsigned int));
+    stats_free(MEM_SCHEDULE,tab->option,n * sizeof(unsigned int));
+    memset(tab,0,sizeof(schedtab_t));
+}
+
+static void freecommands(dqueue_t *list)
 {
-    dqueue_t *dq = script->schedule.dq_next;
+    while (list->dq_next != list) {
+        command_t *cmd = (command_t *) list->dq_next;
 
-    while (dq != &(script->schedule)) {
-        schedcmd_t *acmd = (schedcmd_t *) dq;
+        dq_dequeue(&(cmd->link));
+        stats_free(MEM_COMMANDS,cmd,sizeof(command_t));
+    }
+}
 
-        // Look for our place in the schedule to insert.
-        if (scmd->time < acmd->time) {
-            break;
-        }
+static void freesyms(dqueue_t *tab)
+{
+    while (tab->dq_next != tab) {
+        symbol_t *sym = (symbol_t *) tab->dq_next;
 
-        dq = dq->dq_next;
+        dq_dequeue(&(sym->link));
+        stats_free(MEM_SYMBOLS,sym,sizeof(symbol_t));
+    }
+}
+
+//
+// Give back what compile_script() and genschedule() made for a
+// script, when a long-running program is done with it.  What it
+// imports (the config, included files) is shared and stays, and
+// so does anything the caller set, like the music file's path.
+//
+void freescript(script_t *script)
+{
+    // Symbols and macros point into the tree, so they go first.
+    freesyms(&(script->symbols));
+    freesyms(&(script->macros));
+    freetree(script->scripttree);
+    script->scripttree = NULL;
+    script->configtree = NULL;
+    script->musicfile = NULL;
+    script->idleanimation = NULL;
+
+    while (script->imports.dq_next != &(script->imports)) {
+        import_t *imp = (import_t *) script->imports.dq_next;
+
+        dq_dequeue(&(imp->link));
+        stats_free(MEM_MODULES,imp,sizeof(import_t));
+    }
+
+    freecommands(&(script->commands));
+
+    while (script->repeats.dq_next != &(script->repeats)) {
+        repeat_t *rep = (repeat_t *) script->repeats.dq_next;
+
+        dq_dequeue(&(rep->link));
+        freecommands(&(rep->commands));
+        freetab(&(rep->pattern));
+        stats_free(MEM_COMMANDS,rep,sizeof(repeat_t));
+    }
+
+    while (script->schedule.dq_next != &(script->schedule)) {
+        schedcmd_t *cmd = (schedcmd_t *) script->schedule.dq_next;
+
+        dq_dequeue(&(cmd->link));
+        stats_free(MEM_SCHEDULE,cmd,sizeof(schedcmd_t));
+    }
+
+    freetab(&(script->sched));
+
+    if (script->seekidx.keys) {
+        stats_free(MEM_SCHEDULE,script->seekidx.keys,script->seekidx.nkeys * MAXSTRIPS * sizeof(int32_t));
+        memset(&(script->seekidx),0,sizeof(seekindex_t));
+    }
+
+    free(script->beatgrid);
+    script->beatgrid = NULL;
+    script->nbeatgrid = 0;
+}
+
+
+//
+// Commands are appended as they are generated and sorted once at
+// the end, see sortschedule().
+//
+void insert_sched(script_t *script, schedcmd_t *scmd)
+{
+    stats_count(CNT_EVENTS, 1);
+
+    // Compiling to a stream, the stream sorts them.
+    if (script->stream) {
+        stream_event(script->stream, scmd);
+        stats_free(MEM_SCHEDULE,scmd,sizeof(schedcmd_t));
+        return;
     }
 
-    // The place where we stopped is where we want to insert the next command.
-    dq_enqueue(dq,&(scmd->link));
+    dq_enqueue(&(script->schedule),&(scmd->link));
 }
 
 
 
-static void schedule_from(script_t *script,double basetime,command_t *cmd)
+static void schedule_from(script_t *script,lstime_t basetime,command_t *cmd)
 {
     int i;
 
     for (i = 0; i < cmd->count; i++) {
-        double t = cmd->from + (cmd->to - cmd->from) * ((double) i / (double) (cmd->count-1));
+        lstime_t t = (cmd->count > 1) ? cmd->from + (cmd->to - cmd->from) * i / (cmd->count-1) : cmd->from;
     
-        schedcmd_t *scmd = (schedcmd_t *) calloc(1,sizeof(schedcmd_t));
+        schedcmd_t *scmd = (schedcmd_t *) stats_calloc(MEM_SCHEDULE,1,sizeof(schedcmd_t));
 
         scmd->time = basetime + t;
         scmd->speed = cmd->speed;
@@ -403,9 +865,9 @@ static void schedule_from(script_t *script,double basetime,command_t *cmd)
     
 }
 
-static void schedule_at(script_t *script,double basetime,command_t *cmd)
+static void schedule_at(script_t *script,lstime_t basetime,command_t *cmd)
 {
-    schedcmd_t *scmd = (schedcmd_t *) calloc(1,sizeof(schedcmd_t));
+    schedcmd_t *scmd = (schedcmd_t *) stats_calloc(MEM_SCHEDULE,1,sizeof(schedcmd_t));
 
     scmd->time = basetime + cmd->from;
     scmd->speed = cmd->speed;
@@ -422,15 +884,15 @@ static void schedule_at(script_t *script,double basetime,command_t *cmd)
 
 
 
-static void schedule_cascade(script_t *script,double basetime,command_t *cmd)
+static void schedule_cascade(script_t *script,lstime_t basetime,command_t *cmd)
 {
     int i;
     int count = cmd->strips.nvalues;        // we iterate across strips
 
     for (i = 0; i < count; i++) {
-        double t = cmd->from + (((double) i) * cmd->delay);
+        lstime_t t = cmd->from + i * cmd->delay;
     
-        schedcmd_t *scmd = (schedcmd_t *) calloc(1,sizeof(schedcmd_t));
+        schedcmd_t *scmd = (schedcmd_t *) stats_calloc(MEM_SCHEDULE,1,sizeof(schedcmd_t));
 
         scmd->time = basetime + t;
         scmd->speed = cmd->speed;
@@ -449,7 +911,6 @@ static void schedule_cascade(script_t *script,double basetime,command_t *cmd)
     
 }
 
-#define MAXSTRIPS 31
 static char *maskstr(char *str,uint32_t m)
 {
     int i;
@@ -461,10 +922,10 @@ static char *maskstr(char *str,uint32_t m)
     return str;
 }
 
-static void fmttime(char *dest, double t)
+static void fmttime(char *dest, lstime_t t)
 {
-    unsigned int minutes = (int) (t / 60.0);
-    double seconds = (t - ((double) minutes)*60.0);
+    unsigned int minutes = (unsigned int) (t / (60*LSTIME_SECOND));
+    double seconds = LSTIME_SECS(t - ((lstime_t) minutes)*60*LSTIME_SECOND);
     sprintf(dest,"%2u:%05.02f",
             minutes,seconds);
 }
@@ -473,7 +934,7 @@ static void animname(script_t *script, unsigned int anim, char *buffer)
 {
     char *name;
     
-    name = findval(&(script->symbols), anim);
+    name = lookupval(script, anim);
     if (!name) {
         sprintf(buffer, "anim %u",anim);
     } else {
@@ -481,45 +942,47 @@ static void animname(script_t *script, unsigned int anim, char *buffer)
     }
 }
 
-void printsched1(script_t *script, schedcmd_t * acmd)
+void printevent(script_t *script, lsevent_t *ev)
 {
     char tmpstr[64];
     char timestr[32];
     char colorstr[32];
     char animstr[40];
 
-    fmttime(timestr,acmd->time);
+    fmttime(timestr,ev->time);
 
-    if (acmd->palette & 0x1000000) {
-        sprintf(colorstr,"color 0x%06X", acmd->palette & 0x00FFFFFF);
+    if (ev->palette & 0x1000000) {
+        sprintf(colorstr,"color 0x%06X", ev->palette & 0x00FFFFFF);
     } else {
-        sprintf(colorstr,"palette %2u    ",acmd->palette);
+        sprintf(colorstr,"palette %2u    ",ev->palette);
     }
 
-    animname(script, acmd->animation, animstr);
+    animname(script, ev->animation, animstr);
     
     printf("Time %8s | %-15.15s %c | speed %5u | option %5u | %s | strips %s\n",timestr,animstr,
-           acmd->direction ? 'R' : 'F',
-           acmd->speed, acmd->option,
-           colorstr, maskstr(tmpstr,acmd->stripmask));
+           ev->direction ? 'R' : 'F',
+           ev->speed, ev->option,
+           colorstr, maskstr(tmpstr,ev->stripmask));
 }
 
-
-void dumpschedule(script_t *script)
+void printsched1(script_t *script, int idx)
 {
-    dqueue_t *dq = script->schedule.dq_next;
-
-    while (dq != &(script->schedule)) {
-        schedcmd_t *acmd = (schedcmd_t *) dq;
-
-        printsched1(script,acmd);
-
-        dq = dq->dq_next;
-    }
-
+    schedtab_t *tab = &(script->sched);
+    lsevent_t ev;
+
+    ev.time = tab->time[idx];
+    ev.stripmask = tab->stripmask[idx];
+    ev.animation = tab->animation[idx];
+    ev.speed = tab->speed[idx];
+    ev.brightness = tab->brightness[idx];
+    ev.palette = tab->palette[idx];
+    ev.direction = tab->direction[idx];
+    ev.option = tab->option[idx];
+
+    printevent(script, &ev);
 }
 
-static void genschedlist(script_t *script, double basetime, dqueue_t *list)
+static void genschedlist(script_t *script, lstime_t basetime, dqueue_t *list)
 {
     dqueue_t *dq = list;
 
@@ -546,12 +1009,320 @@ static void genschedlist(script_t *script, double basetime, dqueue_t *list)
 }
 
 
+static int samecmd(schedcmd_t *a, schedcmd_t *b)
+{
+    return ((a->animation == b->animation) &&
+            (a->speed == b->speed) &&
+            (a->brightness == b->brightness) &&
+            (a->palette == b->palette) &&
+            (a->direction == b->direction) &&
+            (a->option == b->option));
+}
+
+//
+// Optimize one run of events that all have the same time.  Events
+// later in the run win, so first take away the strips that a later
+// event will overwrite anyway, dropping events that have nothing left.
+// After that no two events share a strip and we can merge events that
+// do the same thing into one frame.
+//
+static int optgroup(dqueue_t *first, dqueue_t *last)
+{
+    unsigned int covered = 0;
+    int removed = 0;
+    dqueue_t *dq, *prev, *next;
+
+    for (dq = last; dq != first->dq_prev; dq = prev) {
+        schedcmd_t *cmd = (schedcmd_t *) dq;
+        unsigned int mask = cmd->stripmask;
+
+        prev = dq->dq_prev;
+
+        if ((mask != 0) && ((mask & ~covered) == 0)) {
+            if (dq == first) first = dq->dq_next;
+            dq_dequeue(dq);
+            stats_free(MEM_SCHEDULE,cmd,sizeof(schedcmd_t));
+            removed++;
+        } else {
+            cmd->stripmask = mask & ~covered;
+        }
+        covered |= mask;
+    }
+
+    for (dq = first; dq != last->dq_next; dq = dq->dq_next) {
+        schedcmd_t *cmd = (schedcmd_t *) dq;
+        dqueue_t *other;
+
+        for (other = dq->dq_next; other != last->dq_next; other = next) {
+            schedcmd_t *ocmd = (schedcmd_t *) other;
+
+            next = other->dq_next;
+            if (samecmd(cmd, ocmd)) {
+                cmd->stripmask |= ocmd->stripmask;
+                if (other == last) last = other->dq_prev;
+                dq_dequeue(other);
+                stats_free(MEM_SCHEDULE,ocmd,sizeof(schedcmd_t));
+                removed++;
+            }
+        }
+    }
+
+    return removed;
+}
+
+//
+// Optimize a list holding one group of same-time events.
+//
+int optimize_group(dqueue_t *group)
+{
+    if (group->dq_next == group) {
+        return 0;
+    }
+
+    return optgroup(group->dq_next, group->dq_prev);
+}
+
+static int optlist(dqueue_t *list, int *ptotal)
+{
+    dqueue_t *dq = list->dq_next;
+    int total = 0;
+    int removed = 0;
+
+    while (dq != list) {
+        dqueue_t *first = dq;
+        dqueue_t *last = dq;
+        lstime_t t = ((schedcmd_t *) dq)->time;
+
+        total++;
+        while ((last->dq_next != list) && (((schedcmd_t *) last->dq_next)->time == t)) {
+            last = last->dq_next;
+            total++;
+        }
+
+        dq = last->dq_next;
+
+        if (first != last) {
+            removed += optgroup(first, last);
+        }
+    }
+
+    *ptotal = total;
+    return removed;
+}
+
+static void optschedule(script_t *script)
+{
+    int total;
+    int removed = optlist(&(script->schedule), &total);
+
+    if (removed && !script->quiet) {
+        printf("* Optimized schedule: removed %d of %d frames\n",removed,total);
+    }
+}
+
+
+//
+// Sort the schedule by time.  The sort must be stable: commands
+// at the same time keep the order they were generated in, since
+// later ones win when the schedule is optimized.
+//
+static void sortschedule(script_t *script)
+{
+    schedcmd_t **cmds, **tmp, **src, **dst, **swap;
+    dqueue_t *dq;
+    int count = 0;
+    int width, lo, i;
+
+    for (dq = script->schedule.dq_next; dq != &(script->schedule); dq = dq->dq_next) {
+        count++;
+    }
+
+    if (count < 2) {
+        return;
+    }
+
+    cmds = (schedcmd_t **) stats_malloc(MEM_SCHEDULE,count * sizeof(schedcmd_t *));
+    tmp = (schedcmd_t **) stats_malloc(MEM_SCHEDULE,count * sizeof(schedcmd_t *));
+
+    i = 0;
+    for (dq = script->schedule.dq_next; dq != &(script->schedule); dq = dq->dq_next) {
+        cmds[i++] = (schedcmd_t *) dq;
+    }
+
+    // Bottom-up merge sort
+    src = cmds;
+    dst = tmp;
+    for (width = 1; width < count; width *= 2) {
+        for (lo = 0; lo < count; lo += 2*width) {
+            int mid = (lo + width < count) ? lo + width : count;
+            int hi = (lo + 2*width < count) ? lo + 2*width : count;
+            int a = lo, b = mid, k = lo;
+
+            while ((a < mid) && (b < hi)) {
+                dst[k++] = (src[b]->time < src[a]->time) ? src[b++] : src[a++];
+            }
+            while (a < mid) dst[k++] = src[a++];
+            while (b < hi) dst[k++] = src[b++];
+        }
+        swap = src; src = dst; dst = swap;
+    }
+
+    dq_init(&(script->schedule));
+    for (i = 0; i < count; i++) {
+        dq_enqueue(&(script->schedule),&(src[i]->link));
+    }
+
+    stats_free(MEM_SCHEDULE,cmds,count * sizeof(schedcmd_t *));
+    stats_free(MEM_SCHEDULE,tmp,count * sizeof(schedcmd_t *));
+}
+
+//
+// Move the finished list into the parallel arrays and free it.
+//
+static void packschedule(script_t *script)
+{
+    schedtab_t *tab = &(script->sched);
+    dqueue_t *dq;
+    int count = 0;
+    int i;
+
+    for (dq = script->schedule.dq_next; dq != &(script->schedule); dq = dq->dq_next) {
+        count++;
+    }
+
+    tab->count = count;
+    tab->time = (lstime_t *) stats_malloc(MEM_SCHEDULE,(count ? count : 1) * sizeof(lstime_t));
+    tab->stripmask = (unsigned int *) stats_malloc(MEM_SCHEDULE,(count ? count : 1) * sizeof(unsigned int));
+    tab->animation = (unsigned int *) stats_malloc(MEM_SCHEDULE,(count ? count : 1) * sizeof(unsigned int));
+    tab->speed = (unsigned int *) stats_malloc(MEM_SCHEDULE,(count ? count : 1) * sizeof(unsigned int));
+    tab->brightness = (unsigned int *) stats_malloc(MEM_SCHEDULE,(count ? count : 1) * sizeof(unsigned int));
+    tab->palette = (unsigned int *) stats_malloc(MEM_SCHEDULE,(count ? count : 1) * sizeof(unsigned int));
+    tab->direction = (unsigned int *) stats_malloc(MEM_SCHEDULE,(count ? count : 1) * sizeof(unsigned int));
+    tab->option = (unsigned int *) stats_malloc(MEM_SCHEDULE,(count ? count : 1) * sizeof(unsigned int));
+
+    i = 0;
+    dq = script->schedule.dq_next;
+    while (dq != &(script->schedule)) {
+        schedcmd_t *cmd = (schedcmd_t *) dq;
+
+        dq = dq->dq_next;
+
+        tab->time[i] = cmd->time;
+        tab->stripmask[i] = cmd->stripmask;
+        tab->animation[i] = cmd->animation;
+        tab->speed[i] = cmd->speed;
+        tab->brightness[i] = cmd->brightness;
+        tab->palette[i] = cmd->palette;
+        tab->direction[i] = cmd->direction;
+        tab->option[i] = cmd->option;
+        i++;
+
+        stats_free(MEM_SCHEDULE,cmd,sizeof(schedcmd_t));
+    }
+
+    dq_init(&(script->schedule));
+}
+
+//
+// Return the index of the first command at or after time t, or
+// the count if there are none.
+//
+int sched_seek(schedtab_t *tab, lstime_t t)
+{
+    int lo = 0;
+    int hi = tab->count;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (tab->time[mid] < t) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+
+//
+// Each repeat body goes through the same steps as the whole script,
+// one pass of it, and the result is kept with the repeat.
+//
+static void genrepeats(script_t *script)
+{
+    dqueue_t *dq;
+    int total;
+
+    for (dq = script->repeats.dq_next; dq != &(script->repeats); dq = dq->dq_next) {
+        repeat_t *rep = (repeat_t *) dq;
+
+        genschedlist(script, 0, &(rep->commands));
+        sortschedule(script);
+        optlist(&(script->schedule), &total);
+        packschedule(script);
+
+        rep->pattern = script->sched;
+        memset(&(script->sched), 0, sizeof(schedtab_t));
+    }
+}
+
+//
+// Just the events for the commands, sorted and optimized but left
+// on script->schedule.  For the few statements injected during a
+// show (see lsinject.c).
+//
+void genevents(script_t *script)
+{
+    int total;
+
+    genschedlist(script, 0, &(script->commands));
+    sortschedule(script);
+    optlist(&(script->schedule), &total);
+}
+
 void genschedule(script_t *script)
 {
     dqueue_t *list = &(script->commands);
 
+    genrepeats(script);
+
     genschedlist(script, 0, list);
 
+    sortschedule(script);
+
+    optschedule(script);
+
+    packschedule(script);
+
+    // Frames in the main schedule.  The repeat patterns were packed
+    // the same way, but a pattern's frames are sent once a pass.
+    stats_count(CNT_FRAMES, script->sched.count);
+
+    seek_index(script);
+
     dumpschedule(script);
     
 }
+
+//
+// Like genschedule(), but the events go to a compiled stream file
+// instead of memory, for shows too long to hold.
+//
+int genstream(script_t *script, char *filename)
+{
+    genrepeats(script);
+
+    script->stream = stream_create(script, filename);
+    if (!script->stream) {
+        return -1;
+    }
+
+    genschedlist(script, 0, &(script->commands));
+
+    // The repeats go in expanded, the stream is the whole show.
+    stream_schedule(script->stream, script);
+
+    return stream_finish(script->stream);
+}
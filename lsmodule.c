@@ -0,0 +1,231 @@
+/*  *********************************************************************
+    *  LightScript - A script processor for LED animations
+    *
+    *  Module Cache                             File: lsmodule.c
+    *
+    *  Files brought in with 'include' are parsed and their defines
+    *  resolved once, then kept in a cache keyed by a hash of their
+    *  contents.  Every script that includes the same file shares
+    *  the one copy of its tree, symbols and macros.
+    *
+    *  A module's defines can use the names its includer imports
+    *  (the config, and anything included before it), so those
+    *  imports are part of the key: the same file included under
+    *  another config is resolved again.
+    *
+    *  Author:  Mitch Lichtenberg
+    ********************************************************************* */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "lightscript.h"
+
+#define MAXINCLUDEDEPTH 16
+
+typedef struct module_s {
+    dqueue_t link;
+    uint64_t hash;
+    size_t size;
+    char *filename;             // where we first saw it
+    node_t *tree;
+    int nscope;                 // the includer's imports, first in defs.imports
+    script_t defs;              // resolved symbols and macros
+} module_t;
+
+static dqueue_t modules = {&modules, &modules};
+static pthread_mutex_t modlock = PTHREAD_MUTEX_INITIALIZER;
+
+//
+// 64-bit FNV-1a
+//
+uint64_t hashbytes(const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) buf;
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (len--) {
+        h ^= *p++;
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+//
+// Was the module resolved with the same imports 'script' has?
+//
+static int samescope(module_t *mod, script_t *script)
+{
+    dqueue_t *a = mod->defs.imports.dq_next;
+    dqueue_t *b = script->imports.dq_next;
+    int n;
+
+    for (n = 0; n < mod->nscope; n++) {
+        if ((b == &(script->imports)) || (((import_t *) a)->defs != ((import_t *) b)->defs)) {
+            return 0;
+        }
+        a = a->dq_next;
+        b = b->dq_next;
+    }
+
+    return (b == &(script->imports));
+}
+
+static module_t *findmodule(uint64_t hash, size_t size, script_t *includer)
+{
+    dqueue_t *dq;
+
+    for (dq = modules.dq_next; dq != &modules; dq = dq->dq_next) {
+        module_t *mod = (module_t *) dq;
+        if ((mod->hash == hash) && (mod->size == size) && samescope(mod, includer)) {
+            return mod;
+        }
+    }
+
+    return NULL;
+}
+
+//
+// Throw away a module nobody has seen.  The modules it includes
+// are in the cache and stay.
+//
+static void freemodule(module_t *mod)
+{
+    mod->defs.scripttree = mod->tree;
+    freescript(&(mod->defs));
+    free(mod->filename);
+    stats_free(MEM_MODULES,mod,sizeof(module_t));
+}
+
+//
+// Find the module for a file, parsing and resolving it if it is
+// not in the cache.  Returns NULL if the file can't be used.
+//
+static module_t *loadmodule(char *filename, script_t *includer)
+{
+    struct stat statbuf;
+    lsparse_t ps;
+    module_t *mod;
+    dqueue_t *dq;
+    uint64_t hash;
+    char *buf;
+    int fd;
+
+    fd = open(filename,O_RDONLY);
+    if (fd < 0) {
+        printf("Warning: Could not open include file %s : %s\n",filename,strerror(errno));
+        return NULL;
+    }
+
+    if ((fstat(fd,&statbuf) < 0) || (statbuf.st_size == 0)) {
+        close(fd);
+        return NULL;
+    }
+
+    buf = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED) {
+        printf("Warning: Could not read include file %s : %s\n",filename,strerror(errno));
+        return NULL;
+    }
+
+    hash = hashbytes(buf, statbuf.st_size);
+
+    pthread_mutex_lock(&modlock);
+    mod = findmodule(hash, statbuf.st_size, includer);
+    pthread_mutex_unlock(&modlock);
+
+    if (mod) {
+        munmap(buf, statbuf.st_size);
+        return mod;
+    }
+
+    memset(&ps,0,sizeof(ps));
+    ps.filename = filename;
+    parse_buffer(&ps, buf, (int) statbuf.st_size);
+    munmap(buf, statbuf.st_size);
+
+    if (ps.errors || !ps.tree) {
+        printf("Warning: There was an error in include file %s\n",filename);
+        return NULL;
+    }
+
+    mod = (module_t *) stats_calloc(MEM_MODULES,1,sizeof(module_t));
+    mod->hash = hash;
+    mod->size = statbuf.st_size;
+    mod->filename = strdup(filename);
+    mod->tree = ps.tree;
+
+    initscript(&(mod->defs));
+    mod->defs.depth = includer->depth + 1;
+
+    // See what the includer sees.
+    for (dq = includer->imports.dq_next; dq != &(includer->imports); dq = dq->dq_next) {
+        import_t *imp = (import_t *) stats_calloc(MEM_MODULES,1,sizeof(import_t));
+
+        imp->defs = ((import_t *) dq)->defs;
+        dq_enqueue(&(mod->defs.imports), &(imp->link));
+        mod->nscope++;
+    }
+
+    savedefines(&(mod->defs), mod->tree);
+
+    // Someone else may have loaded the same thing while we were busy.
+    // Theirs wins, ours is thrown away.
+    pthread_mutex_lock(&modlock);
+    {
+        module_t *other = findmodule(hash, statbuf.st_size, includer);
+
+        if (!other) {
+            dq_enqueue(&modules, &(mod->link));
+        }
+        pthread_mutex_unlock(&modlock);
+
+        if (other) {
+            freemodule(mod);
+            mod = other;
+        }
+    }
+
+    return mod;
+}
+
+void include_module(script_t *script, char *filename)
+{
+    module_t *mod;
+    import_t *imp;
+    dqueue_t *dq;
+
+    if (script->depth >= MAXINCLUDEDEPTH) {
+        printf("Warning: Includes nested too deeply at %s\n",filename);
+        return;
+    }
+
+    mod = loadmodule(filename, script);
+    if (!mod) {
+        return;
+    }
+
+    for (dq = script->imports.dq_next; dq != &(script->imports); dq = dq->dq_next) {
+        if (((import_t *) dq)->defs == &(mod->defs)) {
+            return;             // already included
+        }
+    }
+
+    imp = (import_t *) stats_calloc(MEM_MODULES,1,sizeof(import_t));
+    imp->defs = &(mod->defs);
+    dq_enqueue(&(script->imports), &(imp->link));
+
+    // Pick up idle and music from the module unless we have our own.
+    if (!script->idleanimation) script->idleanimation = mod->defs.idleanimation;
+    if (!script->musicfile) script->musicfile = mod->defs.musicfile;
+}
@@ -17,39 +17,442 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <time.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #include "lightscript.h"
 
-#define MSGSIZE 16
+#define MAXDEST         16              // UDP controllers per sink
+#define UDPMAXFRAMES    80              // frames per datagram, fits a 1500 byte MTU
+#define MCASTTTL        1               // multicast stays on the local network
+#define RXBUF           512             // replies from the controller
 
-static double current_time(script_t *script)
+/*  *********************************************************************
+    *  Output sinks
+    *
+    *  Where frames go.  The device name picks the sink:
+    *
+    *      udp:host:port[,host:port...]   datagrams to one or more
+    *                                     controllers, or a multicast group
+    *      file:path                      raw frames to a file
+    *      null                           nowhere, but counted
+    *      anything else                  a serial device, like /dev/cu.usbmodem1
+    *
+    *  Frames are handed to the sink one at a time, then the sink is
+    *  flushed after the last event at each time in the schedule.
+    *  The UDP sink packs the events for one time into one datagram.
+    *  Those frames are marked as a group (LSFLAG_HOLD) so the
+    *  controller changes the strips together, unless the controller
+    *  can't take that (--nogroup).  A player that is running late
+    *  still cuts the groups by time, so a late cue doesn't merge
+    *  with the next one.
+    *
+    *  Serial and UDP controllers can talk back (see lslatency.c).
+    *  Their replies are frames too and come in through sink_recv().
+    ********************************************************************* */
+
+struct lssink_s {
+    char *name;
+    void (*send)(lssink_t *sink, lsmessage_t *msg);
+    void (*flush)(lssink_t *sink);
+    void (*close)(lssink_t *sink);
+    int (*recv)(lssink_t *sink, uint8_t *buf, int len);
+
+    int fd;
+    FILE *str;
+
+    // UDP
+    struct sockaddr_storage dest[MAXDEST];
+    socklen_t destlen[MAXDEST];
+    int ndest;
+    uint8_t packet[sizeof(lsudphdr_t) + UDPMAXFRAMES * sizeof(lsmessage_t)];
+    int nframes;
+    uint32_t seq;
+    uint64_t errors;
+
+    // Bytes read back, until they make up a whole frame
+    uint8_t rxbuf[RXBUF];
+    int rxlen;
+
+    // The latest frame, until we know if it ends the group
+    lsmessage_t held;
+    int holding;
+};
+
+int use_groups = 1;
+
+static void serial_send(lssink_t *sink, lsmessage_t *msg)
 {
-    struct timeval tv;
+    if (write(sink->fd, msg, sizeof(lsmessage_t)) != sizeof(lsmessage_t)) {
+        perror("Write Error to Arduino");
+        exit(1);
+    }
+}
 
-    gettimeofday(&tv,NULL);
+static int serial_recv(lssink_t *sink, uint8_t *buf, int len)
+{
+    return (int) read(sink->fd, buf, len);
+}
 
-    return ((double) (tv.tv_sec - script->epoch)) + ((double)(tv.tv_usec)/1000000.0);
+static void serial_close(lssink_t *sink)
+{
+    close(sink->fd);
 }
 
-typedef struct __attribute__((packed)) lsmessage_s {
-    uint8_t     ls_sync[2];
-    uint16_t    ls_reserved;
-    uint16_t    ls_anim;
-    uint16_t    ls_speed;
-    uint16_t    ls_option;
-    uint32_t    ls_color;
-    uint32_t    ls_strips;
-} lsmessage_t;
+static void file_send(lssink_t *sink, lsmessage_t *msg)
+{
+    fwrite(msg, sizeof(lsmessage_t), 1, sink->str);
+}
 
-void send_message(script_t *script, unsigned int strips, unsigned int anim,  unsigned int speed, unsigned int option, unsigned int palette)
+static void file_flush(lssink_t *sink)
 {
-    lsmessage_t msg;
+    fflush(sink->str);
+}
+
+static void file_close(lssink_t *sink)
+{
+    fclose(sink->str);
+}
+
+static void null_send(lssink_t *sink, lsmessage_t *msg)
+{
+}
 
-    if (script->device <= 0) {
+static void null_flush(lssink_t *sink)
+{
+}
+
+static void null_close(lssink_t *sink)
+{
+}
+
+static void udp_flush(lssink_t *sink)
+{
+    lsudphdr_t *hdr = (lsudphdr_t *) sink->packet;
+    size_t len;
+    int i;
+
+    if (sink->nframes == 0) {
         return;
     }
 
+    hdr->lu_magic[0] = 'L';
+    hdr->lu_magic[1] = 'S';
+    hdr->lu_version = LSUDP_VERSION;
+    hdr->lu_count = sink->nframes;
+    hdr->lu_seq = sink->seq++;
+
+    len = sizeof(lsudphdr_t) + sink->nframes * sizeof(lsmessage_t);
+
+    for (i = 0; i < sink->ndest; i++) {
+        if (sendto(sink->fd, sink->packet, len, 0, (struct sockaddr *) &(sink->dest[i]), sink->destlen[i]) < 0) {
+            // Don't stop the show for a lost datagram, but say so once.
+            if (sink->errors++ == 0) {
+                perror("Send Error to controller");
+            }
+        }
+    }
+
+    sink->nframes = 0;
+}
+
+static void udp_send(lssink_t *sink, lsmessage_t *msg)
+{
+    if (sink->nframes == UDPMAXFRAMES) {
+        udp_flush(sink);
+    }
+
+    memcpy(sink->packet + sizeof(lsudphdr_t) + sink->nframes * sizeof(lsmessage_t), msg, sizeof(lsmessage_t));
+    sink->nframes++;
+}
+
+//
+// Replies come back in datagrams like ours: the header, then frames.
+//
+static int udp_recv(lssink_t *sink, uint8_t *buf, int len)
+{
+    uint8_t packet[sizeof(lsudphdr_t) + UDPMAXFRAMES * sizeof(lsmessage_t)];
+    lsudphdr_t *hdr = (lsudphdr_t *) packet;
+    ssize_t n;
+
+    n = recv(sink->fd, packet, sizeof(packet), 0);
+    if ((n < (ssize_t) sizeof(lsudphdr_t)) || (hdr->lu_magic[0] != 'L') || (hdr->lu_magic[1] != 'S')) {
+        return 0;
+    }
+
+    n -= sizeof(lsudphdr_t);
+    if (n > len) n = len;
+    memcpy(buf, packet + sizeof(lsudphdr_t), n);
+
+    return (int) n;
+}
+
+static void udp_close(lssink_t *sink)
+{
+    udp_flush(sink);
+    if (sink->errors) {
+        printf("Warning: %llu datagrams could not be sent\n",(unsigned long long) sink->errors);
+    }
+    close(sink->fd);
+}
+
+//
+// Resolve "host:port,host:port..." and open one socket for all of them.
+//
+static int udp_open(lssink_t *sink, char *targets)
+{
+    char *list = strdup(targets);
+    char *tok, *save = NULL;
+    int family = AF_UNSPEC;
+    int res = 0;
+
+    sink->fd = -1;
+
+    for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        struct addrinfo hints, *ai;
+        char *port = strrchr(tok, ':');
+        char *host = tok;
+        int err;
+
+        if (!port || (sink->ndest == MAXDEST)) {
+            fprintf(stderr,"Error: bad UDP destination '%s', expected host:port\n",tok);
+            res = -1;
+            break;
+        }
+        *port++ = 0;
+
+        // [v6addr]:port
+        if ((host[0] == '[') && (host[strlen(host)-1] == ']')) {
+            host[strlen(host)-1] = 0;
+            host++;
+        }
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = family;
+        hints.ai_socktype = SOCK_DGRAM;
+
+        if ((err = getaddrinfo(host, port, &hints, &ai)) != 0) {
+            fprintf(stderr,"Error: could not resolve %s: %s\n",host,gai_strerror(err));
+            res = -1;
+            break;
+        }
+
+        if (sink->fd < 0) {
+            family = ai->ai_family;
+            sink->fd = socket(family, SOCK_DGRAM, 0);
+            if (sink->fd < 0) {
+                perror("Could not create UDP socket");
+                freeaddrinfo(ai);
+                res = -1;
+                break;
+            }
+        }
+
+        memcpy(&(sink->dest[sink->ndest]), ai->ai_addr, ai->ai_addrlen);
+        sink->destlen[sink->ndest] = ai->ai_addrlen;
+
+        // Multicast: keep it local, and loop it back so a listener on
+        // this machine hears it too.
+        if (family == AF_INET) {
+            struct sockaddr_in *sin = (struct sockaddr_in *) ai->ai_addr;
+            if (IN_MULTICAST(ntohl(sin->sin_addr.s_addr))) {
+                unsigned char ttl = MCASTTTL, loop = 1;
+                setsockopt(sink->fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+                setsockopt(sink->fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+            }
+        } else if (family == AF_INET6) {
+            struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) ai->ai_addr;
+            if (IN6_IS_ADDR_MULTICAST(&(sin6->sin6_addr))) {
+                int hops = MCASTTTL, loop = 1;
+                setsockopt(sink->fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &hops, sizeof(hops));
+                setsockopt(sink->fd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &loop, sizeof(loop));
+            }
+        }
+
+        sink->ndest++;
+        freeaddrinfo(ai);
+    }
+
+    free(list);
+
+    if ((res == 0) && (sink->ndest == 0)) {
+        fprintf(stderr,"Error: no UDP destinations in '%s'\n",targets);
+        res = -1;
+    }
+
+    if ((res < 0) && (sink->fd >= 0)) {
+        close(sink->fd);
+    }
+
+    return res;
+}
+
+//
+// Open the sink named by a device name, or return NULL after
+// saying why not.
+//
+lssink_t *sink_open(char *name)
+{
+    lssink_t *sink = (lssink_t *) calloc(1,sizeof(lssink_t));
+
+    sink->name = name;
+
+    if (strncmp(name,"udp:",4) == 0) {
+        if (udp_open(sink, name+4) < 0) {
+            free(sink);
+            return NULL;
+        }
+        sink->send = udp_send;
+        sink->flush = udp_flush;
+        sink->close = udp_close;
+        sink->recv = udp_recv;
+    } else if (strncmp(name,"file:",5) == 0) {
+        sink->str = fopen(name+5,"wb");
+        if (!sink->str) {
+            fprintf(stderr,"Error: Could not create %s: %s\n",name+5, strerror(errno));
+            free(sink);
+            return NULL;
+        }
+        sink->send = file_send;
+        sink->flush = file_flush;
+        sink->close = file_close;
+    } else if (strcmp(name,"null") == 0) {
+        sink->send = null_send;
+        sink->flush = null_flush;
+        sink->close = null_close;
+    } else {
+        sink->fd = open(name,O_RDWR);
+        if (sink->fd < 0) {
+            fprintf(stderr,"Error: Could not open Arduino device %s: %s\n",name, strerror(errno));
+            free(sink);
+            return NULL;
+        }
+        sink->send = serial_send;
+        sink->flush = null_flush;
+        sink->close = serial_close;
+        sink->recv = serial_recv;
+    }
+
+    return sink;
+}
+
+//
+// Each frame is held back until the next one comes along, which
+// means it is not the last of its group, so it goes out with HOLD
+// set.  The flush sends the last one as it is.
+//
+void sink_send(lssink_t *sink, lsmessage_t *msg)
+{
+    if (!use_groups) {
+        sink->send(sink, msg);
+        return;
+    }
+
+    if (sink->holding) {
+        sink->held.ls_reserved |= LSFLAG_HOLD;
+        sink->send(sink, &(sink->held));
+    }
+
+    sink->held = *msg;
+    sink->holding = 1;
+}
+
+static void sink_release(lssink_t *sink)
+{
+    if (sink->holding) {
+        sink->send(sink, &(sink->held));
+        sink->holding = 0;
+    }
+}
+
+void sink_flush(lssink_t *sink)
+{
+    record_flush();
+
+    if (sink) {
+        sink_release(sink);
+        sink->flush(sink);
+    }
+}
+
+//
+// Wait up to timeout milliseconds for a frame from the controller.
+// Returns 1 with the frame, or 0 if none came (or the sink is one
+// that can't answer).
+//
+int sink_recv(lssink_t *sink, lsmessage_t *msg, int timeout)
+{
+    struct pollfd pfd;
+    int n, i;
+
+    if (!sink || !sink->recv) {
+        return 0;
+    }
+
+    for (;;) {
+        // Line up on the sync bytes, dropping anything before them.
+        for (i = 0; i + 1 < sink->rxlen; i++) {
+            if ((sink->rxbuf[i] == 0x02) && (sink->rxbuf[i+1] == 0xAA)) {
+                break;
+            }
+        }
+        if ((i + 1 >= sink->rxlen) && (sink->rxlen > 0) && (sink->rxbuf[sink->rxlen-1] != 0x02)) {
+            i = sink->rxlen;
+        }
+        if (i > 0) {
+            memmove(sink->rxbuf, sink->rxbuf + i, sink->rxlen - i);
+            sink->rxlen -= i;
+        }
+
+        if (sink->rxlen >= (int) sizeof(lsmessage_t)) {
+            memcpy(msg, sink->rxbuf, sizeof(lsmessage_t));
+            sink->rxlen -= sizeof(lsmessage_t);
+            memmove(sink->rxbuf, sink->rxbuf + sizeof(lsmessage_t), sink->rxlen);
+            return 1;
+        }
+
+        pfd.fd = sink->fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, timeout) <= 0) {
+            return 0;
+        }
+
+        n = sink->recv(sink, sink->rxbuf + sink->rxlen, RXBUF - sink->rxlen);
+        if (n <= 0) {
+            return 0;
+        }
+        sink->rxlen += n;
+
+        // Whatever else there is, we don't wait for it.
+        timeout = 0;
+    }
+}
+
+void sink_close(lssink_t *sink)
+{
+    if (sink) {
+        if (sink->holding) {
+            sink_flush(sink);
+        }
+        sink->close(sink);
+        free(sink);
+    }
+}
+
+/*  *********************************************************************
+    *  Playback
+    ********************************************************************* */
+
+static uint64_t frames_sent;
+
+void send_message(script_t *script, unsigned int strips, unsigned int anim,  unsigned int speed, unsigned int option, unsigned int palette)
+{
+    lsmessage_t msg;
+
     msg.ls_sync[0] = 0x02;
     msg.ls_sync[1] = 0xAA;
     msg.ls_strips = strips;
@@ -59,75 +462,106 @@ void send_message(script_t *script, unsigned int strips, unsigned int anim,  uns
     msg.ls_color = palette;
     msg.ls_reserved = 0;
 
-    if (write(script->device, &msg, sizeof(msg)) != sizeof(msg)) {
-        perror("Write Error to Arduino");
-        exit(1);
+    record_frame(&msg);
+    frames_sent++;
+
+    if (!script->sink) {
+        return;
     }
+
+    sink_send(script->sink, &msg);
 }
 
-static void play_events(script_t *script)
+//
+// Send one event from the schedule.
+//
+static void send_event(script_t *script, lsevent_t *ev)
 {
-    dqueue_t *dq;
+    unsigned int anim;
 
-    double start_time;
+    anim = ev->animation;
+    if (ev->direction) anim |= 0x8000;
 
-    start_time = current_time(script) + script->start_offset;
+    printevent(script, ev);
+    send_message(script, ev->stripmask, anim, ev->speed, ev->option, ev->palette);
+}
 
-    dq = script->schedule.dq_next;
+static void play_events(script_t *script)
+{
+    schedcursor_t cur;
+    lsevent_t ev;
+    lstime_t next;
 
-    if (script->start_cue != 0.0) {
-        while (dq != &(script->schedule)) {
-            schedcmd_t *cmd = (schedcmd_t *) dq;
-            if (cmd->time < script->start_cue) {
-                dq = dq->dq_next;
-            } else {
-                break;
-            }
-        }
+    lstime_t start_time;
+
+    // Starting partway in, put the strips the way they should be.
+    if (script->start_cue != 0) {
+        seek_restore(script, script->start_cue);
     }
 
-    while (dq != &(script->schedule)) {
-        double now;
+    start_time = clock_now() + script->start_offset;
+
+    cursor_seek(&cur, script, script->start_cue);
 
-        schedcmd_t *cmd = (schedcmd_t *) dq;
+    while (cursor_peek(&cur, &next)) {
+        lstime_t now;
 
         // Figure out the difference between the time stamp
-        // at the start and now.
-        now = current_time(script) - start_time + script->start_cue;
+        // at the start and now.  Frames take script->latency to
+        // land, so we run that far ahead.
+        now = clock_now() - start_time + script->start_cue + script->latency;
 
         // If the current time is past the script command's time,
         // do the command.
 
-        if (now >= cmd->time) {
-            unsigned int anim;
-
-            anim = cmd->animation;
-            if (cmd->direction) anim |= 0x8000;
-            
-            printsched1(script,cmd);
-            send_message(script, cmd->stripmask, anim, cmd->speed, cmd->option, cmd->palette);
-
-            dq = dq->dq_next;
+        if (now >= next) {
+            int more;
+
+            // Everything that is due, a group for each time.
+            do {
+                cursor_next(&cur, &ev);
+                send_event(script, &ev);
+                more = cursor_peek(&cur, &next);
+                if (!more || (next != ev.time)) {
+                    sink_flush(script->sink);
+                }
+            } while (more && (now >= next));
+        } else {
+            // Nothing to do until the next command, or until just
+            // past the end cue if that comes first.
+            if ((script->end_cue != 0) && (script->end_cue < next)) {
+                next = script->end_cue + 1;
+            }
+            clock_wait(start_time + next - script->start_cue - script->latency);
+            latency_poll(script);
+            inject_poll(script, now - script->latency);
         }
 
         if ((script->end_cue != 0) && (now > (script->end_cue))) {
             break;
         }
+
+        if (script->abort) {
+            break;
+        }
     }
 
+    cursor_free(&cur);
 }
 
-static dqueue_t *musicpos;
+static schedcursor_t musiccur;
 static script_t *curscript;
 
-int player_callback(double now)
+int player_callback(double secs)
 {
-    schedcmd_t *cmd = (schedcmd_t *) musicpos;
+    lstime_t now = LSTIME_FROMSECS(secs) + curscript->latency;
+    lstime_t next;
+    lsevent_t ev;
 
     // If the current time is past the script command's time,
     // do the command.
 
-    if (musicpos == &(curscript->schedule)) {
+    if (!cursor_peek(&musiccur, &next)) {
         // End of script, stop playing
         return 0;
     }
@@ -137,16 +571,25 @@ int player_callback(double now)
         return 0;
     }
 
-    if (now >= cmd->time) {
-        unsigned int anim;
+    if (curscript->abort) {
+        // Stopped by the daemon
+        return 0;
+    }
 
-        anim = cmd->animation;
-        if (cmd->direction) anim |= 0x8000;
-            
-        printsched1(curscript,cmd);
-        send_message(curscript, cmd->stripmask, anim, cmd->speed, cmd->option, cmd->palette);
+    if (now >= next) {
+        int more;
 
-        musicpos = musicpos->dq_next;
+        do {
+            cursor_next(&musiccur, &ev);
+            send_event(curscript, &ev);
+            more = cursor_peek(&musiccur, &next);
+            if (!more || (next != ev.time)) {
+                sink_flush(curscript->sink);
+            }
+        } while (more && (now >= next));
+    } else {
+        latency_poll(curscript);
+        inject_poll(curscript, now - curscript->latency);
     }
 
     // Keep going
@@ -154,33 +597,60 @@ int player_callback(double now)
 
 }
 
+//
+// Stand in for the music player on a dry run: call back at each
+// deadline instead of every few milliseconds of audio.
+//
+static void dryrun_music(script_t *script)
+{
+    lstime_t start_time = clock_now();
+    lstime_t now = script->start_cue;
+    lstime_t next;
+
+    while (player_callback(LSTIME_SECS(now))) {
+        if (cursor_peek(&musiccur, &next) && (next > now)) {
+            if ((script->end_cue != 0) && (script->end_cue < next)) {
+                next = script->end_cue;
+            }
+            clock_wait(start_time + next - script->start_cue);
+        }
+        now = clock_now() - start_time + script->start_cue;
+    }
+}
+
 extern int playMusicFile(const char *name, int (*callback)(double),double start_cue);
 
 static void play_music(script_t *script)
 {
+    lstime_t next;
+
     curscript = script;
-    musicpos = script->schedule.dq_next;
 
-    // Seek in script to cue point
+    // Seek in script to cue point, the music is already there
+    // so skip anything right at the cue too.
 
-    if (script->start_cue != 0.0) {
-        while (musicpos != &(curscript->schedule)) {
-            schedcmd_t *cmd = (schedcmd_t *) musicpos;
-            if (cmd->time > script->start_cue) break;
-            musicpos = musicpos->dq_next;
-        }
+    cursor_seek(&musiccur, script, (script->start_cue != 0) ? script->start_cue + 1 : 0);
 
-        // We started past the end of the script, bail.
-        if (musicpos == &(curscript->schedule)) {
-            return;
-        }
+    if (script->start_cue != 0) {
+        seek_restore(script, script->start_cue + 1);
     }
 
+    // We started past the end of the script, bail.
+    if (!cursor_peek(&musiccur, &next)) {
+        cursor_free(&musiccur);
+        return;
+    }
+
+    if (clock_is_virtual()) {
+        dryrun_music(script);
+    } else {
+        playMusicFile((const char *) script->musicfile, player_callback, LSTIME_SECS(script->start_cue));
+    }
 
-    playMusicFile((const char *) script->musicfile, player_callback, script->start_cue);
+    cursor_free(&musiccur);
 }
 
-static void play_idle(script_t *script)
+void play_idle(script_t *script)
 {
     symbol_t *sym;
 
@@ -188,7 +658,7 @@ static void play_idle(script_t *script)
         return;         // no idleanimation specified
     }
 
-    sym = findsym(&(script->symbols),script->idleanimation);
+    sym = lookupsym(script,script->idleanimation);
 
     if (sym == NULL) {
         printf("Warning: idle animation '%s' is not valid\n",script->idleanimation);
@@ -197,33 +667,58 @@ static void play_idle(script_t *script)
     
     // Start the idle animation.
     send_message(script, 0x7FF, sym->wvalues[0], 500, 0, 0);
+    sink_flush(script->sink);
+}
+
+//
+// Run the schedule on an already-open device.  Returns when the
+// show ends, reaches the end cue, or script->abort is set.
+//
+void play_show(script_t *script, int how)
+{
+    script->abort = 0;
+
+    if (how == 0) {
+        play_events(script);
+    } else if (how == 2) {
+        play_stream(script);
+    } else {
+        play_music(script);
+    }
 }
 
 
 void play_script(script_t *script, int how)
 {
 
+    script->sink = NULL;                // No device, just pretend.
     if (script->device_name != NULL) {
-        script->device = open(script->device_name,O_RDWR);
-
-        if (script->device < 0) {
-            fprintf(stderr,"Error: Could not open Arduino device %s: %s\n",script->device_name, strerror(errno));
+        script->sink = sink_open(script->device_name);
+        if (!script->sink) {
             return;
         }
-    } else {
-        script->device = 0;             // No device, just pretend.
     }
 
     play_idle(script);
 
+    // Before we wait for the user, so the report can be read
+    // and nothing slow is left to do once we start.
+    latency_calibrate(script);
+    realtime_setup(script);
+
+    if (inject_open(script) < 0) {
+        sink_close(script->sink);
+        script->sink = NULL;
+        return;
+    }
+
     printf("\n\n");
     printf("Press ENTER to start playback\n"); getchar();
     
-    if (how == 0) {
-        play_events(script);
-    } else {
-        play_music(script);
-    }
+    play_show(script, how);
+
+    inject_close(script);
+    latency_report(script);
 
     sleep(1);
 
@@ -231,7 +726,45 @@ void play_script(script_t *script, int how)
 
     sleep(1);
 
-    close(script->device);
+    sink_close(script->sink);
+    script->sink = NULL;
 }
 
+//
+// Play the show on the virtual clock, as fast as it will go, through
+// the same code as play_script().  The device is optional; the null
+// sink, a UDP listener or a PTY lets the writes happen too.
+//
+void dryrun_script(script_t *script, int how)
+{
+    lstime_t wall, show;
 
+    script->sink = NULL;
+    if (script->device_name != NULL) {
+        script->sink = sink_open(script->device_name);
+        if (!script->sink) {
+            return;
+        }
+    }
+
+    clock_use_virtual(1);
+    frames_sent = 0;
+
+    play_idle(script);
+
+    wall = current_ticks();
+    play_show(script, how);
+    wall = current_ticks() - wall;
+    show = clock_now();
+
+    play_idle(script);
+
+    clock_use_virtual(0);
+
+    sink_close(script->sink);
+    script->sink = NULL;
+
+    printf("* Dry run: %llu frames, %.3f seconds of show in %.3f seconds (%.0fx realtime)\n",
+           (unsigned long long) frames_sent, LSTIME_SECS(show), LSTIME_SECS(wall),
+           (wall > 0) ? (double) show / (double) wall : 0.0);
+}
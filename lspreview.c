@@ -0,0 +1,734 @@
+/*  *********************************************************************
+    *  LightScript - A script processor for LED animations
+    *
+    *  Preview Renderer                         File: lspreview.c
+    *
+    *  Renders the schedule to pixels without the rig, so a show
+    *  can be looked at before it is played.  Each strip gets a
+    *  software model of what the Arduino does with the animation
+    *  number, speed, palette or color and direction it was sent;
+    *  the models are approximations of the ALA animations named
+    *  in lightscript.cfg, close enough to judge timing and color.
+    *
+    *  Every frame is an image one row per strip, written to a raw
+    *  RGB file (script.rgb) or as PPM images (script.frames/).
+    *
+    *  Each model fills in a palette position and a level for each
+    *  pixel; the clamping, scaling and conversion that turn those
+    *  into colors run 4 pixels at a time.  The palette lookup
+    *  itself is a pixel at a time, as vector extensions have no
+    *  gather.  Strips are independent, so a block of frames is
+    *  rendered one strip per thread, on threads started once for
+    *  the whole preview.
+    *
+    *  Author:  Mitch Lichtenberg
+    ********************************************************************* */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "lightscript.h"
+
+#define BLOCKFRAMES     128             // frames rendered between writes
+#define VLEN            4               // pixels per vector, 128 bits for SSE and NEON
+#define TAILSECS        2               // keep rendering after the last event
+#define MAXFPS          1000            // more than any controller can show
+
+typedef float v4f __attribute__((vector_size(VLEN * sizeof(float))));
+typedef int v4i __attribute__((vector_size(VLEN * sizeof(int))));
+
+// Animation numbers, from lightscript.cfg
+#define A_STOP                  100
+#define A_ON                    101
+#define A_OFF                   102
+#define A_BLINK                 103
+#define A_BLINKALT              104
+#define A_SPARKLE               105
+#define A_SPARKLE2              106
+#define A_STROBO                107
+#define A_SOUNDPULSE            108
+#define A_IDLEWHITE             109
+#define A_SINGLEPIXEL           110
+#define A_PIXELLINE             111
+#define A_GROW                  112
+#define A_SHRINK                113
+#define A_PIXELMARCH            114
+#define A_CYCLECOLORS           151
+#define A_PIXELSHIFTRIGHT       201
+#define A_PIXELSHIFTLEFT        202
+#define A_PIXELBOUNCE           203
+#define A_PIXELSMOOTHSHIFTRIGHT 211
+#define A_PIXELSMOOTHSHIFTLEFT  212
+#define A_PIXELSMOOTHBOUNCE     213
+#define A_COMET                 221
+#define A_COMETCOL              222
+#define A_MOVINGBARS            241
+#define A_MOVINGGRADIENT        242
+#define A_LARSONSCANNER         251
+#define A_LARSONSCANNER2        252
+#define A_FADEIN                301
+#define A_FADEOUT               302
+#define A_FADEINOUT             303
+#define A_GLOW                  304
+#define A_PLASMA                305
+#define A_FADECOLORS            351
+#define A_FADECOLORSLOOP        352
+#define A_PIXELSFADECOLORS      353
+#define A_FLAME                 354
+#define A_FIRE                  501
+#define A_BOUNCINGBALLS         502
+#define A_BUBBLES               503
+
+typedef struct pvstrip_s {
+    int active;
+    lstime_t start;                     // when the animation was sent
+    unsigned int anim;
+    unsigned int speed;
+    unsigned int option;
+    unsigned int palette;
+    int reverse;
+    schedcursor_t cur;                  // next event to look at
+
+    // Palette expanded to 256 steps, one plane per channel
+    unsigned int palid;
+    int palvalid;
+    float pr[256], pg[256], pb[256];
+
+    // Per-pixel model output for the frame being rendered
+    float *pos;                         // palette position, 0 to 1
+    float *level;                       // brightness, 0 to 1
+} pvstrip_t;
+
+typedef struct preview_s {
+    script_t *script;
+    int pixels;                         // per strip, a multiple of VLEN
+    int fps;
+    int rowbytes;
+    int framebytes;
+
+    pvstrip_t strips[MAXSTRIPS];
+
+    // The block being rendered
+    uint8_t *block;
+    lstime_t blocktime;
+    int blockframe;                     // number of its first frame
+    int nframes;
+    int nextstrip;                      // handed out to the threads
+
+    // The render threads wait here between blocks
+    pthread_mutex_t lock;
+    pthread_cond_t go;                  // a new block, or stop
+    pthread_cond_t done;                // the last thread finished a block
+    int generation;                     // blocks handed out so far
+    int busy;                           // threads still on this block
+    int stop;
+} preview_t;
+
+/*  *********************************************************************
+    *  Palettes
+    ********************************************************************* */
+
+static const uint32_t pal_rgb[] = {0xFF0000, 0x00FF00, 0x0000FF};
+static const uint32_t pal_rainbow[] = {0xFF0000, 0xFFFF00, 0x00FF00, 0x00FFFF, 0x0000FF, 0xFF00FF};
+static const uint32_t pal_rainbowstripe[] = {0xFF0000, 0x000000, 0xFFFF00, 0x000000, 0x00FF00, 0x000000,
+                                             0x0000FF, 0x000000};
+static const uint32_t pal_party[] = {0x5500AB, 0x84007C, 0xB5004B, 0xE5001B, 0xE81700, 0xB84700,
+                                     0xAB7700, 0xABAB00, 0xAB5500, 0xDD2200, 0xF2000E, 0xC2003E};
+static const uint32_t pal_heat[] = {0x000000, 0x800000, 0xFF0000, 0xFF8000, 0xFFFF00, 0xFFFFFF};
+static const uint32_t pal_fire[] = {0x000000, 0x660000, 0xFF0000, 0xFF6600, 0xFFCC00};
+static const uint32_t pal_cool[] = {0x0000FF, 0x0080FF, 0x00FFFF, 0x80FFFF};
+
+static uint32_t wheel(unsigned int pos)
+{
+    // 0 to 63 around the color wheel, like the firmware's palettes 0-63
+    float h = (float) (pos & 63) / 64.0f * 6.0f;
+    int sector = (int) h;
+    float f = h - (float) sector;
+    unsigned int up = (unsigned int) (f * 255.0f);
+    unsigned int down = 255 - up;
+
+    switch (sector) {
+        case 0: return 0xFF0000 | (up << 8);
+        case 1: return (down << 16) | 0x00FF00;
+        case 2: return 0x00FF00 | up;
+        case 3: return (down << 8) | 0x0000FF;
+        case 4: return (up << 16) | 0x0000FF;
+        default: return 0xFF0000 | down;
+    }
+}
+
+//
+// Expand a palette into the strip's 256-step tables, blending
+// around the keys so moving animations wrap smoothly.
+//
+static void setpalette(pvstrip_t *st, unsigned int palette)
+{
+    const uint32_t *keys;
+    uint32_t solid;
+    int nkeys;
+    int i;
+
+    if (st->palvalid && (st->palid == palette)) {
+        return;
+    }
+
+    if (palette & 0x1000000) {
+        solid = palette & 0xFFFFFF;
+        keys = &solid; nkeys = 1;
+    } else if (palette < 64) {
+        solid = wheel(palette);
+        keys = &solid; nkeys = 1;
+    } else {
+        switch (palette) {
+            case 64: keys = pal_rgb; nkeys = 3; break;
+            case 66: keys = pal_rainbowstripe; nkeys = 8; break;
+            case 67: keys = pal_party; nkeys = 12; break;
+            case 68: keys = pal_heat; nkeys = 6; break;
+            case 69: keys = pal_fire; nkeys = 5; break;
+            case 70: keys = pal_cool; nkeys = 4; break;
+            case 71: solid = 0xFFFFFF; keys = &solid; nkeys = 1; break;
+            case 80: solid = 0xFF0000; keys = &solid; nkeys = 1; break;
+            case 82: solid = 0x00FF00; keys = &solid; nkeys = 1; break;
+            case 84: solid = 0x0000FF; keys = &solid; nkeys = 1; break;
+            default: keys = pal_rainbow; nkeys = 6; break;
+        }
+    }
+
+    for (i = 0; i < 256; i++) {
+        float x = (float) i * (float) nkeys / 256.0f;
+        int k = (int) x;
+        float f = x - (float) k;
+        uint32_t a = keys[k % nkeys];
+        uint32_t b = keys[(k+1) % nkeys];
+
+        st->pr[i] = ((float) ((a >> 16) & 0xFF) * (1.0f - f) + (float) ((b >> 16) & 0xFF) * f) / 255.0f;
+        st->pg[i] = ((float) ((a >> 8) & 0xFF) * (1.0f - f) + (float) ((b >> 8) & 0xFF) * f) / 255.0f;
+        st->pb[i] = ((float) (a & 0xFF) * (1.0f - f) + (float) (b & 0xFF) * f) / 255.0f;
+    }
+
+    st->palid = palette;
+    st->palvalid = 1;
+}
+
+/*  *********************************************************************
+    *  Animation models
+    ********************************************************************* */
+
+static inline float wrap(float x)
+{
+    return x - floorf(x);
+}
+
+static inline float hashf(uint32_t a, uint32_t b, uint32_t c)
+{
+    uint32_t h = a * 0x9E3779B1u ^ b * 0x85EBCA77u ^ c * 0xC2B2AE3Du;
+
+    h ^= h >> 15; h *= 0x2C1B3C6Du;
+    h ^= h >> 12; h *= 0x297A2D39u;
+    h ^= h >> 15;
+
+    return (float) (h >> 8) / 16777216.0f;
+}
+
+//
+// Fill in pos[] and level[] for one strip at one frame.
+//
+static void model(preview_t *pv, int strip, pvstrip_t *st, lstime_t now, int frame)
+{
+    int n = pv->pixels;
+    float *pos = st->pos;
+    float *level = st->level;
+    float period = (float) (st->speed ? st->speed : 1000) / 1000.0f;
+    float elapsed = (float) LSTIME_SECS(now - st->start);
+    float phase = wrap(elapsed / period);
+    float tri = (phase < 0.5f) ? phase * 2.0f : 2.0f - phase * 2.0f;
+    float head, tail;
+    int i;
+
+    if (!st->active) {
+        for (i = 0; i < n; i++) {
+            pos[i] = 0;
+            level[i] = 0;
+        }
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        pos[i] = (float) i / (float) n;
+        level[i] = 1.0f;
+    }
+
+    switch (st->anim) {
+        case A_STOP:
+        case A_OFF:
+            for (i = 0; i < n; i++) level[i] = 0;
+            break;
+
+        case A_ON:
+            break;
+
+        case A_IDLEWHITE:
+            for (i = 0; i < n; i++) level[i] = 0.25f;
+            break;
+
+        case A_BLINK:
+            for (i = 0; i < n; i++) level[i] = (phase < 0.5f);
+            break;
+
+        case A_BLINKALT:
+            for (i = 0; i < n; i++) level[i] = ((i & 1) ^ (phase < 0.5f));
+            break;
+
+        case A_STROBO:
+            for (i = 0; i < n; i++) level[i] = (phase < 0.1f);
+            break;
+
+        case A_SPARKLE:
+        case A_SPARKLE2:
+            for (i = 0; i < n; i++) {
+                level[i] = (hashf(strip, frame, i) < 0.1f);
+                pos[i] = hashf(strip, frame, i + n);
+            }
+            break;
+
+        case A_SOUNDPULSE:
+        case A_GLOW:
+            for (i = 0; i < n; i++) level[i] = 0.5f - 0.5f * cosf(2.0f * (float) M_PI * phase);
+            break;
+
+        case A_FADEIN:
+            for (i = 0; i < n; i++) level[i] = phase;
+            break;
+
+        case A_FADEOUT:
+            for (i = 0; i < n; i++) level[i] = 1.0f - phase;
+            break;
+
+        case A_FADEINOUT:
+            for (i = 0; i < n; i++) level[i] = tri;
+            break;
+
+        case A_GROW:
+        case A_PIXELLINE:
+            for (i = 0; i < n; i++) level[i] = ((float) i < phase * (float) n);
+            break;
+
+        case A_SHRINK:
+            for (i = 0; i < n; i++) level[i] = ((float) i < (1.0f - phase) * (float) n);
+            break;
+
+        case A_PIXELMARCH:
+            for (i = 0; i < n; i++) level[i] = (((i + (int) (phase * 4.0f)) & 3) == 0);
+            break;
+
+        case A_SINGLEPIXEL:
+        case A_PIXELSHIFTRIGHT:
+        case A_PIXELSHIFTLEFT:
+        case A_PIXELBOUNCE:
+            head = (float) (int) (((st->anim == A_PIXELBOUNCE) ? tri : phase) * (float) n);
+            if (st->anim == A_PIXELSHIFTLEFT) head = (float) (n - 1) - head;
+            for (i = 0; i < n; i++) level[i] = ((float) i == head);
+            break;
+
+        case A_PIXELSMOOTHSHIFTRIGHT:
+        case A_PIXELSMOOTHSHIFTLEFT:
+        case A_PIXELSMOOTHBOUNCE:
+            head = ((st->anim == A_PIXELSMOOTHBOUNCE) ? tri : phase) * (float) (n - 1);
+            if (st->anim == A_PIXELSMOOTHSHIFTLEFT) head = (float) (n - 1) - head;
+            for (i = 0; i < n; i++) level[i] = fmaxf(0.0f, 1.0f - fabsf((float) i - head));
+            break;
+
+        case A_COMET:
+        case A_COMETCOL:
+            head = phase * (float) (n + n/3);
+            tail = (float) (n/3 + 1);
+            for (i = 0; i < n; i++) {
+                float d = head - (float) i;
+                level[i] = ((d >= 0) && (d < tail)) ? 1.0f - d / tail : 0.0f;
+                if (st->anim == A_COMET) pos[i] = phase;
+            }
+            break;
+
+        case A_LARSONSCANNER:
+        case A_LARSONSCANNER2:
+            head = tri * (float) (n - 1);
+            tail = (float) (n/8 + 1);
+            for (i = 0; i < n; i++) level[i] = fmaxf(0.0f, 1.0f - fabsf((float) i - head) / tail);
+            break;
+
+        case A_CYCLECOLORS:
+        case A_FADECOLORS:
+        case A_FADECOLORSLOOP:
+            for (i = 0; i < n; i++) pos[i] = phase;
+            break;
+
+        case A_PIXELSFADECOLORS:
+        case A_MOVINGGRADIENT:
+            for (i = 0; i < n; i++) pos[i] = wrap(pos[i] + phase);
+            break;
+
+        case A_MOVINGBARS:
+            for (i = 0; i < n; i++) pos[i] = floorf(wrap(pos[i] + phase) * 4.0f) / 4.0f;
+            break;
+
+        case A_PLASMA:
+            for (i = 0; i < n; i++) {
+                float x = pos[i] * 2.0f * (float) M_PI;
+                pos[i] = wrap(0.5f + 0.25f * (sinf(2.0f * x + 2.0f * (float) M_PI * phase) +
+                                              sinf(3.0f * x - 4.0f * (float) M_PI * phase)));
+            }
+            break;
+
+        case A_FIRE:
+        case A_FLAME:
+            for (i = 0; i < n; i++) {
+                float heat = hashf(strip, frame / 2, i) * (1.0f - 0.7f * pos[i]);
+                pos[i] = heat * 0.99f;
+                level[i] = heat;
+            }
+            break;
+
+        case A_BUBBLES:
+            for (i = 0; i < n; i++) {
+                level[i] = (hashf(strip, frame / 8, i) < 0.05f);
+                pos[i] = hashf(strip, frame / 8, i + n);
+            }
+            break;
+
+        case A_BOUNCINGBALLS:
+            for (i = 0; i < n; i++) level[i] = 0;
+            for (i = 0; i < 3; i++) {
+                float h = fabsf(sinf((float) M_PI * elapsed / (period * (1.0f + 0.3f * (float) i))));
+                int p = (int) (h * (float) (n - 1));
+                level[p] = 1.0f;
+                pos[p] = (float) i / 3.0f;
+            }
+            break;
+
+        default:
+            // Something we don't model, show it lit so it isn't missed.
+            break;
+    }
+}
+
+/*  *********************************************************************
+    *  Pixel pipeline
+    ********************************************************************* */
+
+static inline v4f vclamp(v4f x, v4f lo, v4f hi)
+{
+    v4i below = (x < lo);
+    v4i above = (x > hi);
+
+    x = (v4f) (((v4i) x & ~below) | ((v4i) lo & below));
+    x = (v4f) (((v4i) x & ~above) | ((v4i) hi & above));
+
+    return x;
+}
+
+//
+// Turn the model output into one row of RGB bytes: palette lookup,
+// scale by level, and convert.  All but the lookup are done VLEN
+// pixels at a time.
+//
+static void shade(preview_t *pv, pvstrip_t *st, uint8_t *row)
+{
+    int n = pv->pixels;
+    const v4f scale = (v4f) {255.0f, 255.0f, 255.0f, 255.0f};
+    const v4f half = (v4f) {0.5f, 0.5f, 0.5f, 0.5f};
+    const v4f zero = (v4f) {0};
+    const v4f one = half + half;
+    int i, k;
+
+    for (i = 0; i < n; i += VLEN) {
+        v4f pos, level, r, g, b;
+        v4i idx, ri, gi, bi;
+
+        memcpy(&pos, &(st->pos[i]), sizeof(pos));
+        memcpy(&level, &(st->level[i]), sizeof(level));
+
+        pos = vclamp(pos * scale, zero, scale);
+        idx = __builtin_convertvector(pos, v4i);
+        level = vclamp(level, zero, one);
+
+        for (k = 0; k < VLEN; k++) {
+            int j = idx[k] & 0xFF;
+            r[k] = st->pr[j];
+            g[k] = st->pg[j];
+            b[k] = st->pb[j];
+        }
+
+        ri = __builtin_convertvector(r * level * scale + half, v4i);
+        gi = __builtin_convertvector(g * level * scale + half, v4i);
+        bi = __builtin_convertvector(b * level * scale + half, v4i);
+
+        for (k = 0; k < VLEN; k++) {
+            int p = st->reverse ? (n - 1 - (i + k)) : (i + k);
+            row[p*3+0] = (uint8_t) ri[k];
+            row[p*3+1] = (uint8_t) gi[k];
+            row[p*3+2] = (uint8_t) bi[k];
+        }
+    }
+}
+
+//
+// Bring a strip up to date with the schedule at time 'now'.
+//
+static void advance(preview_t *pv, int strip, pvstrip_t *st, lstime_t now)
+{
+    uint32_t bit = 1 << strip;
+    lsevent_t ev;
+    lstime_t next;
+
+    while (cursor_peek(&(st->cur), &next) && (next <= now)) {
+        cursor_next(&(st->cur), &ev);
+
+        if (!(ev.stripmask & bit)) {
+            continue;
+        }
+
+        st->active = 1;
+        st->start = ev.time;
+        st->anim = ev.animation;
+        st->speed = ev.speed;
+        st->option = ev.option;
+        st->palette = ev.palette;
+        st->reverse = ev.direction ? 1 : 0;
+        setpalette(st, st->palette);
+    }
+}
+
+static void renderblock(preview_t *pv)
+{
+    lstime_t frametime = LSTIME_SECOND / pv->fps;
+    int strip, f;
+
+    while ((strip = __atomic_fetch_add(&(pv->nextstrip), 1, __ATOMIC_RELAXED)) < MAXSTRIPS) {
+        pvstrip_t *st = &(pv->strips[strip]);
+
+        for (f = 0; f < pv->nframes; f++) {
+            lstime_t now = pv->blocktime + f * frametime;
+            uint8_t *row = pv->block + f * pv->framebytes + strip * pv->rowbytes;
+
+            advance(pv, strip, st, now);
+            model(pv, strip, st, now, pv->blockframe + f);
+            shade(pv, st, row);
+        }
+    }
+}
+
+//
+// Render each block that is handed out until told to stop.
+//
+static void *renderthread(void *arg)
+{
+    preview_t *pv = (preview_t *) arg;
+    int seen = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&(pv->lock));
+        while (!pv->stop && (pv->generation == seen)) {
+            pthread_cond_wait(&(pv->go), &(pv->lock));
+        }
+        if (pv->stop) {
+            pthread_mutex_unlock(&(pv->lock));
+            return NULL;
+        }
+        seen = pv->generation;
+        pthread_mutex_unlock(&(pv->lock));
+
+        renderblock(pv);
+
+        pthread_mutex_lock(&(pv->lock));
+        if (--pv->busy == 0) {
+            pthread_cond_signal(&(pv->done));
+        }
+        pthread_mutex_unlock(&(pv->lock));
+    }
+}
+
+/*  *********************************************************************
+    *  Output
+    ********************************************************************* */
+
+static int writeppm(preview_t *pv, char *dir, int frame, uint8_t *pixels)
+{
+    char filename[1024];
+    FILE *str;
+
+    snprintf(filename, sizeof(filename), "%s/frame%06d.ppm", dir, frame);
+    str = fopen(filename, "wb");
+    if (!str) {
+        fprintf(stderr,"Could not create %s : %s\n",filename,strerror(errno));
+        return -1;
+    }
+
+    fprintf(str, "P6\n%d %d\n255\n", pv->pixels, MAXSTRIPS);
+    fwrite(pixels, 1, pv->framebytes, str);
+    fclose(str);
+
+    return 0;
+}
+
+/*  *********************************************************************
+    *  preview_script(script, filename)
+    *
+    *  Render the script's schedule to 'filename': a raw RGB file,
+    *  or a directory of PPM images if script->preview_ppm is set.
+    ********************************************************************* */
+
+int preview_script(script_t *script, char *filename)
+{
+    preview_t *pv;
+    schedcursor_t cur;
+    lsevent_t ev;
+    lstime_t frametime, start, end, t, last = 0;
+    pthread_t *threads;
+    FILE *out = NULL;
+    int nthreads, totalframes;
+    int frame, i;
+    int res = 0;
+    double t0;
+
+    if (script->preview_fps > MAXFPS) {
+        fprintf(stderr,"A preview can be at most %d fps\n",MAXFPS);
+        return -1;
+    }
+
+    pv = (preview_t *) calloc(1,sizeof(preview_t));
+    pv->script = script;
+    pv->fps = (script->preview_fps > 0) ? script->preview_fps : 30;
+    pv->pixels = (script->preview_pixels > 0) ? script->preview_pixels : 64;
+    pv->pixels = (pv->pixels + VLEN - 1) / VLEN * VLEN;
+    pv->rowbytes = pv->pixels * 3;
+    pv->framebytes = pv->rowbytes * MAXSTRIPS;
+    pv->block = (uint8_t *) malloc((size_t) BLOCKFRAMES * pv->framebytes);
+
+    for (i = 0; i < MAXSTRIPS; i++) {
+        pv->strips[i].pos = (float *) calloc(pv->pixels, sizeof(float));
+        pv->strips[i].level = (float *) calloc(pv->pixels, sizeof(float));
+        cursor_seek(&(pv->strips[i].cur), script, 0);
+    }
+
+    // The show ends with its last event, which may be a repeat's.
+    cursor_seek(&cur, script, 0);
+    while (cursor_peek(&cur, &t)) {
+        cursor_next(&cur, &ev);
+        last = t;
+    }
+    cursor_free(&cur);
+
+    frametime = LSTIME_SECOND / pv->fps;
+    start = script->start_cue;
+    end = script->end_cue ? script->end_cue : last + TAILSECS*LSTIME_SECOND;
+    totalframes = (int) ((end - start) / frametime) + 1;
+
+    if (script->preview_ppm) {
+        if ((mkdir(filename, 0755) < 0) && (errno != EEXIST)) {
+            fprintf(stderr,"Could not create %s : %s\n",filename,strerror(errno));
+            res = -1;
+            goto out;
+        }
+    } else {
+        out = fopen(filename, "wb");
+        if (!out) {
+            fprintf(stderr,"Could not create %s : %s\n",filename,strerror(errno));
+            res = -1;
+            goto out;
+        }
+    }
+
+    nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > MAXSTRIPS) nthreads = MAXSTRIPS;
+    threads = (pthread_t *) calloc(nthreads, sizeof(pthread_t));
+
+    pthread_mutex_init(&(pv->lock), NULL);
+    pthread_cond_init(&(pv->go), NULL);
+    pthread_cond_init(&(pv->done), NULL);
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, renderthread, pv) != 0) {
+            break;
+        }
+    }
+    nthreads = i;               // if there are none, we render here
+
+    printf("* Rendering %d frames of %d strips x %d pixels at %d fps on %d thread%s\n",
+           totalframes, MAXSTRIPS, pv->pixels, pv->fps, nthreads ? nthreads : 1, (nthreads > 1) ? "s" : "");
+
+    t0 = (double) current_ticks();
+
+    for (frame = 0; (frame < totalframes) && (res == 0); frame += BLOCKFRAMES) {
+        pthread_mutex_lock(&(pv->lock));
+        pv->blocktime = start + frame * frametime;
+        pv->blockframe = frame;
+        pv->nframes = (totalframes - frame < BLOCKFRAMES) ? totalframes - frame : BLOCKFRAMES;
+        pv->nextstrip = 0;
+
+        if (nthreads) {
+            pv->busy = nthreads;
+            pv->generation++;
+            pthread_cond_broadcast(&(pv->go));
+            while (pv->busy) {
+                pthread_cond_wait(&(pv->done), &(pv->lock));
+            }
+        } else {
+            renderblock(pv);
+        }
+        pthread_mutex_unlock(&(pv->lock));
+
+        if (out) {
+            if (fwrite(pv->block, pv->framebytes, pv->nframes, out) != (size_t) pv->nframes) {
+                fprintf(stderr,"Could not write %s : %s\n",filename,strerror(errno));
+                res = -1;
+            }
+        } else {
+            for (i = 0; i < pv->nframes; i++) {
+                if (writeppm(pv, filename, frame + i, pv->block + i * pv->framebytes) < 0) {
+                    res = -1;
+                    break;
+                }
+            }
+        }
+    }
+
+    pthread_mutex_lock(&(pv->lock));
+    pv->stop = 1;
+    pthread_cond_broadcast(&(pv->go));
+    pthread_mutex_unlock(&(pv->lock));
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_cond_destroy(&(pv->go));
+    pthread_cond_destroy(&(pv->done));
+    pthread_mutex_destroy(&(pv->lock));
+
+    if (res == 0) {
+        printf("* Wrote %d frames to %s in %.2f seconds\n",totalframes,filename,
+               ((double) current_ticks() - t0) / (double) LSTIME_SECOND);
+        if (out) {
+            printf("  View with: ffplay -f rawvideo -pixel_format rgb24 -video_size %dx%d -framerate %d %s\n",
+                   pv->pixels, MAXSTRIPS, pv->fps, filename);
+        }
+    }
+
+out:
+    if (out) fclose(out);
+    for (i = 0; i < MAXSTRIPS; i++) {
+        free(pv->strips[i].pos);
+        free(pv->strips[i].level);
+        cursor_free(&(pv->strips[i].cur));
+    }
+    free(pv->block);
+    free(pv);
+
+    return res;
+}
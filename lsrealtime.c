@@ -0,0 +1,225 @@
+/*  *********************************************************************
+    *  LightScript - A script processor for LED animations
+    *
+    *  Real-time Playback                       File: lsrealtime.c
+    *
+    *  Optional settings for the thread that plays a show: lock
+    *  and prefault our memory so we don't take page faults in the
+    *  middle of a show, raise the thread's scheduling priority,
+    *  and pin it to one CPU.  Each one can fail (most need
+    *  privileges), so we report what actually took effect.
+    *
+    *  Author:  Mitch Lichtenberg
+    ********************************************************************* */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE             // CPU affinity on Linux
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "lightscript.h"
+
+#ifdef __APPLE__
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <mach/thread_policy.h>
+#else
+#include <sched.h>
+#endif
+
+#define STACKPREFAULT   (256*1024)      // stack to touch before we start
+#define RTPRIORITY      80              // SCHED_FIFO priority, below the kernel's own threads
+
+//
+// Touch every page of a block so it is resident before the show.
+//
+static size_t prefault(const void *buf, size_t len)
+{
+    volatile const char *p = (volatile const char *) buf;
+    size_t pagesize = (size_t) sysconf(_SC_PAGESIZE);
+    size_t off;
+    char sum = 0;
+
+    if (!buf) {
+        return 0;
+    }
+
+    for (off = 0; off < len; off += pagesize) {
+        sum += p[off];
+    }
+    (void) sum;
+
+    return len;
+}
+
+static size_t prefault_schedule(schedtab_t *tab)
+{
+    size_t bytes = 0;
+    size_t n = tab->count;
+
+    bytes += prefault(tab->time, n * sizeof(lstime_t));
+    bytes += prefault(tab->stripmask, n * sizeof(unsigned int));
+    bytes += prefault(tab->animation, n * sizeof(unsigned int));
+    bytes += prefault(tab->speed, n * sizeof(unsigned int));
+    bytes += prefault(tab->brightness, n * sizeof(unsigned int));
+    bytes += prefault(tab->palette, n * sizeof(unsigned int));
+    bytes += prefault(tab->direction, n * sizeof(unsigned int));
+    bytes += prefault(tab->option, n * sizeof(unsigned int));
+
+    return bytes;
+}
+
+//
+// Grow the stack now rather than during the show.
+//
+static void prefault_stack(void)
+{
+    volatile char stack[STACKPREFAULT];
+    size_t pagesize = (size_t) sysconf(_SC_PAGESIZE);
+    size_t off;
+
+    for (off = 0; off < sizeof(stack); off += pagesize) {
+        stack[off] = 0;
+    }
+}
+
+static int set_priority(char *result, size_t len)
+{
+#ifdef __APPLE__
+    thread_time_constraint_policy_data_t policy;
+    mach_timebase_info_data_t tb;
+    kern_return_t kr;
+    double ms;
+
+    // The Mach time-constraint policy is what Core Audio uses: we ask
+    // for a slice of every period and the scheduler keeps it for us.
+    mach_timebase_info(&tb);
+    ms = 1000000.0 * (double) tb.denom / (double) tb.numer;
+
+    policy.period = (uint32_t) (1.0 * ms);
+    policy.computation = (uint32_t) (0.5 * ms);
+    policy.constraint = (uint32_t) (1.0 * ms);
+    policy.preemptible = TRUE;
+
+    kr = thread_policy_set(pthread_mach_thread_np(pthread_self()), THREAD_TIME_CONSTRAINT_POLICY,
+                           (thread_policy_t) &policy, THREAD_TIME_CONSTRAINT_POLICY_COUNT);
+    if (kr != KERN_SUCCESS) {
+        snprintf(result, len, "no (%s)", mach_error_string(kr));
+        return -1;
+    }
+
+    snprintf(result, len, "time-constraint policy");
+    return 0;
+#else
+    struct sched_param param;
+    int policy;
+    int res;
+
+    memset(&param,0,sizeof(param));
+    param.sched_priority = RTPRIORITY;
+    if (param.sched_priority > sched_get_priority_max(SCHED_FIFO)) {
+        param.sched_priority = sched_get_priority_max(SCHED_FIFO);
+    }
+
+    res = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (res != 0) {
+        snprintf(result, len, "no (%s)", strerror(res));
+        return -1;
+    }
+
+    // Read it back to be sure.
+    if ((pthread_getschedparam(pthread_self(), &policy, &param) != 0) || (policy != SCHED_FIFO)) {
+        snprintf(result, len, "no (policy did not stick)");
+        return -1;
+    }
+
+    snprintf(result, len, "SCHED_FIFO priority %d", param.sched_priority);
+    return 0;
+#endif
+}
+
+static int set_affinity(int cpu, char *result, size_t len)
+{
+    if (cpu < 0) {
+        snprintf(result, len, "not pinned");
+        return 0;
+    }
+
+#ifdef __APPLE__
+    // macOS only takes affinity hints, and not at all on Apple silicon.
+    snprintf(result, len, "no (CPU pinning is not supported on macOS)");
+    return -1;
+#else
+    {
+        cpu_set_t set;
+        int res;
+
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+
+        res = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (res != 0) {
+            snprintf(result, len, "no (%s)", strerror(res));
+            return -1;
+        }
+
+        snprintf(result, len, "pinned to %d (running on %d)", cpu, sched_getcpu());
+    }
+    return 0;
+#endif
+}
+
+/*  *********************************************************************
+    *  realtime_setup(script)
+    *
+    *  Apply the real-time settings to the calling thread, which is
+    *  about to play the script, and report what took effect.
+    *  Returns the number of settings that failed.
+    ********************************************************************* */
+
+int realtime_setup(script_t *script)
+{
+    char sched[128];
+    char affinity[128];
+    char locked[128];
+    size_t bytes;
+    int failed = 0;
+
+    if (!script->realtime) {
+        return 0;
+    }
+
+    // Lock everything we have now and anything we map later (the
+    // recorder grows its file while we play).
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        snprintf(locked, sizeof(locked), "no (%s)", strerror(errno));
+        failed++;
+    } else {
+        snprintf(locked, sizeof(locked), "yes");
+    }
+
+    bytes = prefault_schedule(&(script->sched));
+    prefault_stack();
+
+    if (set_priority(sched, sizeof(sched)) < 0) failed++;
+    if (set_affinity(script->rtcpu, affinity, sizeof(affinity)) < 0) failed++;
+
+    printf("* Real-time settings:\n");
+    printf("    Memory locked:   %s\n",locked);
+    printf("    Prefaulted:      %zu KB of schedule, %d KB of stack\n",(bytes + 1023) / 1024,STACKPREFAULT / 1024);
+    printf("    Scheduling:      %s\n",sched);
+    printf("    CPU:             %s\n",affinity);
+
+    if (failed) {
+        printf("Warning: %d real-time setting%s did not take effect\n",failed,(failed == 1) ? "" : "s");
+    }
+
+    return failed;
+}
@@ -0,0 +1,417 @@
+/*  *********************************************************************
+    *  LightScript - A script processor for LED animations
+    *
+    *  Flight Recorder                          File: lsrecord.c
+    *
+    *  Keeps a log of every frame sent to the Arduino along with
+    *  the time it was sent, and plays such a log back to a device
+    *  with the original timing.
+    *
+    *  The log is a small header followed by fixed-size records.
+    *  It is mapped into memory, so recording a frame is a copy
+    *  into the map and nothing more.  The last frame of each
+    *  dispatch is marked, so a replay sends the same groups the
+    *  player did.
+    *
+    *  The player never grows the file.  A helper thread watches
+    *  the count and, once the log is half full, maps a file twice
+    *  the size and faults it in.  The player picks up the new map
+    *  at its next frame and the helper unmaps the old one.
+    *
+    *  Author:  Mitch Lichtenberg
+    ********************************************************************* */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "lightscript.h"
+
+#define RECMAGIC        "LSREC002"
+#define RECINITIAL      65536           // records to preallocate, grows by doubling
+
+typedef struct rechdr_s {
+    char magic[8];
+    uint32_t recsize;
+    uint32_t reserved;
+    uint64_t count;
+} rechdr_t;
+
+typedef struct recframe_s {
+    uint64_t ns;                        // playback clock at send
+    lsmessage_t msg;
+    uint8_t flags;                      // RECF_xxx
+    uint8_t pad[32 - sizeof(uint64_t) - sizeof(lsmessage_t) - 1];
+} recframe_t;
+
+#define RECF_FLUSH      0x01            // last frame before a sink flush
+
+static int recfd = -1;
+static long pagesize;
+
+// The map the player writes to.
+static rechdr_t *rechdr = NULL;
+static recframe_t *recframes = NULL;
+static uint64_t reccap = 0;
+
+// Handed between the player and the grow thread.
+static rechdr_t *recnext = NULL;        // grown map, waiting for the player
+static uint64_t recnextcap = 0;
+static rechdr_t *recold = NULL;         // map the player has let go of
+static uint64_t recoldcap = 0;
+
+static pthread_t recthread;
+static int recgrowing = 0;              // grow thread is running
+static int recstop = 0;
+static uint64_t recdropped = 0;         // frames that found the log full
+
+#define RECPOLL         10000000        // ns between looks at the count
+
+static inline uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static inline size_t recbytes(uint64_t nrecs)
+{
+    return sizeof(rechdr_t) + nrecs * sizeof(recframe_t);
+}
+
+//
+// Size the file for nrecs records and map all of it.  Maps made
+// earlier stay valid, they just see less of the file.
+//
+static rechdr_t *recmap(uint64_t nrecs)
+{
+    void *map;
+
+    if (ftruncate(recfd, recbytes(nrecs)) < 0) {
+        return NULL;
+    }
+
+    map = mmap(NULL, recbytes(nrecs), PROT_READ | PROT_WRITE, MAP_SHARED, recfd, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    return (rechdr_t *) map;
+}
+
+/*  *********************************************************************
+    *  Growing the log
+    ********************************************************************* */
+
+static void *recordthread(void *arg)
+{
+    struct timespec nap = {0, RECPOLL};
+    rechdr_t *hdr = rechdr;
+    uint64_t cap = reccap;
+    rechdr_t *next, *old;
+    volatile uint8_t *page;
+    size_t off;
+
+    while (!__atomic_load_n(&recstop, __ATOMIC_RELAXED)) {
+        nanosleep(&nap, NULL);
+
+        // Wait for the player to move to the last map we made.
+        if (__atomic_load_n(&recnext, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+
+        old = __atomic_exchange_n(&recold, NULL, __ATOMIC_ACQUIRE);
+        if (old) {
+            munmap(old, recbytes(recoldcap));
+        }
+
+        // All the maps share the file's pages, so any of them can read the count.
+        if (__atomic_load_n(&(hdr->count), __ATOMIC_RELAXED) < cap / 2) {
+            continue;
+        }
+
+        next = recmap(cap * 2);
+        if (!next) {
+            perror("Could not grow the recording");
+            break;
+        }
+
+        // Take the faults here rather than on the player: map in the
+        // pages already written and zero the new ones.
+        page = (volatile uint8_t *) next;
+        for (off = 0; off < recbytes(cap); off += pagesize) {
+            (void) page[off];
+        }
+        memset((recframe_t *) (next + 1) + cap, 0, cap * sizeof(recframe_t));
+
+        recnextcap = cap * 2;
+        __atomic_store_n(&recnext, next, __ATOMIC_RELEASE);
+
+        hdr = next;
+        cap = cap * 2;
+    }
+
+    __atomic_store_n(&recgrowing, 0, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/*  *********************************************************************
+    *  Recording
+    ********************************************************************* */
+
+int record_open(char *filename)
+{
+    pagesize = sysconf(_SC_PAGESIZE);
+
+    recfd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if (recfd < 0) {
+        fprintf(stderr,"Could not create %s : %s\n",filename,strerror(errno));
+        return -1;
+    }
+
+    rechdr = recmap(RECINITIAL);
+    if (!rechdr) {
+        fprintf(stderr,"Could not map %s : %s\n",filename,strerror(errno));
+        close(recfd);
+        recfd = -1;
+        return -1;
+    }
+    recframes = (recframe_t *) (rechdr + 1);
+    reccap = RECINITIAL;
+
+    memcpy(rechdr->magic, RECMAGIC, sizeof(rechdr->magic));
+    rechdr->recsize = sizeof(recframe_t);
+    rechdr->count = 0;
+
+    // Touch the pages now so the first frames don't take the faults.
+    memset(recframes, 0, reccap * sizeof(recframe_t));
+
+    recgrowing = 1;
+    if (pthread_create(&recthread, NULL, recordthread, NULL) != 0) {
+        fprintf(stderr,"Could not start the recording thread\n");
+        munmap(rechdr, recbytes(reccap));
+        rechdr = NULL;
+        close(recfd);
+        recfd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+void record_frame(lsmessage_t *msg)
+{
+    struct timespec nap = {0, 1000000};
+    recframe_t *rec;
+    rechdr_t *next;
+    uint64_t count;
+
+    if (!rechdr) {
+        return;
+    }
+
+    for (;;) {
+        next = __atomic_load_n(&recnext, __ATOMIC_ACQUIRE);
+        if (next) {
+            // The grow thread has a bigger map ready, move to it
+            // and give it the old one to unmap.
+            recoldcap = reccap;
+            __atomic_store_n(&recold, rechdr, __ATOMIC_RELEASE);
+            rechdr = next;
+            recframes = (recframe_t *) (rechdr + 1);
+            reccap = recnextcap;
+            __atomic_store_n(&recnext, NULL, __ATOMIC_RELEASE);
+        }
+
+        if (rechdr->count < reccap) {
+            break;
+        }
+
+        // Full, and the grow thread hasn't caught up.  A live show
+        // can't wait for it, so the frame goes unrecorded; a dry run
+        // has no deadline and waits.
+        if (!clock_is_virtual() || !__atomic_load_n(&recgrowing, __ATOMIC_ACQUIRE)) {
+            recdropped++;
+            return;
+        }
+        nanosleep(&nap, NULL);
+    }
+
+    count = rechdr->count;
+    rec = &recframes[count];
+    rec->ns = (uint64_t) clock_now();
+    rec->msg = *msg;
+    rec->flags = 0;
+    __atomic_store_n(&(rechdr->count), count + 1, __ATOMIC_RELAXED);
+}
+
+//
+// The frames recorded since the last flush went out as a group.
+//
+void record_flush(void)
+{
+    if (rechdr && (rechdr->count > 0)) {
+        recframes[rechdr->count-1].flags |= RECF_FLUSH;
+    }
+}
+
+void record_close(void)
+{
+    uint64_t count;
+
+    if (!rechdr) {
+        return;
+    }
+
+    __atomic_store_n(&recstop, 1, __ATOMIC_RELAXED);
+    pthread_join(recthread, NULL);
+
+    if (recnext) {
+        munmap(recnext, recbytes(recnextcap));
+        recnext = NULL;
+    }
+    if (recold) {
+        munmap(recold, recbytes(recoldcap));
+        recold = NULL;
+    }
+
+    count = rechdr->count;
+    munmap(rechdr, recbytes(reccap));
+    rechdr = NULL;
+
+    // Trim the preallocated space we did not use.
+    if (ftruncate(recfd, recbytes(count)) < 0) {
+        perror("Could not trim the recording");
+    }
+    close(recfd);
+    recfd = -1;
+
+    printf("[Recorded %llu frames]\n",(unsigned long long) count);
+    if (recdropped) {
+        printf("[%llu frames arrived with the recording full and were not recorded]\n",
+               (unsigned long long) recdropped);
+    }
+}
+
+/*  *********************************************************************
+    *  Replay
+    ********************************************************************* */
+
+//
+// Sleep until we are close to the deadline, then spin the rest of
+// the way so the frame goes out as close to on time as we can manage.
+//
+static void waituntil(uint64_t deadline)
+{
+    uint64_t now = monotonic_ns();
+
+    if ((now < deadline) && (deadline - now > 2000000)) {
+        struct timespec ts;
+        uint64_t nap = deadline - now - 1000000;
+
+        ts.tv_sec = nap / 1000000000ULL;
+        ts.tv_nsec = nap % 1000000000ULL;
+        nanosleep(&ts, NULL);
+    }
+
+    while (monotonic_ns() < deadline) {
+    }
+}
+
+int replay_log(char *filename, char *device_name)
+{
+    struct stat statbuf;
+    rechdr_t *hdr;
+    recframe_t *frames;
+    uint64_t count, i;
+    uint64_t base, start;
+    uint64_t late, worst = 0, total = 0;
+    lssink_t *sink = NULL;
+    int fd;
+    void *map;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr,"Could not open %s : %s\n",filename,strerror(errno));
+        return -1;
+    }
+
+    fstat(fd, &statbuf);
+    if (statbuf.st_size < (off_t) sizeof(rechdr_t)) {
+        fprintf(stderr,"%s is not a lightscript recording\n",filename);
+        close(fd);
+        return -1;
+    }
+
+    map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr,"Could not map %s : %s\n",filename,strerror(errno));
+        return -1;
+    }
+
+    hdr = (rechdr_t *) map;
+    frames = (recframe_t *) (hdr + 1);
+    count = hdr->count;
+
+    // The count comes from the file, so make sure recbytes() can't wrap
+    // before trusting it against the file's size.
+    if ((memcmp(hdr->magic, RECMAGIC, sizeof(hdr->magic)) != 0) || (hdr->recsize != sizeof(recframe_t)) ||
+        (count > (SIZE_MAX - sizeof(rechdr_t)) / sizeof(recframe_t)) ||
+        (recbytes(count) > (size_t) statbuf.st_size)) {
+        fprintf(stderr,"%s is not a lightscript recording\n",filename);
+        munmap(map, statbuf.st_size);
+        return -1;
+    }
+
+    if (device_name) {
+        sink = sink_open(device_name);
+        if (!sink) {
+            munmap(map, statbuf.st_size);
+            return -1;
+        }
+    }
+
+    printf("* Replaying %llu frames (%.3f seconds) from %s\n",(unsigned long long) count,
+           count ? (double) (frames[count-1].ns - frames[0].ns) / 1e9 : 0.0, filename);
+
+    base = count ? frames[0].ns : 0;
+    start = monotonic_ns();
+
+    for (i = 0; i < count; i++) {
+        uint64_t deadline = start + (frames[i].ns - base);
+
+        waituntil(deadline);
+
+        if (sink) {
+            sink_send(sink, &frames[i].msg);
+
+            // Frames the player flushed together go out together.
+            if ((i+1 == count) || (frames[i].flags & RECF_FLUSH)) {
+                sink_flush(sink);
+            }
+        }
+
+        late = monotonic_ns() - deadline;
+        total += late;
+        if (late > worst) worst = late;
+    }
+
+    printf("Replay done: mean lateness %.3fms, worst %.3fms\n",
+           count ? (double) total / (double) count / 1e6 : 0.0, (double) worst / 1e6);
+
+    sink_close(sink);
+    munmap(map, statbuf.st_size);
+
+    return 0;
+}
@@ -0,0 +1,257 @@
+/*  *********************************************************************
+    *  LightScript - A script processor for LED animations
+    *
+    *  Repeats                                  File: lsrepeat.c
+    *
+    *  A 'repeat' block is never expanded into the schedule.  It
+    *  keeps one pass of its body, and a cursor walks the packed
+    *  schedule and all the repeats together, working out the
+    *  next event of each repeat as it gets there.  A loop that
+    *  runs for the whole show costs the same as one pass.
+    *
+    *  When a pass is longer than the interval the passes overlap.
+    *  Every m'th pass then cannot overlap, so a repeat becomes m
+    *  generators, each making every m'th pass, and the cursor
+    *  merges them like any other source.
+    *
+    *  Events at the same time go out in this order: the schedule,
+    *  then the repeats in the order they appear in the script, an
+    *  earlier pass before a later one.  They are not optimized
+    *  against each other the way the schedule is.  Events injected
+    *  while the show plays (lsinject.c) come last of all.
+    *
+    *  Author:  Mitch Lichtenberg
+    ********************************************************************* */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "lightscript.h"
+
+static inline int gen_done(schedgen_t *gen)
+{
+    return (gen->rep->pattern.count == 0) ||
+        (gen->base + gen->rep->pattern.time[gen->idx] >= gen->rep->until);
+}
+
+static inline lstime_t gen_time(schedgen_t *gen)
+{
+    return gen->base + gen->rep->pattern.time[gen->idx];
+}
+
+//
+// Put a generator on its first event at or after t.  Its passes
+// don't overlap, so only the pass t falls in can have one, and if
+// it doesn't the next pass starts after t.
+//
+static void gen_seek(schedgen_t *gen, lstime_t t)
+{
+    schedtab_t *pat = &(gen->rep->pattern);
+
+    if (t > gen->base) {
+        gen->base += ((t - gen->base) / gen->stride) * gen->stride;
+    }
+
+    gen->idx = sched_seek(pat, t - gen->base);
+    if (gen->idx == pat->count) {
+        gen->base += gen->stride;
+        gen->idx = 0;
+    }
+}
+
+/*  *********************************************************************
+    *  cursor_seek(cur, script, t)
+    *
+    *  Set up a cursor on the script's schedule and repeats, at the
+    *  first event at or after time t.
+    ********************************************************************* */
+
+void cursor_seek(schedcursor_t *cur, script_t *script, lstime_t t)
+{
+    dqueue_t *dq;
+    int n = 0;
+
+    cur->tab = &(script->sched);
+    cur->idx = sched_seek(cur->tab, t);
+    cur->ngens = 0;
+    cur->gens = NULL;
+    cur->live = inject_pending(script);
+    cur->inject = script->inject;
+
+    for (dq = script->repeats.dq_next; dq != &(script->repeats); dq = dq->dq_next) {
+        repeat_t *rep = (repeat_t *) dq;
+
+        if (rep->pattern.count) {
+            n += (int) (rep->pattern.time[rep->pattern.count-1] / rep->every) + 1;
+        }
+    }
+
+    if (n == 0) {
+        return;
+    }
+
+    cur->gens = (schedgen_t *) malloc(n * sizeof(schedgen_t));
+
+    for (dq = script->repeats.dq_next; dq != &(script->repeats); dq = dq->dq_next) {
+        repeat_t *rep = (repeat_t *) dq;
+        int m, i;
+
+        if (rep->pattern.count == 0) {
+            continue;
+        }
+
+        m = (int) (rep->pattern.time[rep->pattern.count-1] / rep->every) + 1;
+
+        for (i = 0; i < m; i++) {
+            schedgen_t *gen = &(cur->gens[cur->ngens++]);
+
+            gen->rep = rep;
+            gen->base = rep->from + i * rep->every;
+            gen->stride = m * rep->every;
+            gen_seek(gen, t);
+        }
+    }
+}
+
+//
+// Find where the next event comes from: a generator, -1 for the
+// schedule or -3 for an injected event.  Returns -2 if there is
+// nothing left.
+//
+static int cursor_pick(schedcursor_t *cur)
+{
+    int best = -2;
+    lstime_t besttime = 0;
+    int i;
+
+    if (cur->idx < cur->tab->count) {
+        best = -1;
+        besttime = cur->tab->time[cur->idx];
+    }
+
+    for (i = 0; i < cur->ngens; i++) {
+        schedgen_t *gen = &(cur->gens[i]);
+        lstime_t t;
+
+        if (gen_done(gen)) {
+            continue;
+        }
+
+        t = gen_time(gen);
+        if ((best == -2) || (t < besttime) ||
+            ((t == besttime) && (best >= 0) && (cur->gens[best].rep == gen->rep) && (gen->base < cur->gens[best].base))) {
+            best = i;
+            besttime = t;
+        }
+    }
+
+    if (cur->live && (cur->live->dq_next != cur->live)) {
+        lstime_t t = ((schedcmd_t *) cur->live->dq_next)->time;
+
+        if ((best == -2) || (t < besttime)) {
+            best = -3;
+        }
+    }
+
+    return best;
+}
+
+/*  *********************************************************************
+    *  cursor_peek(cur, t)
+    *
+    *  Returns 1 and the time of the next event, or 0 at the end.
+    ********************************************************************* */
+
+int cursor_peek(schedcursor_t *cur, lstime_t *t)
+{
+    int src;
+
+    // Nearly always there are no repeats and nothing injected.
+    if ((cur->ngens == 0) && (!cur->live || (cur->live->dq_next == cur->live))) {
+        if (cur->idx < cur->tab->count) {
+            *t = cur->tab->time[cur->idx];
+            return 1;
+        }
+        return 0;
+    }
+
+    src = cursor_pick(cur);
+    if (src == -2) {
+        return 0;
+    }
+
+    if (src == -3) {
+        *t = ((schedcmd_t *) cur->live->dq_next)->time;
+    } else {
+        *t = (src == -1) ? cur->tab->time[cur->idx] : gen_time(&(cur->gens[src]));
+    }
+    return 1;
+}
+
+/*  *********************************************************************
+    *  cursor_next(cur, ev)
+    *
+    *  Take the next event.  Only call this when cursor_peek()
+    *  says there is one.
+    ********************************************************************* */
+
+void cursor_next(schedcursor_t *cur, lsevent_t *ev)
+{
+    schedtab_t *tab;
+    schedgen_t *gen = NULL;
+    int idx;
+    int src;
+
+    src = ((cur->ngens == 0) && !cur->live) ? -1 : cursor_pick(cur);
+    assert(src != -2);
+
+    if (src == -3) {
+        schedcmd_t *cmd = (schedcmd_t *) cur->live->dq_next;
+
+        ev->time = cmd->time;
+        ev->stripmask = cmd->stripmask;
+        ev->animation = cmd->animation;
+        ev->speed = cmd->speed;
+        ev->brightness = cmd->brightness;
+        ev->palette = cmd->palette;
+        ev->direction = cmd->direction;
+        ev->option = cmd->option;
+
+        dq_dequeue(&(cmd->link));
+        inject_done(cur->inject, cmd);
+        return;
+    }
+
+    if (src == -1) {
+        tab = cur->tab;
+        idx = cur->idx++;
+        ev->time = tab->time[idx];
+    } else {
+        gen = &(cur->gens[src]);
+        tab = &(gen->rep->pattern);
+        idx = gen->idx;
+        ev->time = gen_time(gen);
+
+        if (++gen->idx == tab->count) {
+            gen->idx = 0;
+            gen->base += gen->stride;
+        }
+    }
+
+    ev->stripmask = tab->stripmask[idx];
+    ev->animation = tab->animation[idx];
+    ev->speed = tab->speed[idx];
+    ev->brightness = tab->brightness[idx];
+    ev->palette = tab->palette[idx];
+    ev->direction = tab->direction[idx];
+    ev->option = tab->option[idx];
+}
+
+void cursor_free(schedcursor_t *cur)
+{
+    free(cur->gens);
+    cur->gens = NULL;
+    cur->ngens = 0;
+}
@@ -0,0 +1,189 @@
+/*  *********************************************************************
+    *  LightScript - A script processor for LED animations
+    *
+    *  Seeking                                  File: lsseek.c
+    *
+    *  Starting a show partway through (-s, or 'seek' in the daemon)
+    *  used to skip everything before the cue, so a strip stayed
+    *  dark until its next event came along.  Now the strips are
+    *  put back the way they would be at the cue first.
+    *
+    *  When the schedule is generated we record which event each
+    *  strip is showing at a keyframe every SEEKKEYSECS seconds.  A
+    *  seek starts from the keyframe before the cue, replays the
+    *  few seconds of events after it, works out the repeats, and
+    *  then sends one frame for each different thing the strips
+    *  are doing.  The animations start over at the cue, of course,
+    *  rather than partway through.
+    *
+    *  Author:  Mitch Lichtenberg
+    ********************************************************************* */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "lightscript.h"
+
+#define SEEKKEYSECS     10              // seconds between keyframes
+
+/*  *********************************************************************
+    *  seek_index(script)
+    *
+    *  Build the keyframes for the packed schedule.  Keyframe k is
+    *  the state after every event before k * SEEKKEYSECS.
+    ********************************************************************* */
+
+void seek_index(script_t *script)
+{
+    schedtab_t *tab = &(script->sched);
+    seekindex_t *si = &(script->seekidx);
+    int32_t state[MAXSTRIPS];
+    int i, k, s;
+
+    si->interval = SEEKKEYSECS * LSTIME_SECOND;
+    si->nkeys = (tab->count ? (int) (tab->time[tab->count-1] / si->interval) : 0) + 1;
+    si->keys = (int32_t *) stats_malloc(MEM_SCHEDULE, si->nkeys * MAXSTRIPS * sizeof(int32_t));
+
+    for (s = 0; s < MAXSTRIPS; s++) {
+        state[s] = -1;
+    }
+
+    i = 0;
+    for (k = 0; k < si->nkeys; k++) {
+        lstime_t keytime = k * si->interval;
+
+        for (; (i < tab->count) && (tab->time[i] < keytime); i++) {
+            for (s = 0; s < MAXSTRIPS; s++) {
+                if (tab->stripmask[i] & (1 << s)) {
+                    state[s] = i;
+                }
+            }
+        }
+
+        memcpy(&(si->keys[k * MAXSTRIPS]), state, sizeof(state));
+    }
+}
+
+static void takeevent(lsevent_t *ev, schedtab_t *tab, int idx, lstime_t t)
+{
+    ev->time = t;
+    ev->animation = tab->animation[idx];
+    ev->speed = tab->speed[idx];
+    ev->brightness = tab->brightness[idx];
+    ev->palette = tab->palette[idx];
+    ev->direction = tab->direction[idx];
+    ev->option = tab->option[idx];
+}
+
+static int samestate(lsevent_t *a, lsevent_t *b)
+{
+    return ((a->animation == b->animation) &&
+            (a->speed == b->speed) &&
+            (a->palette == b->palette) &&
+            (a->direction == b->direction) &&
+            (a->option == b->option));
+}
+
+/*  *********************************************************************
+    *  seek_restore(script, t)
+    *
+    *  Send the strips what they would be showing after every event
+    *  before time t, as few frames as it takes.
+    ********************************************************************* */
+
+void seek_restore(script_t *script, lstime_t t)
+{
+    schedtab_t *tab = &(script->sched);
+    seekindex_t *si = &(script->seekidx);
+    lsevent_t state[MAXSTRIPS];
+    uint32_t have = 0;
+    uint32_t left;
+    dqueue_t *dq;
+    int frames = 0;
+    int i, j, k, s, end;
+
+    if (!si->keys) {
+        return;
+    }
+
+    // The keyframe, then the events between it and t.
+    k = (int) (t / si->interval);
+    if (k >= si->nkeys) k = si->nkeys - 1;
+
+    for (s = 0; s < MAXSTRIPS; s++) {
+        int32_t idx = si->keys[k * MAXSTRIPS + s];
+
+        if (idx >= 0) {
+            takeevent(&state[s], tab, idx, tab->time[idx]);
+            have |= (1 << s);
+        }
+    }
+
+    end = sched_seek(tab, t);
+    for (i = sched_seek(tab, k * si->interval); i < end; i++) {
+        for (s = 0; s < MAXSTRIPS; s++) {
+            if (tab->stripmask[i] & (1 << s)) {
+                takeevent(&state[s], tab, i, tab->time[i]);
+                have |= (1 << s);
+            }
+        }
+    }
+
+    // For each event in a repeat, the last pass that did it before t.
+    for (dq = script->repeats.dq_next; dq != &(script->repeats); dq = dq->dq_next) {
+        repeat_t *rep = (repeat_t *) dq;
+        schedtab_t *pat = &(rep->pattern);
+        lstime_t limit = (t < rep->until) ? t : rep->until;
+
+        for (j = 0; j < pat->count; j++) {
+            lstime_t x = limit - 1 - rep->from - pat->time[j];
+            lstime_t when;
+
+            if (x < 0) {
+                continue;
+            }
+            when = rep->from + (x / rep->every) * rep->every + pat->time[j];
+
+            for (s = 0; s < MAXSTRIPS; s++) {
+                if ((pat->stripmask[j] & (1 << s)) && (!(have & (1 << s)) || (when >= state[s].time))) {
+                    takeevent(&state[s], pat, j, when);
+                    have |= (1 << s);
+                }
+            }
+        }
+    }
+
+    // One frame for all the strips doing the same thing.
+    left = have;
+    for (s = 0; s < MAXSTRIPS; s++) {
+        uint32_t mask;
+        unsigned int anim;
+
+        if (!(left & (1 << s))) {
+            continue;
+        }
+
+        mask = 0;
+        for (i = s; i < MAXSTRIPS; i++) {
+            if ((left & (1 << i)) && samestate(&state[s], &state[i])) {
+                mask |= (1 << i);
+            }
+        }
+        left &= ~mask;
+
+        anim = state[s].animation;
+        if (state[s].direction) anim |= 0x8000;
+
+        send_message(script, mask, anim, state[s].speed, state[s].option, state[s].palette);
+        frames++;
+    }
+
+    sink_flush(script->sink);
+
+    if (frames) {
+        printf("* Restored %d strips with %d frames for the cue at %.2f\n",
+               __builtin_popcount(have), frames, LSTIME_SECS(t));
+    }
+}
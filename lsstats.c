@@ -0,0 +1,225 @@
+/*  *********************************************************************
+    *  LightScript - A script processor for LED animations
+    *
+    *  Statistics                               File: lsstats.c
+    *
+    *  Counts what each part of the program allocates, how many
+    *  tokens, nodes, commands and events it went through, and how
+    *  long each phase took and the peak RSS at its end, so we can
+    *  see what a big show costs and catch it when that goes up.
+    *  Reported at exit with --stats (readable, after the rest of
+    *  the output) or --stats=json, which goes to stderr so it can
+    *  be piped apart from the schedule, or to a file with
+    *  --stats=json:file.
+    *
+    *  Author:  Mitch Lichtenberg
+    ********************************************************************* */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <sys/resource.h>
+#include "lightscript.h"
+
+#define MAXPHASES       16
+
+typedef struct memstat_s {
+    uint64_t allocs;
+    uint64_t bytes;             // total ever allocated
+    int64_t live;               // allocated and not yet freed
+    int64_t peak;               // most live at once
+} memstat_t;
+
+typedef struct phase_s {
+    char *name;
+    lstime_t elapsed;           // since the end of the previous phase
+    long maxrss;                // KB
+} phase_t;
+
+int stats_mode = 0;
+char *stats_file = NULL;        // for the JSON, stderr if not set
+
+static memstat_t memstats[MEM_MAX];
+static char *memnames[MEM_MAX] = {"parse", "symbols", "commands", "schedule", "modules"};
+
+static uint64_t counters[CNT_MAX];
+static char *cntnames[CNT_MAX] = {"tokens", "nodes", "commands", "macros", "events", "frames"};
+
+static phase_t phases[MAXPHASES];
+static int nphases = 0;
+static lstime_t lastmark;
+
+//
+// Both files are parsed at once, so the counters are updated
+// atomically.  They are only touched when stats are on.
+//
+static void count(int sub, int64_t bytes)
+{
+    memstat_t *ms = &memstats[sub];
+    int64_t live, peak;
+
+    if (bytes > 0) {
+        __atomic_add_fetch(&(ms->allocs), 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&(ms->bytes), (uint64_t) bytes, __ATOMIC_RELAXED);
+    }
+
+    live = __atomic_add_fetch(&(ms->live), bytes, __ATOMIC_RELAXED);
+
+    peak = __atomic_load_n(&(ms->peak), __ATOMIC_RELAXED);
+    while ((live > peak) &&
+           !__atomic_compare_exchange_n(&(ms->peak), &peak, live, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void *stats_calloc(int sub, size_t n, size_t size)
+{
+    void *ptr = calloc(n, size);
+
+    if (stats_mode && ptr) {
+        count(sub, (int64_t) (n * size));
+    }
+
+    return ptr;
+}
+
+void *stats_malloc(int sub, size_t size)
+{
+    void *ptr = malloc(size);
+
+    if (stats_mode && ptr) {
+        count(sub, (int64_t) size);
+    }
+
+    return ptr;
+}
+
+void stats_free(int sub, void *ptr, size_t size)
+{
+    if (stats_mode && ptr) {
+        count(sub, -(int64_t) size);
+    }
+
+    free(ptr);
+}
+
+void stats_count(int which, uint64_t n)
+{
+    if (stats_mode) {
+        __atomic_add_fetch(&counters[which], n, __ATOMIC_RELAXED);
+    }
+}
+
+static long maxrss_kb(void)
+{
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_SELF, &ru) < 0) {
+        return 0;
+    }
+
+#ifdef __APPLE__
+    return ru.ru_maxrss / 1024;         // bytes on macOS
+#else
+    return ru.ru_maxrss;                // KB everywhere else
+#endif
+}
+
+void stats_start(void)
+{
+    lastmark = current_ticks();
+}
+
+//
+// Mark the end of a phase of main().  The phase ran from the
+// previous mark (or stats_start) until now.
+//
+void stats_phase(char *name)
+{
+    lstime_t now;
+
+    if (!stats_mode || (nphases == MAXPHASES)) {
+        return;
+    }
+
+    now = current_ticks();
+    phases[nphases].name = name;
+    phases[nphases].elapsed = now - lastmark;
+    phases[nphases].maxrss = maxrss_kb();
+    nphases++;
+    lastmark = now;
+}
+
+static void report_text(void)
+{
+    int i;
+
+    printf("\n* Memory by subsystem:\n");
+    printf("    %-10s %10s %12s %12s %12s\n","","allocs","bytes","live","peak");
+    for (i = 0; i < MEM_MAX; i++) {
+        printf("    %-10s %10llu %12llu %12lld %12lld\n",memnames[i],
+               (unsigned long long) memstats[i].allocs, (unsigned long long) memstats[i].bytes,
+               (long long) memstats[i].live, (long long) memstats[i].peak);
+    }
+
+    printf("* Counts:\n");
+    for (i = 0; i < CNT_MAX; i++) {
+        printf("    %-10s %10llu\n",cntnames[i],(unsigned long long) counters[i]);
+    }
+
+    printf("* Phases:\n");
+    printf("    %-10s %10s %12s\n","","ms","peak RSS");
+    for (i = 0; i < nphases; i++) {
+        printf("    %-10s %10.3f %9ld KB\n",phases[i].name,LSTIME_SECS(phases[i].elapsed) * 1000.0,phases[i].maxrss);
+    }
+}
+
+static void report_json(FILE *str)
+{
+    int i;
+
+    fprintf(str,"{\"memory\":{");
+    for (i = 0; i < MEM_MAX; i++) {
+        fprintf(str,"%s\"%s\":{\"allocs\":%llu,\"bytes\":%llu,\"live\":%lld,\"peak\":%lld}",
+                    i ? "," : "", memnames[i],
+                    (unsigned long long) memstats[i].allocs, (unsigned long long) memstats[i].bytes,
+                    (long long) memstats[i].live, (long long) memstats[i].peak);
+    }
+    fprintf(str,"},\"counts\":{");
+    for (i = 0; i < CNT_MAX; i++) {
+        fprintf(str,"%s\"%s\":%llu",i ? "," : "",cntnames[i],(unsigned long long) counters[i]);
+    }
+    fprintf(str,"},\"phases\":[");
+    for (i = 0; i < nphases; i++) {
+        fprintf(str,"%s{\"name\":\"%s\",\"ns\":%lld,\"maxrss_kb\":%ld}",i ? "," : "",phases[i].name,
+                    (long long) phases[i].elapsed,phases[i].maxrss);
+    }
+    fprintf(str,"]}\n");
+}
+
+//
+// Registered with atexit() when stats are on.
+//
+void stats_report(void)
+{
+    stats_phase("exit");
+
+    fflush(stdout);
+    if (stats_mode == STATS_JSON) {
+        FILE *str = stderr;
+
+        if (stats_file && !(str = fopen(stats_file,"w"))) {
+            fprintf(stderr,"Could not create %s : %s\n",stats_file,strerror(errno));
+            str = stderr;
+        }
+        report_json(str);
+        if (str != stderr) {
+            fclose(str);
+        }
+    } else {
+        report_text();
+    }
+    fflush(stdout);
+}
@@ -0,0 +1,761 @@
+/*  *********************************************************************
+    *  LightScript - A script processor for LED animations
+    *
+    *  Compiled Streams                         File: lsstream.c
+    *
+    *  For shows too long to keep in memory.  'compile' writes the
+    *  events to a file instead of building the schedule, and
+    *  'splay' plays such a file, reading ahead with a fixed amount
+    *  of memory no matter how long the show is.
+    *
+    *  Compiling: events are collected in chunks, each chunk is
+    *  sorted and spilled to a temporary file as a run, and the runs
+    *  are merged into the output.  Events at the same time are
+    *  optimized as a group on the way out, as in genschedule().
+    *
+    *  The file is a header followed by one record per event:
+    *
+    *      varint  time since the previous event (ns)
+    *      byte    mask of the fields that differ from the previous event
+    *      varint  each changed field, in lsevent_t order
+    *
+    *  Author:  Mitch Lichtenberg
+    ********************************************************************* */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "lightscript.h"
+
+#define STREAMMAGIC     "LSSTRM01"
+#define CHUNKEVENTS     (256*1024)      // events sorted in memory at once
+#define RUNBUF          4096            // events read ahead from each run while merging
+#define IOBUF           (64*1024)       // bytes per read or write of the stream
+#define RINGSIZE        65536           // events read ahead during playback, power of 2
+#define MAXRECORD       64              // bytes, worst case encoding of one event
+
+#define IDLENAMELEN     64
+
+typedef struct streamhdr_s {
+    char magic[8];
+    uint64_t events;
+    int64_t duration;                   // time of the last event
+    uint32_t idle;                      // idle animation, if idlename[0]
+    uint32_t reserved;
+    char idlename[IDLENAMELEN];
+} streamhdr_t;
+
+// Field bits in the change mask
+#define F_STRIPMASK     0x01
+#define F_ANIMATION     0x02
+#define F_SPEED         0x04
+#define F_BRIGHTNESS    0x08
+#define F_PALETTE       0x10
+#define F_DIRECTION     0x20
+#define F_OPTION        0x40
+
+typedef struct run_s {
+    off_t start;
+    uint64_t count;
+} run_t;
+
+typedef struct stream_s {
+    char *filename;
+    int fd;
+
+    // Chunk being collected
+    lsevent_t *chunk;
+    lsevent_t *tmp;
+    int nchunk;
+
+    // Sorted runs in the spill file
+    FILE *spill;
+    off_t spillpos;
+    run_t *runs;
+    int nruns;
+    int maxruns;
+
+    // Encoder
+    uint8_t out[IOBUF];
+    int outlen;
+    lsevent_t prev;
+    char *idlename;
+    uint32_t idle;
+    uint64_t events;
+    uint64_t bytes;
+    int error;
+    int quiet;
+} stream_t;
+
+/*  *********************************************************************
+    *  Encoding
+    ********************************************************************* */
+
+static inline uint8_t *putvarint(uint8_t *p, uint64_t v)
+{
+    while (v >= 0x80) {
+        *p++ = (uint8_t) (v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t) v;
+    return p;
+}
+
+static void flushout(stream_t *st)
+{
+    if (st->outlen && !st->error) {
+        if (write(st->fd, st->out, st->outlen) != st->outlen) {
+            fprintf(stderr,"Could not write %s : %s\n",st->filename,strerror(errno));
+            st->error = 1;
+        }
+        st->bytes += st->outlen;
+    }
+    st->outlen = 0;
+}
+
+static void encode(stream_t *st, lsevent_t *ev)
+{
+    uint8_t *p, *maskp;
+    uint8_t mask = 0;
+
+    if (st->outlen + MAXRECORD > IOBUF) {
+        flushout(st);
+    }
+
+    p = st->out + st->outlen;
+    p = putvarint(p, (uint64_t) (ev->time - st->prev.time));
+    maskp = p++;
+
+#define ENCFIELD(f,bit) if (ev->f != st->prev.f) { mask |= bit; p = putvarint(p, ev->f); }
+    ENCFIELD(stripmask, F_STRIPMASK);
+    ENCFIELD(animation, F_ANIMATION);
+    ENCFIELD(speed, F_SPEED);
+    ENCFIELD(brightness, F_BRIGHTNESS);
+    ENCFIELD(palette, F_PALETTE);
+    ENCFIELD(direction, F_DIRECTION);
+    ENCFIELD(option, F_OPTION);
+#undef ENCFIELD
+
+    *maskp = mask;
+    st->outlen = p - st->out;
+    st->prev = *ev;
+    st->events++;
+}
+
+/*  *********************************************************************
+    *  Compiling
+    ********************************************************************* */
+
+stream_t *stream_create(script_t *script, char *filename)
+{
+    stream_t *st;
+    streamhdr_t hdr;
+    symbol_t *sym;
+
+    st = (stream_t *) calloc(1,sizeof(stream_t));
+    st->filename = filename;
+    st->quiet = script->quiet;
+
+    // Keep the idle animation so 'splay' can go idle without the script.
+    if (script->idleanimation) {
+        sym = lookupsym(script, script->idleanimation);
+        if (sym && (sym->nvalues > 0)) {
+            st->idlename = script->idleanimation;
+            st->idle = sym->wvalues[0];
+        }
+    }
+
+    st->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (st->fd < 0) {
+        fprintf(stderr,"Could not create %s : %s\n",filename,strerror(errno));
+        free(st);
+        return NULL;
+    }
+
+    st->spill = tmpfile();
+    if (!st->spill) {
+        fprintf(stderr,"Could not create a temporary file : %s\n",strerror(errno));
+        close(st->fd);
+        free(st);
+        return NULL;
+    }
+
+    st->chunk = (lsevent_t *) stats_malloc(MEM_SCHEDULE, CHUNKEVENTS * sizeof(lsevent_t));
+    st->tmp = (lsevent_t *) stats_malloc(MEM_SCHEDULE, CHUNKEVENTS * sizeof(lsevent_t));
+
+    // Room for the header, filled in when we are done.
+    memset(&hdr,0,sizeof(hdr));
+    if (write(st->fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        st->error = 1;
+    }
+
+    return st;
+}
+
+//
+// Stable sort of one chunk by time, bottom-up merge sort.
+//
+static lsevent_t *sortchunk(lsevent_t *src, lsevent_t *dst, int count)
+{
+    lsevent_t *swap;
+    int width, lo;
+
+    for (width = 1; width < count; width *= 2) {
+        for (lo = 0; lo < count; lo += 2*width) {
+            int mid = (lo + width < count) ? lo + width : count;
+            int hi = (lo + 2*width < count) ? lo + 2*width : count;
+            int a = lo, b = mid, k = lo;
+
+            while ((a < mid) && (b < hi)) {
+                dst[k++] = (src[b].time < src[a].time) ? src[b++] : src[a++];
+            }
+            while (a < mid) dst[k++] = src[a++];
+            while (b < hi) dst[k++] = src[b++];
+        }
+        swap = src; src = dst; dst = swap;
+    }
+
+    return src;
+}
+
+static void spillchunk(stream_t *st)
+{
+    lsevent_t *sorted;
+    size_t bytes;
+
+    if (st->nchunk == 0) {
+        return;
+    }
+
+    sorted = sortchunk(st->chunk, st->tmp, st->nchunk);
+    bytes = st->nchunk * sizeof(lsevent_t);
+
+    if (pwrite(fileno(st->spill), sorted, bytes, st->spillpos) != (ssize_t) bytes) {
+        fprintf(stderr,"Could not write temporary file : %s\n",strerror(errno));
+        st->error = 1;
+    }
+
+    if (st->nruns == st->maxruns) {
+        st->maxruns = st->maxruns ? st->maxruns * 2 : 16;
+        st->runs = (run_t *) realloc(st->runs, st->maxruns * sizeof(run_t));
+    }
+    st->runs[st->nruns].start = st->spillpos;
+    st->runs[st->nruns].count = st->nchunk;
+    st->nruns++;
+
+    st->spillpos += bytes;
+    st->nchunk = 0;
+}
+
+//
+// Called by insert_sched() for each event while compiling.
+//
+void stream_event(stream_t *st, schedcmd_t *cmd)
+{
+    lsevent_t *ev = &(st->chunk[st->nchunk++]);
+
+    ev->time = cmd->time;
+    ev->stripmask = cmd->stripmask;
+    ev->animation = cmd->animation;
+    ev->speed = cmd->speed;
+    ev->brightness = cmd->brightness;
+    ev->palette = cmd->palette;
+    ev->direction = cmd->direction;
+    ev->option = cmd->option;
+
+    if (st->nchunk == CHUNKEVENTS) {
+        spillchunk(st);
+    }
+}
+
+//
+// Write out a schedule already generated in memory, along with
+// its repeats, which a stream can only hold expanded.
+//
+void stream_schedule(stream_t *st, script_t *script)
+{
+    schedcursor_t cur;
+    lstime_t t;
+
+    cursor_seek(&cur, script, 0);
+    while (cursor_peek(&cur, &t)) {
+        cursor_next(&cur, &(st->chunk[st->nchunk++]));
+
+        if (st->nchunk == CHUNKEVENTS) {
+            spillchunk(st);
+        }
+    }
+    cursor_free(&cur);
+}
+
+typedef struct runreader_s {
+    off_t pos;
+    uint64_t left;                      // not yet read from the file
+    lsevent_t buf[RUNBUF];
+    int n, i;
+} runreader_t;
+
+static int runfill(stream_t *st, runreader_t *rr)
+{
+    size_t n = (rr->left < RUNBUF) ? rr->left : RUNBUF;
+    size_t bytes = n * sizeof(lsevent_t);
+
+    if (n == 0) {
+        rr->n = rr->i = 0;
+        return 0;
+    }
+
+    if (pread(fileno(st->spill), rr->buf, bytes, rr->pos) != (ssize_t) bytes) {
+        fprintf(stderr,"Could not read temporary file : %s\n",strerror(errno));
+        st->error = 1;
+        rr->left = 0;
+        rr->n = rr->i = 0;
+        return 0;
+    }
+
+    rr->pos += bytes;
+    rr->left -= n;
+    rr->n = n;
+    rr->i = 0;
+
+    return n;
+}
+
+//
+// Optimize one same-time group and write what is left.
+//
+static int flushgroup(stream_t *st, dqueue_t *group)
+{
+    dqueue_t *dq;
+    int removed = 0;
+
+    if (group->dq_next != group->dq_prev) {
+        removed = optimize_group(group);
+    }
+
+    while ((dq = group->dq_next) != group) {
+        schedcmd_t *cmd = (schedcmd_t *) dq;
+        lsevent_t ev;
+
+        ev.time = cmd->time;
+        ev.stripmask = cmd->stripmask;
+        ev.animation = cmd->animation;
+        ev.speed = cmd->speed;
+        ev.brightness = cmd->brightness;
+        ev.palette = cmd->palette;
+        ev.direction = cmd->direction;
+        ev.option = cmd->option;
+        encode(st, &ev);
+
+        dq_dequeue(dq);
+        stats_free(MEM_SCHEDULE, cmd, sizeof(schedcmd_t));
+    }
+
+    return removed;
+}
+
+//
+// Merge the runs into the output.  Returns the number of events
+// the optimizer removed.
+//
+static int mergeruns(stream_t *st)
+{
+    runreader_t *readers;
+    dqueue_t group;
+    lstime_t grouptime = 0;
+    int removed = 0;
+    int i;
+
+    readers = (runreader_t *) stats_calloc(MEM_SCHEDULE, st->nruns ? st->nruns : 1, sizeof(runreader_t));
+    for (i = 0; i < st->nruns; i++) {
+        readers[i].pos = st->runs[i].start;
+        readers[i].left = st->runs[i].count;
+        runfill(st, &readers[i]);
+    }
+
+    dq_init(&group);
+
+    for (;;) {
+        runreader_t *best = NULL;
+        lsevent_t *ev;
+        schedcmd_t *cmd;
+
+        // Earliest head, ties go to the earlier run so the order
+        // events were generated in is kept.
+        for (i = 0; i < st->nruns; i++) {
+            runreader_t *rr = &readers[i];
+            if ((rr->i < rr->n) && (!best || (rr->buf[rr->i].time < best->buf[best->i].time))) {
+                best = rr;
+            }
+        }
+
+        if (!best) {
+            break;
+        }
+
+        ev = &(best->buf[best->i]);
+
+        if ((group.dq_next != &group) && (ev->time != grouptime)) {
+            removed += flushgroup(st, &group);
+        }
+        grouptime = ev->time;
+
+        cmd = (schedcmd_t *) stats_calloc(MEM_SCHEDULE,1,sizeof(schedcmd_t));
+        cmd->time = ev->time;
+        cmd->stripmask = ev->stripmask;
+        cmd->animation = ev->animation;
+        cmd->speed = ev->speed;
+        cmd->brightness = ev->brightness;
+        cmd->palette = ev->palette;
+        cmd->direction = ev->direction;
+        cmd->option = ev->option;
+        dq_enqueue(&group, &(cmd->link));
+
+        if (++(best->i) == best->n) {
+            runfill(st, best);
+        }
+    }
+
+    removed += flushgroup(st, &group);
+
+    stats_free(MEM_SCHEDULE, readers, (st->nruns ? st->nruns : 1) * sizeof(runreader_t));
+
+    return removed;
+}
+
+//
+// Finish compiling: merge, write the header, and clean up.
+// Returns -1 if anything went wrong.
+//
+int stream_finish(stream_t *st)
+{
+    streamhdr_t hdr;
+    int removed;
+    int res;
+
+    spillchunk(st);
+    stats_free(MEM_SCHEDULE, st->chunk, CHUNKEVENTS * sizeof(lsevent_t));
+    stats_free(MEM_SCHEDULE, st->tmp, CHUNKEVENTS * sizeof(lsevent_t));
+
+    removed = mergeruns(st);
+    flushout(st);
+
+    memset(&hdr,0,sizeof(hdr));
+    memcpy(hdr.magic, STREAMMAGIC, sizeof(hdr.magic));
+    hdr.events = st->events;
+    hdr.duration = st->prev.time;
+    if (st->idlename) {
+        strncpy(hdr.idlename, st->idlename, IDLENAMELEN-1);
+        hdr.idle = st->idle;
+    }
+    if (pwrite(st->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+        st->error = 1;
+    }
+
+    stats_count(CNT_FRAMES, st->events);
+
+    if (removed && !st->quiet) {
+        printf("* Optimized schedule: removed %d of %llu frames\n",removed,
+               (unsigned long long) (st->events + removed));
+    }
+    if (!st->quiet) printf("* Wrote %llu frames in %llu bytes (%.1f bytes/frame) from %d sorted run%s to %s\n",
+           (unsigned long long) st->events, (unsigned long long) (st->bytes + sizeof(hdr)),
+           st->events ? (double) st->bytes / (double) st->events : 0.0,
+           st->nruns, (st->nruns == 1) ? "" : "s", st->filename);
+
+    res = st->error ? -1 : 0;
+
+    fclose(st->spill);
+    close(st->fd);
+    free(st->runs);
+    free(st);
+
+    return res;
+}
+
+/*  *********************************************************************
+    *  Playback
+    ********************************************************************* */
+
+typedef struct reader_s {
+    script_t *script;
+    int fd;
+    uint8_t in[IOBUF];
+    int inlen, inpos;
+    int eof;
+
+    // Ring of decoded events.  The reader thread owns head and
+    // the player owns tail.
+    lsevent_t *ring;
+    uint64_t head;
+    uint64_t tail;
+    int done;
+    int stop;
+    uint64_t underruns;         // events late because the ring ran dry
+} reader_t;
+
+static int getbyte(reader_t *rd)
+{
+    if (rd->inpos == rd->inlen) {
+        if (rd->eof) {
+            return -1;
+        }
+        rd->inlen = read(rd->fd, rd->in, IOBUF);
+        rd->inpos = 0;
+        if (rd->inlen <= 0) {
+            rd->inlen = 0;
+            rd->eof = 1;
+            return -1;
+        }
+    }
+
+    return rd->in[rd->inpos++];
+}
+
+static int getvarint(reader_t *rd, uint64_t *v)
+{
+    uint64_t res = 0;
+    int shift = 0;
+    int b;
+
+    do {
+        if ((b = getbyte(rd)) < 0) {
+            return -1;
+        }
+        res |= ((uint64_t) (b & 0x7F)) << shift;
+        shift += 7;
+    } while ((b & 0x80) && (shift < 64));
+
+    *v = res;
+    return 0;
+}
+
+static int decode(reader_t *rd, lsevent_t *ev)
+{
+    uint64_t delta, v;
+    int mask;
+
+    if (getvarint(rd, &delta) < 0) {
+        return -1;
+    }
+    if ((mask = getbyte(rd)) < 0) {
+        return -1;
+    }
+
+    ev->time += (lstime_t) delta;
+
+#define DECFIELD(f,bit) if (mask & bit) { if (getvarint(rd, &v) < 0) return -1; ev->f = (uint32_t) v; }
+    DECFIELD(stripmask, F_STRIPMASK);
+    DECFIELD(animation, F_ANIMATION);
+    DECFIELD(speed, F_SPEED);
+    DECFIELD(brightness, F_BRIGHTNESS);
+    DECFIELD(palette, F_PALETTE);
+    DECFIELD(direction, F_DIRECTION);
+    DECFIELD(option, F_OPTION);
+#undef DECFIELD
+
+    return 0;
+}
+
+static void *readthread(void *arg)
+{
+    reader_t *rd = (reader_t *) arg;
+    lsevent_t ev;
+    struct timespec nap = {0, 1000000};
+
+    memset(&ev,0,sizeof(ev));
+
+    while (!__atomic_load_n(&(rd->stop), __ATOMIC_ACQUIRE)) {
+        uint64_t tail = __atomic_load_n(&(rd->tail), __ATOMIC_ACQUIRE);
+
+        if (rd->head - tail == RINGSIZE) {
+            nanosleep(&nap, NULL);      // ring full, the player is behind us
+            continue;
+        }
+
+        if (decode(rd, &ev) < 0) {
+            break;
+        }
+
+        // Catch up to the start cue without bothering the player.
+        if (ev.time < rd->script->start_cue) {
+            continue;
+        }
+
+        rd->ring[rd->head & (RINGSIZE-1)] = ev;
+        __atomic_store_n(&(rd->head), rd->head + 1, __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(&(rd->done), 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+//
+// Open a compiled stream for 'splay'.  The config is loaded only
+// for animation names, the stream has everything else.
+//
+int stream_attach(script_t *script, char *configfilename, char *filename)
+{
+    streamhdr_t hdr;
+    script_t *defs;
+    int errors;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr,"Could not open %s : %s\n",filename,strerror(errno));
+        return -1;
+    }
+
+    if ((read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) || (memcmp(hdr.magic, STREAMMAGIC, sizeof(hdr.magic)) != 0)) {
+        fprintf(stderr,"%s is not a compiled lightscript stream\n",filename);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    defs = load_config(configfilename, &errors);
+    if (defs) {
+        import_t *imp = (import_t *) stats_calloc(MEM_MODULES,1,sizeof(import_t));
+        imp->defs = defs;
+        dq_enqueue(&(script->imports), &(imp->link));
+    }
+
+    if (hdr.idlename[0]) {
+        symbol_t *sym;
+
+        hdr.idlename[IDLENAMELEN-1] = 0;
+        script->idleanimation = strdup(hdr.idlename);
+        sym = newsym(&(script->symbols), script->idleanimation);
+        sym->wvalues[0] = hdr.idle;
+        sym->nvalues = 1;
+    }
+
+    script->streamfile = filename;
+
+    printf("* %s: %llu frames, %.3f seconds\n",filename,(unsigned long long) hdr.events,LSTIME_SECS(hdr.duration));
+
+    return 0;
+}
+
+void play_stream(script_t *script)
+{
+    reader_t *rd;
+    pthread_t thread;
+    lstime_t start_time;
+    struct timespec nap = {0, 1000000};
+    int starved = 0;
+    lstime_t lastsent = 0;      // time of the last event sent
+    int sentany = 0;
+
+    rd = (reader_t *) calloc(1,sizeof(reader_t));
+    rd->script = script;
+    rd->ring = (lsevent_t *) malloc(RINGSIZE * sizeof(lsevent_t));
+
+    rd->fd = open(script->streamfile, O_RDONLY);
+    if ((rd->fd < 0) || (lseek(rd->fd, sizeof(streamhdr_t), SEEK_SET) < 0)) {
+        fprintf(stderr,"Could not open %s : %s\n",script->streamfile,strerror(errno));
+        goto out;
+    }
+
+    if (pthread_create(&thread, NULL, readthread, rd) != 0) {
+        perror("Could not start the stream reader");
+        close(rd->fd);
+        goto out;
+    }
+
+    // Let the reader get ahead before the clock starts.
+    while (!__atomic_load_n(&(rd->done), __ATOMIC_ACQUIRE) &&
+           (__atomic_load_n(&(rd->head), __ATOMIC_ACQUIRE) < RINGSIZE/2)) {
+        nanosleep(&nap, NULL);
+    }
+
+    start_time = clock_now() + script->start_offset;
+
+    for (;;) {
+        uint64_t head = __atomic_load_n(&(rd->head), __ATOMIC_ACQUIRE);
+        lstime_t now = clock_now() - start_time + script->start_cue + script->latency;
+
+        if (rd->tail == head) {
+            if (__atomic_load_n(&(rd->done), __ATOMIC_ACQUIRE) &&
+                (__atomic_load_n(&(rd->head), __ATOMIC_ACQUIRE) == rd->tail)) {
+                break;
+            }
+
+            // Send what is held once, then nap rather than spin: at
+            // real-time priority spinning could keep the reader off
+            // the CPU it needs to fill the ring.
+            if (!starved) {
+                sink_flush(script->sink);
+                starved = 1;
+            }
+            nanosleep(&nap, NULL);
+        } else {
+            lsevent_t *ev = &(rd->ring[rd->tail & (RINGSIZE-1)]);
+
+            // The ring ran dry.  That only matters if the event we
+            // were waiting for was already due, and it counts once.
+            if (starved) {
+                if (now > ev->time) {
+                    rd->underruns++;
+                }
+                starved = 0;
+            }
+
+            if (now >= ev->time) {
+                unsigned int anim = ev->animation;
+
+                // An event at another time starts a new group.
+                if (sentany && (ev->time != lastsent)) {
+                    sink_flush(script->sink);
+                }
+                lastsent = ev->time;
+                sentany = 1;
+
+                if (ev->direction) anim |= 0x8000;
+
+                printevent(script, ev);
+                send_message(script, ev->stripmask, anim, ev->speed, ev->option, ev->palette);
+                __atomic_store_n(&(rd->tail), rd->tail + 1, __ATOMIC_RELEASE);
+            } else {
+                lstime_t next = ev->time;
+
+                sink_flush(script->sink);
+                if ((script->end_cue != 0) && (script->end_cue < next)) {
+                    next = script->end_cue + 1;
+                }
+                clock_wait(start_time + next - script->start_cue - script->latency);
+                latency_poll(script);
+            }
+        }
+
+        if ((script->end_cue != 0) && (now > script->end_cue)) {
+            break;
+        }
+
+        if (script->abort) {
+            break;
+        }
+    }
+
+    sink_flush(script->sink);
+
+    __atomic_store_n(&(rd->stop), 1, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    close(rd->fd);
+
+    if (rd->underruns) {
+        printf("Warning: the stream reader fell behind %llu times\n",(unsigned long long) rd->underruns);
+    }
+
+out:
+    free(rd->ring);
+    free(rd);
+}
@@ -7,6 +7,7 @@ extern int debug;
 
 extern "C" {
     int playMusicFile(const char *filename, int (*callback)(double time), double start_cue);
+    int decodeMusicFile(const char *filename, float **samples, long *nsamples, double *rate);
 };
 
 int playMusicFile(const char *filename, int (*callback)(double time),double start_cue)
@@ -59,6 +60,58 @@ int playMusicFile(const char *filename, int (*callback)(double time),double star
 }
 
 
+//
+// Decode the whole music file into memory as mono float samples,
+// for the analysis code.  The caller frees the sample buffer.
+//
+int decodeMusicFile(const char *filename, float **samples, long *nsamples, double *rate)
+{
+    NSString *path = [NSString stringWithFormat:@"file://%@", [NSString stringWithCString:filename encoding:NSUTF8StringEncoding]];
+    NSURL *soundUrl = [NSURL URLWithString:path];
+    NSError *error = nil;
+    AVAudioFile *file;
+    AVAudioPCMBuffer *buffer;
+    AVAudioFrameCount frames;
+    AVAudioChannelCount channels;
+    float *mono;
+
+    file = [[AVAudioFile alloc] initForReading:soundUrl error:&error];
+    if (error || (file == nil)) {
+        NSLog(@"Error opening music file: %@", [error localizedDescription]);
+        return -1;
+    }
+
+    frames = (AVAudioFrameCount) file.length;
+    buffer = [[AVAudioPCMBuffer alloc] initWithPCMFormat:file.processingFormat frameCapacity:frames];
+
+    if (![file readIntoBuffer:buffer error:&error]) {
+        NSLog(@"Error decoding music file: %@", [error localizedDescription]);
+        return -1;
+    }
+
+    frames = buffer.frameLength;
+    channels = file.processingFormat.channelCount;
+
+    mono = (float *) calloc(frames ? frames : 1, sizeof(float));
+    if (mono == NULL) {
+        return -1;
+    }
+
+    // processingFormat is always deinterleaved float, mix down to mono
+    for (AVAudioChannelCount c = 0; c < channels; c++) {
+        const float *chan = buffer.floatChannelData[c];
+        for (AVAudioFrameCount i = 0; i < frames; i++) {
+            mono[i] += chan[i] / (float) channels;
+        }
+    }
+
+    *samples = mono;
+    *nsamples = (long) frames;
+    *rate = file.processingFormat.sampleRate;
+
+    return 0;
+}
+
 
 #ifdef TESTPROG
 int main(int argc, char *argv[])
@@ -22,147 +22,303 @@
 #include "lightscript.h"
 
 
-extern void yyparse(void);
+extern int yyget_lineno(void *scanner);
+extern void yyerror(void *scanner, lsparse_t *ps, const char *str);
 
-extern int yylineno;
-extern FILE *yyin;
-node_t *tree = NULL;
+#define LINENO(ps) yyget_lineno((ps)->scanner)
 
+//
+// Convert [minutes:]seconds[.fraction] to ticks.  The digits are
+// converted directly, so "0.1" is exactly 100000000 and never
+// goes near a double.
+//
+lstime_t parsetime(const char *str)
+{
+    lstime_t minutes = 0;
+    lstime_t seconds = 0;
+    lstime_t frac = 0;
+    lstime_t scale = LSTIME_SECOND;
+    const char *p = str;
+
+    if (strchr(p,':')) {
+        while ((*p >= '0') && (*p <= '9')) minutes = minutes*10 + (*p++ - '0');
+        p++;
+    }
+
+    while ((*p >= '0') && (*p <= '9')) seconds = seconds*10 + (*p++ - '0');
+
+    if (*p == '.') {
+        p++;
+        while ((*p >= '0') && (*p <= '9')) {
+            scale /= 10;
+            frac += (*p++ - '0') * scale;
+        }
+    }
+
+    return (minutes*60 + seconds) * LSTIME_SECOND + frac;
+}
 
 
-node_t *newnode(node_t *l,node_t *r)
+static inline void *allocnode(lsparse_t *ps, size_t size)
 {
-    node_t *n = (node_t *) calloc(1,sizeof(node_t));
+    ps->nodes++;
+    return stats_calloc(MEM_PARSE,1,size);
+}
+
+node_t *newnode(lsparse_t *ps, node_t *l,node_t *r)
+{
+    node_t *n = (node_t *) allocnode(ps,sizeof(node_t));
 
     n->left = l;
     n->right = r;
     n->type = nNODE;
-    n->line = yylineno;
+    n->line = LINENO(ps);
 
     return n;
 }
 
-node_t *newidlist(char *idstr,node_t *rest)
+node_t *newidlist(lsparse_t *ps, char *idstr,node_t *rest)
 {
-    idlist_t *idl = (idlist_t *) calloc(1,sizeof(idlist_t));
+    idlist_t *idl = (idlist_t *) allocnode(ps,sizeof(idlist_t));
 
     idl->type = nIDLIST;
     idl->next = rest;
     idl->idstr = idstr;
-    idl->line = yylineno;
+    idl->line = LINENO(ps);
 
     return (node_t *) idl;
 }
 
-node_t *newoption_idl(int opttype, node_t *optval)
+node_t *newoption_idl(lsparse_t *ps, int opttype, node_t *optval)
 {
-    option_t *opt = (option_t *) calloc(1,sizeof(option_t));
+    option_t *opt = (option_t *) allocnode(ps,sizeof(option_t));
 
     opt->type = nOPTION;
     opt->opttype = opttype;
     opt->lvalue = optval;
-    opt->line = yylineno;
+    opt->line = LINENO(ps);
 
     return (node_t *) opt;
 }
 
-node_t *newoption_w(int opttype, int optval)
+node_t *newoption_w(lsparse_t *ps, int opttype, int optval)
 {
-    option_t *opt = (option_t *) calloc(1,sizeof(option_t));
+    option_t *opt = (option_t *) allocnode(ps,sizeof(option_t));
 
     opt->type = nOPTION;
     opt->opttype = opttype;
     opt->wvalue = optval;
-    opt->line = yylineno;
+    opt->line = LINENO(ps);
 
     return (node_t *) opt;
 }
 
-node_t *newoption_f(int opttype, double optval)
+node_t *newoption_t(lsparse_t *ps, int opttype, lstime_t optval)
 {
-    option_t *opt = (option_t *) calloc(1,sizeof(option_t));
+    option_t *opt = (option_t *) allocnode(ps,sizeof(option_t));
 
     opt->type = nOPTION;
     opt->opttype = opttype;
-    opt->fvalue = optval;
-    opt->line = yylineno;
+    opt->tvalue = optval;
+    opt->line = LINENO(ps);
 
     return (node_t *) opt;
 }
 
 
-node_t *newcmd_sched(int cmdtype, double from, double to, node_t *opts)
+node_t *newcmd_sched(lsparse_t *ps, int cmdtype, lstime_t from, lstime_t to, node_t *opts)
 {
-    scriptcmd_t *sc = (scriptcmd_t *) calloc(1,sizeof(scriptcmd_t));
+    scriptcmd_t *sc = (scriptcmd_t *) allocnode(ps,sizeof(scriptcmd_t));
 
     sc->type = nSCRIPT;
     sc->cmdtype = cmdtype;
     sc->from = from;
     sc->to = to;
     sc->options = opts;
-    sc->line = yylineno;
+    sc->line = LINENO(ps);
 
     return (node_t *) sc;
 }
 
-node_t *newcmd_str(int cmdtype, char *str)
+node_t *newcmd_str(lsparse_t *ps, int cmdtype, char *str)
 {
-    scriptcmd_t *sc = (scriptcmd_t *) calloc(1,sizeof(scriptcmd_t));
+    scriptcmd_t *sc = (scriptcmd_t *) allocnode(ps,sizeof(scriptcmd_t));
 
     sc->type = nSCRIPT;
     sc->cmdtype = cmdtype;
     sc->str = str;
-    sc->line = yylineno;
+    sc->line = LINENO(ps);
 
     return (node_t *) sc;
 }
 
 
-node_t *newcmd_defidl(char *str, node_t *idl)
+node_t *newcmd_defidl(lsparse_t *ps, char *str, node_t *idl)
 {
-    scriptcmd_t *sc = (scriptcmd_t *) calloc(1,sizeof(scriptcmd_t));
+    scriptcmd_t *sc = (scriptcmd_t *) allocnode(ps,sizeof(scriptcmd_t));
 
     sc->type = nSCRIPT;
     sc->cmdtype = sDEFINE;
     sc->str = str;
     sc->options = idl;
-    sc->line = yylineno;
+    sc->line = LINENO(ps);
 
     return (node_t *) sc;
 }
 
-node_t *newcmd_defmacro(char *str, node_t *idl)
+node_t *newcmd_defmacro(lsparse_t *ps, char *str, node_t *idl)
 {
-    scriptcmd_t *sc = (scriptcmd_t *) calloc(1,sizeof(scriptcmd_t));
+    scriptcmd_t *sc = (scriptcmd_t *) allocnode(ps,sizeof(scriptcmd_t));
 
     sc->type = nSCRIPT;
     sc->cmdtype = sMACRO;
     sc->str = str;
     sc->options = idl;
-    sc->line = yylineno;
+    sc->line = LINENO(ps);
 
     return (node_t *) sc;
 }
 
+//
+// repeat { body } every <interval> [from <start>] until <end>
+//
+node_t *newcmd_repeat(lsparse_t *ps, node_t *body, lstime_t every, lstime_t from, lstime_t until)
+{
+    scriptcmd_t *sc = (scriptcmd_t *) allocnode(ps,sizeof(scriptcmd_t));
 
-node_t *newcmd_defval(char *str, int val)
+    if (every <= 0) {
+        yyerror(ps->scanner, ps, "repeat interval must be more than zero");
+    }
+
+    sc->type = nSCRIPT;
+    sc->cmdtype = sREPEAT;
+    sc->options = body;
+    sc->every = every;
+    sc->from = from;
+    sc->to = until;
+    sc->line = LINENO(ps);
+
+    return (node_t *) sc;
+}
+
+//
+// at beat <n> ..., the time comes from the music's beat grid
+// when the commands are found (see beat_time()).
+//
+node_t *newcmd_beat(lsparse_t *ps, int beat, node_t *opts)
+{
+    scriptcmd_t *sc = (scriptcmd_t *) allocnode(ps,sizeof(scriptcmd_t));
+
+    if (beat < 1) {
+        yyerror(ps->scanner, ps, "beats are numbered from 1");
+    }
+
+    sc->type = nSCRIPT;
+    sc->cmdtype = sATBEAT;
+    sc->val = beat;
+    sc->options = opts;
+    sc->line = LINENO(ps);
+
+    return (node_t *) sc;
+}
+
+
+node_t *newcmd_defval(lsparse_t *ps, char *str, int val)
 {
-    scriptcmd_t *sc = (scriptcmd_t *) calloc(1,sizeof(scriptcmd_t));
+    scriptcmd_t *sc = (scriptcmd_t *) allocnode(ps,sizeof(scriptcmd_t));
 
     sc->type = nSCRIPT;
     sc->cmdtype = sDEFINE;
     sc->str = str;
     sc->val = val;
-    sc->line = yylineno;
+    sc->line = LINENO(ps);
 
     return (node_t *) sc;
 }
 
 
+//
+// Names in an include statement are relative to the file that
+// contains the statement.
+//
+char *includepath(lsparse_t *ps, char *str)
+{
+    char *slash;
+    char *path;
+    int dirlen;
+
+    if ((str[0] == '/') || !ps->filename || !(slash = strrchr(ps->filename,'/'))) {
+        return str;
+    }
+
+    dirlen = (int) (slash - ps->filename) + 1;
+    path = (char *) malloc(dirlen + strlen(str) + 1);
+    memcpy(path, ps->filename, dirlen);
+    strcpy(path + dirlen, str);
+
+    free(str);
+    return path;
+}
+
+//
+// Give back a tree and the names in it.  Symbols and macros point
+// into the tree that defined them, so only free a tree that nothing
+// was defined from.
+//
+void freetree(node_t *n)
+{
+    while (n && (n->type == nNODE)) {
+        node_t *next = n->right;
+
+        freetree(n->left);
+        stats_free(MEM_PARSE,n,sizeof(node_t));
+        n = next;
+    }
+
+    if (!n) {
+        return;
+    }
+
+    switch (n->type) {
+        case nIDLIST:
+            while (n) {
+                idlist_t *idl = (idlist_t *) n;
+
+                n = idl->next;
+                free(idl->idstr);
+                stats_free(MEM_PARSE,idl,sizeof(idlist_t));
+            }
+            break;
+        case nOPTION:
+        {
+            option_t *opt = (option_t *) n;
+
+            freetree(opt->lvalue);
+            stats_free(MEM_PARSE,opt,sizeof(option_t));
+        }
+        break;
+        case nSCRIPT:
+        {
+            scriptcmd_t *sc = (scriptcmd_t *) n;
+
+            freetree(sc->options);
+            free(sc->str);
+            stats_free(MEM_PARSE,sc,sizeof(scriptcmd_t));
+        }
+        break;
+    }
+}
 
 
 void printtree(node_t *n, int depth)
 {
+    // Down a statement list in a loop, not a call per statement.
+    while (n && (n->type == nNODE)) {
+        printf("%*s",depth*3,"");
+        printtree(n->left,depth+1);
+        n = n->right;
+    }
+
     if (!n) {
         return;
     }
@@ -170,11 +326,6 @@ void printtree(node_t *n, int depth)
     printf("%*s",depth*3,"");
 
     switch (n->type) {
-        case nNODE:
-//            printf("Node\n");
-            printtree(n->left,depth+1);
-            printtree(n->right,depth);
-            break;
         case nIDLIST:
         {
             idlist_t *idl = (idlist_t *) n;
@@ -210,7 +361,7 @@ void printtree(node_t *n, int depth)
                     printf("Brightness %u\n",opt->wvalue);
                     break;
                 case oDELAY:
-                    printf("Delay %5.3f\n",opt->fvalue);
+                    printf("Delay %5.3f\n",LSTIME_SECS(opt->tvalue));
                     break;
                 case oCOUNT:
                     printf("Count %u\n",opt->wvalue);
@@ -229,11 +380,15 @@ void printtree(node_t *n, int depth)
             printf("(%d)ScriptCmd" ,sc->line);
             switch (sc->cmdtype) {
                 case sFROM:
-                    printf("From %5.3f to %5.3f\n",sc->from,sc->to);
+                    printf("From %5.3f to %5.3f\n",LSTIME_SECS(sc->from),LSTIME_SECS(sc->to));
                     printtree(sc->options,depth);
                     break;
                 case sAT:
-                    printf("At %5.3f\n",sc->from);
+                    printf("At %5.3f\n",LSTIME_SECS(sc->from));
+                    printtree(sc->options,depth);
+                    break;
+                case sATBEAT:
+                    printf("At beat %d\n",sc->val);
                     printtree(sc->options,depth);
                     break;
                 case sMUSIC:
@@ -254,6 +409,14 @@ void printtree(node_t *n, int depth)
                     printf("Macro %s\n",sc->str);
                     printtree(sc->options,depth+1);
                     break;
+                case sINCLUDE:
+                    printf("Include %s\n",sc->str);
+                    break;
+                case sREPEAT:
+                    printf("Repeat every %5.3f from %5.3f until %5.3f\n",LSTIME_SECS(sc->every),
+                           LSTIME_SECS(sc->from),LSTIME_SECS(sc->to));
+                    printtree(sc->options,depth+1);
+                    break;
                     
             }
         }
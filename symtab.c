@@ -20,6 +20,8 @@
 
 #include "lightscript.h"
 
+#define MAXMACRODEPTH   64      // macros calling macros, deeper is a loop
+
 char *findval(dqueue_t *tab, unsigned int val)
 {
     dqueue_t *qb;
@@ -59,6 +61,72 @@ symbol_t *findsym(dqueue_t *tab, char *str)
 }
 
 
+//
+// Look up a symbol or macro in the script, then in the modules it
+// includes.  Included modules are shared, so we never copy their
+// tables into the script, we just search them.
+//
+symbol_t *lookupsym(script_t *script, char *str)
+{
+    symbol_t *sym;
+    dqueue_t *qb;
+
+    sym = findsym(&(script->symbols), str);
+    if (sym) {
+        return sym;
+    }
+
+    for (qb = script->imports.dq_next; qb != &(script->imports); qb = qb->dq_next) {
+        sym = lookupsym(((import_t *) qb)->defs, str);
+        if (sym) {
+            return sym;
+        }
+    }
+
+    return NULL;
+}
+
+symbol_t *lookupmacro(script_t *script, char *str)
+{
+    symbol_t *sym;
+    dqueue_t *qb;
+
+    sym = findsym(&(script->macros), str);
+    if (sym) {
+        return sym;
+    }
+
+    for (qb = script->imports.dq_next; qb != &(script->imports); qb = qb->dq_next) {
+        sym = lookupmacro(((import_t *) qb)->defs, str);
+        if (sym) {
+            return sym;
+        }
+    }
+
+    return NULL;
+}
+
+char *lookupval(script_t *script, unsigned int val)
+{
+    char *name;
+    dqueue_t *qb;
+
+    name = findval(&(script->symbols), val);
+    if (name) {
+        return name;
+    }
+
+    for (qb = script->imports.dq_next; qb != &(script->imports); qb = qb->dq_next) {
+        name = lookupval(((import_t *) qb)->defs, val);
+        if (name) {
+            return name;
+        }
+    }
+
+    return NULL;
+}
+
+
 symbol_t *newsym(dqueue_t *tab, char *str)
 {
     symbol_t *sym;
@@ -71,7 +139,7 @@ symbol_t *newsym(dqueue_t *tab, char *str)
 
     // Otherwise make a new symbol
     // calloc() takes care of zeroing fields.
-    sym = (symbol_t *) calloc(1,sizeof(symbol_t));
+    sym = (symbol_t *) stats_calloc(MEM_SYMBOLS,1,sizeof(symbol_t));
 
     sym->name = str;
 
@@ -121,7 +189,7 @@ void addsymp(dqueue_t *tab, char *str, void *ptr)
     }
 
     // Otherwise make a new symbol
-    sym = (symbol_t *) calloc(1,sizeof(symbol_t));
+    sym = (symbol_t *) stats_calloc(MEM_SYMBOLS,1,sizeof(symbol_t));
 
     sym->name = str;
     sym->pvalue = ptr;
@@ -159,7 +227,7 @@ static void defsym(script_t *script, scriptcmd_t *sc)
         idl = (idlist_t *) sc->options;
         while (idl) {
             assert(idl->type == nIDLIST);
-            s = findsym(&(script->symbols),idl->idstr);
+            s = lookupsym(script,idl->idstr);
             if (!s) {
                 printf("Warning: Symbol %s not defined\n",idl->idstr);
             } else {
@@ -186,17 +254,22 @@ static void defmacro(script_t *script, scriptcmd_t *sc)
 
 static void defines1(script_t *script, node_t *n)
 {
-    scriptcmd_t *sc = (scriptcmd_t *) n;
-    
+    scriptcmd_t *sc;
+
+    // Statement lists are chains of nNODEs to the right.  Follow
+    // the chain in a loop, so only a statement costs a call.
+    while (n && (n->type == nNODE)) {
+        defines1(script, n->left);
+        n = n->right;
+    }
+
     if (n == NULL) {
         return;
     }
-    
+
+    sc = (scriptcmd_t *) n;
+
     switch (n->type) {
-        case nNODE:
-            defines1(script, n->left);
-            defines1(script, n->right);
-            break;
         case nSCRIPT:
             switch (sc->cmdtype) {
                 case sDEFINE:
@@ -211,6 +284,9 @@ static void defines1(script_t *script, node_t *n)
                 case sMACRO:
                     defmacro(script,sc);
                     break;
+                case sINCLUDE:
+                    include_module(script,sc->str);
+                    break;
             }
 
             break;
@@ -267,7 +343,7 @@ static void collectids(script_t *script, symbol_t *dest, idlist_t *list)
     while (list) {
         assert(list->type == nIDLIST);
 
-        sym = findsym(&(script->symbols),list->idstr);
+        sym = lookupsym(script,list->idstr);
 
         if (sym) {
             appendvals(dest,sym);
@@ -279,19 +355,29 @@ static void collectids(script_t *script, symbol_t *dest, idlist_t *list)
     }
 }
 
-static void commands1(script_t *script, double basetime, node_t *n);
+static void commands1(script_t *script, lstime_t basetime, node_t *n);
 
-static void addcommand(script_t *script, double basetime, scriptcmd_t *sc)
+static void addcommand(script_t *script, lstime_t basetime, scriptcmd_t *sc)
 {
     command_t *cmd;
     option_t *opt;
     node_t *n;
     symbol_t *macro;
+    lstime_t from = sc->from;
+    lstime_t to = sc->to;
+
+    if (sc->cmdtype == sATBEAT) {
+        if (beat_time(script, sc->val, &from) < 0) {
+            printf("Warning: beat %d at line %d is not in the beat grid, ignored\n",sc->val,sc->line);
+            return;
+        }
+        to = from;
+    }
 
-    cmd = (command_t *) calloc(1,sizeof(command_t));
+    cmd = (command_t *) stats_calloc(MEM_COMMANDS,1,sizeof(command_t));
 
-    cmd->from = sc->from + basetime;
-    cmd->to = sc->to + basetime;
+    cmd->from = from + basetime;
+    cmd->to = to + basetime;
 
     cmd->cmdtype = CMD_AT;
     if (cmd->from != cmd->to) cmd->cmdtype = CMD_FROM;
@@ -314,23 +400,30 @@ static void addcommand(script_t *script, double basetime, scriptcmd_t *sc)
                     break;
                 case oMACRO:
                     // Expand macro here.
-                    macro = findsym(&(script->macros),((idlist_t *) opt->lvalue)->idstr);
-                    if (macro) {
+                    macro = lookupmacro(script,((idlist_t *) opt->lvalue)->idstr);
+                    if (macro && (script->macrodepth == MAXMACRODEPTH)) {
+                        printf("Warning: Macro '%s' nested more than %d deep, does it call itself?\n",
+                               ((idlist_t *) opt->lvalue)->idstr, MAXMACRODEPTH);
+                    } else if (macro) {
                         int i;
+                        script->macrodepth++;
                         if (cmd->count <= 1) {
+                            stats_count(CNT_MACROS, 1);
                             commands1(script, cmd->from, (node_t *) macro->pvalue);
                         } else {
                             for (i = 0; i < cmd->count; i++) {
-                                double t = cmd->from + (cmd->to - cmd->from) * ((double) i / (double) (cmd->count-1));
+                                lstime_t t = cmd->from + (cmd->to - cmd->from) * i / (cmd->count-1);
+                                stats_count(CNT_MACROS, 1);
                                 commands1(script, t, (node_t *) macro->pvalue);
                             }
                         }
+                        script->macrodepth--;
                     } else {
                         printf("Warning: Macro '%s' not found\n",
                                ((idlist_t *) opt->lvalue)->idstr);
                     }
                     // but this is not really a command of its own.
-                    free(cmd);
+                    stats_free(MEM_COMMANDS,cmd,sizeof(command_t));
                     cmd = NULL;
                     break;
                 case oDO:
@@ -344,7 +437,7 @@ static void addcommand(script_t *script, double basetime, scriptcmd_t *sc)
                     cmd->speed = opt->wvalue;
                     break;
                 case oDELAY:
-                    cmd->delay = opt->fvalue;
+                    cmd->delay = opt->tvalue;
                     break;
                 case oBRIGHTNESS:
                     cmd->brightness = opt->wvalue;
@@ -362,7 +455,7 @@ static void addcommand(script_t *script, double basetime, scriptcmd_t *sc)
                         symbol_t *sym;
                         //printf("Looking up %s\n",((idlist_t *) opt->lvalue)->idstr);
 
-                        sym = findsym(&(script->symbols),((idlist_t *) opt->lvalue)->idstr);
+                        sym = lookupsym(script,((idlist_t *) opt->lvalue)->idstr);
                         if (sym) cmd->palette = getsymval(sym);
                     } else {
                         cmd->palette = opt->wvalue;
@@ -388,30 +481,75 @@ static void addcommand(script_t *script, double basetime, scriptcmd_t *sc)
     }
 
     if (cmd) {
+        stats_count(CNT_COMMANDS, 1);
         dq_enqueue(&(script->commands),&(cmd->link));
     }
 }
 
+//
+// The body of a repeat is compiled once, like any other commands,
+// then moved off to the repeat.  Its times are from the start of
+// one pass.
+//
+static void addrepeat(script_t *script, lstime_t basetime, scriptcmd_t *sc)
+{
+    repeat_t *rep;
+    dqueue_t *mark;
+
+    if (script->repeating) {
+        printf("Warning: repeat at line %d is inside another repeat, ignored\n",sc->line);
+        return;
+    }
+
+    rep = (repeat_t *) stats_calloc(MEM_COMMANDS,1,sizeof(repeat_t));
+    rep->from = sc->from + basetime;
+    rep->until = sc->to + basetime;
+    rep->every = sc->every;
+    dq_init(&(rep->commands));
+
+    mark = script->commands.dq_prev;
+
+    script->repeating = 1;
+    commands1(script, 0, sc->options);
+    script->repeating = 0;
+
+    while (mark->dq_next != &(script->commands)) {
+        dqueue_t *dq = mark->dq_next;
+
+        dq_dequeue(dq);
+        dq_enqueue(&(rep->commands),dq);
+    }
+
+    dq_enqueue(&(script->repeats),&(rep->link));
+}
 
-static void commands1(script_t *script, double basetime, node_t *n)
+static void commands1(script_t *script, lstime_t basetime, node_t *n)
 {
-    scriptcmd_t *sc = (scriptcmd_t *) n;
-    
+    scriptcmd_t *sc;
+
+    // Same as defines1(), a loop down the list.
+    while (n && (n->type == nNODE)) {
+        commands1(script, basetime, n->left);
+        n = n->right;
+    }
+
     if (n == NULL) {
         return;
     }
-    
+
+    sc = (scriptcmd_t *) n;
+
     switch (n->type) {
-        case nNODE:
-            commands1(script, basetime, n->left);
-            commands1(script, basetime, n->right);
-            break;
         case nSCRIPT:
             switch (sc->cmdtype) {
                 case sAT:
                 case sFROM:
+                case sATBEAT:
                     addcommand(script,basetime, sc);
                     break;
+                case sREPEAT:
+                    addrepeat(script,basetime, sc);
+                    break;
                 default:
                     break;
             }
@@ -434,9 +572,9 @@ void printcmdtab(script_t *script)
 
         printf("%-8.8s ",cmdnames[cmd->cmdtype]);
 
-        printf("From %.3f  To %.3f ",cmd->from,cmd->to);
+        printf("From %.3f  To %.3f ",LSTIME_SECS(cmd->from),LSTIME_SECS(cmd->to));
         printf("Speed %u  Bright %u  Count %u  Delay %.3f  ",
-               cmd->speed,cmd->brightness,cmd->count,cmd->delay);
+               cmd->speed,cmd->brightness,cmd->count,LSTIME_SECS(cmd->delay));
 
         printf("Strips=[ ");
         for (i = 0; i < cmd->strips.nvalues; i++) printf("%d ",cmd->strips.wvalues[i]+1);